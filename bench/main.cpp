@@ -0,0 +1,330 @@
+// SPDX-License-Identifier: MIT
+// Author: Diego Iastrubni <diegoiast@gmail.com>
+
+#include <KodoTerm/KodoTerm.hpp>
+#include <QApplication>
+#include <QCommandLineParser>
+#include <QElapsedTimer>
+#include <QEventLoop>
+#include <QFile>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QTextStream>
+#include <QTimer>
+#include <algorithm>
+#include <functional>
+#include <vector>
+
+// Times every paint, this is where the back buffer gets rendered
+class BenchTerminal : public KodoTerm {
+  public:
+    using KodoTerm::KodoTerm;
+
+    std::vector<qint64> paintTimes;
+    std::function<void()> painted;
+
+  protected:
+    void paintEvent(QPaintEvent *event) override {
+        QElapsedTimer timer;
+        timer.start();
+        KodoTerm::paintEvent(event);
+        paintTimes.push_back(timer.nsecsElapsed());
+        if (painted) {
+            painted();
+        }
+    }
+};
+
+struct Workload {
+    const char *name;
+    QByteArray (*generate)(qsizetype size);
+};
+
+static QByteArray asciiFlood(qsizetype size) {
+    QByteArray data;
+    data.reserve(size + 128);
+    for (int line = 0; data.size() < size; ++line) {
+        for (int i = 0; i < 100; ++i) {
+            data.append(char('!' + (line + i) % 94));
+        }
+        data.append("\r\n");
+    }
+    return data;
+}
+
+static QByteArray sgrTruecolor(qsizetype size) {
+    QByteArray data;
+    data.reserve(size + 128);
+    for (int n = 0; data.size() < size; ++n) {
+        data.append(QByteArray("\033[38;2;") + QByteArray::number(n * 7 % 256) + ';' +
+                    QByteArray::number(n * 13 % 256) + ';' + QByteArray::number(n * 29 % 256) +
+                    "m\033[48;2;" + QByteArray::number(n * 3 % 64) + ";0;" +
+                    QByteArray::number(n * 5 % 64) + 'm');
+        data.append((n % 3) ? "\033[1mword\033[22m" : "\033[3mword\033[23m");
+        data.append((n % 12 == 11) ? "\033[0m\r\n" : " ");
+    }
+    return data;
+}
+
+static QByteArray altScreenRedraw(qsizetype size) {
+    // A full screen TUI repainting every row in place, like htop or a text editor
+    QByteArray data;
+    data.reserve(size + 8192);
+    data.append("\033[?1049h");
+    for (int frame = 0; data.size() < size; ++frame) {
+        data.append("\033[H");
+        for (int row = 0; row < 50; ++row) {
+            data.append("\033[" + QByteArray::number(row + 1) + ";1H");
+            data.append("\033[3" + QByteArray::number((frame + row) % 8) + 'm');
+            data.append(QByteArray::number(frame).rightJustified(8, ' '));
+            data.append(" | ");
+            for (int i = 0; i < 60; ++i) {
+                data.append(char('a' + (frame + row + i) % 26));
+            }
+            data.append("\033[0m\033[K");
+        }
+    }
+    data.append("\033[?1049l");
+    return data;
+}
+
+static QByteArray wideText(qsizetype size) {
+    static const char *words[] = {"漢字", "かな", "カタカナ", "한국어", "😀", "🚀", "👍🏽",
+                                  "é", "text", "中文字符", "🇮🇱"};
+    QByteArray data;
+    data.reserve(size + 128);
+    for (int n = 0; data.size() < size; ++n) {
+        data.append(words[n % (sizeof(words) / sizeof(words[0]))]);
+        data.append((n % 16 == 15) ? "\r\n" : " ");
+    }
+    return data;
+}
+
+static QByteArray boxDrawing(qsizetype size) {
+    static const char *lines[] = {
+        "┌────────┬────────┬────────┐ ╔════════╦════════╗ ▁▂▃▄▅▆▇█",
+        "│ name   │ value  │ state  │ ║ ░░░░░░ ║ ▒▒▒▒▒▒ ║ █▇▆▅▄▃▂▁",
+        "├────────┼────────┼────────┤ ╠════════╬════════╣ ▏▎▍▌▋▊▉█",
+        "└────────┴────────┴────────┘ ╚════════╩════════╝ ▓▓▓▓▓▓▓▓",
+    };
+    QByteArray data;
+    data.reserve(size + 256);
+    for (int n = 0; data.size() < size; ++n) {
+        data.append(lines[n % 4]);
+        data.append("\r\n");
+    }
+    return data;
+}
+
+static const Workload workloads[] = {
+    {"ascii", asciiFlood},
+    {"sgr", sgrTruecolor},
+    {"altscreen", altScreenRedraw},
+    {"wide", wideText},
+    {"box", boxDrawing},
+};
+
+static double percentile(std::vector<qint64> values, double p) {
+    if (values.empty()) {
+        return 0;
+    }
+    std::sort(values.begin(), values.end());
+    size_t i = std::min(values.size() - 1, (size_t)(p * (values.size() - 1) + 0.5));
+    return values[i] / 1000000.0;
+}
+
+static QJsonObject runWorkload(BenchTerminal &term, const Workload &workload, qsizetype size,
+                               qsizetype chunkSize) {
+    static int serial = 0;
+    const QByteArray data = workload.generate(size);
+
+    term.resetTerminal();
+    QApplication::processEvents();
+    term.paintTimes.clear();
+    term.resetStats();
+    size_t peakScrollback = 0;
+    term.painted = [&]() {
+        peakScrollback = std::max(peakScrollback, term.scrollbackMemoryUsage());
+    };
+
+    // The terminal reports the marker through cwdChanged once everything before it is parsed
+    const QString marker = QString("/kodoterm-bench/%1").arg(++serial);
+    QEventLoop loop;
+    bool done = false;
+    auto connection = QObject::connect(&term, &KodoTerm::cwdChanged, [&](const QString &cwd) {
+        if (cwd == marker) {
+            done = true;
+            loop.quit();
+        }
+    });
+
+    QElapsedTimer timer;
+    timer.start();
+    for (qsizetype offset = 0; offset < data.size(); offset += chunkSize) {
+        term.onPtyReadyRead(data.mid(offset, chunkSize));
+    }
+    term.onPtyReadyRead("\033]7;file://" + marker.toUtf8() + "\007");
+    if (!done) {
+        loop.exec();
+    }
+    const double seconds = timer.nsecsElapsed() / 1e9;
+    QObject::disconnect(connection);
+    peakScrollback = std::max(peakScrollback, term.scrollbackMemoryUsage());
+    term.painted = nullptr;
+
+    QJsonObject result;
+    result["name"] = workload.name;
+    result["bytes"] = data.size();
+    result["seconds"] = seconds;
+    result["mb_per_s"] = data.size() / (1024.0 * 1024.0) / seconds;
+    result["frames"] = (qint64)term.paintTimes.size();
+    result["frames_per_s"] = term.paintTimes.size() / seconds;
+    result["render_p50_ms"] = percentile(term.paintTimes, 0.50);
+    result["render_p99_ms"] = percentile(term.paintTimes, 0.99);
+    const KodoTermStats stats = term.stats();
+    result["parse_ms"] = stats.parseTimeNs / 1e6;
+    result["cells_redrawn"] = stats.cellsRedrawn;
+    result["cells_skipped"] = stats.cellsSkipped;
+    result["scrollback_lines"] = term.scrollbackLines();
+    result["peak_scrollback_bytes"] = (qint64)peakScrollback;
+    return result;
+}
+
+// Time from a single echoed keystroke arriving to the frame showing it
+static QJsonObject runLatency(BenchTerminal &term, int samples) {
+    term.resetTerminal();
+    QApplication::processEvents();
+    std::vector<qint64> latencies;
+    QElapsedTimer timer;
+    bool waiting = false;
+    QEventLoop loop;
+    term.painted = [&]() {
+        if (waiting) {
+            latencies.push_back(timer.nsecsElapsed());
+            waiting = false;
+            loop.quit();
+        }
+    };
+    for (int i = 0; i < samples; ++i) {
+        // Leave the terminal idle for longer than a frame, as between keystrokes
+        QTimer::singleShot(20, &term, [&, i]() {
+            waiting = true;
+            timer.start();
+            term.onPtyReadyRead((i % 80 == 79) ? "\r\n" : "x");
+        });
+        loop.exec();
+    }
+    term.painted = nullptr;
+
+    QJsonObject result;
+    result["samples"] = samples;
+    result["p50_ms"] = percentile(latencies, 0.50);
+    result["p99_ms"] = percentile(latencies, 0.99);
+    return result;
+}
+
+int main(int argc, char *argv[]) {
+    if (qEnvironmentVariableIsEmpty("QT_QPA_PLATFORM")) {
+        qputenv("QT_QPA_PLATFORM", "offscreen");
+    }
+    Q_INIT_RESOURCE(KodoTermThemes);
+    QApplication app(argc, argv);
+    QApplication::setApplicationName("kodoterm_bench");
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Throughput and latency benchmarks for KodoTerm");
+    parser.addHelpOption();
+    QStringList names;
+    for (const auto &w : workloads) {
+        names << w.name;
+    }
+    QCommandLineOption workloadOption(
+        "workload", QString("Comma separated workloads to run (%1)").arg(names.join(", ")),
+        "names", names.join(','));
+    QCommandLineOption sizeOption("size", "Megabytes of output per workload", "mb", "16");
+    QCommandLineOption chunkOption("chunk", "Bytes per simulated PTY read", "bytes", "4096");
+    QCommandLineOption geometryOption("geometry", "Terminal size in pixels", "WxH", "1280x800");
+    QCommandLineOption latencyOption("latency-samples",
+                                     "Keystrokes for the latency test, 0 to skip", "count", "200");
+    QCommandLineOption jsonOption("json", "Print the results as JSON");
+    QCommandLineOption outputOption("output", "Write the JSON results to a file", "file");
+    parser.addOptions({workloadOption, sizeOption, chunkOption, geometryOption, latencyOption,
+                       jsonOption, outputOption});
+    parser.process(app);
+
+    const qsizetype size = (qsizetype)(parser.value(sizeOption).toDouble() * 1024 * 1024);
+    const qsizetype chunkSize = std::max(1, parser.value(chunkOption).toInt());
+    const QStringList geometry = parser.value(geometryOption).split('x');
+    const int width = std::max(100, geometry.value(0).toInt());
+    const int height = std::max(100, geometry.value(1).toInt());
+    const int samples = parser.value(latencyOption).toInt();
+    QStringList selected = parser.value(workloadOption).split(',', Qt::SkipEmptyParts);
+    for (const QString &name : selected) {
+        if (!names.contains(name)) {
+            qCritical("Unknown workload: %s", qPrintable(name));
+            return 1;
+        }
+    }
+
+    BenchTerminal term;
+    term.resize(width, height);
+    term.show();
+    QApplication::processEvents();
+
+    QJsonArray results;
+    for (const auto &w : workloads) {
+        if (selected.contains(w.name)) {
+            results.append(runWorkload(term, w, size, chunkSize));
+        }
+    }
+    QJsonObject report;
+    report["version"] = 1;
+    report["qt"] = qVersion();
+    report["chunk_bytes"] = chunkSize;
+    report["width"] = term.width();
+    report["height"] = term.height();
+    report["workloads"] = results;
+    if (samples > 0) {
+        report["latency"] = runLatency(term, samples);
+    }
+
+    const QByteArray json = QJsonDocument(report).toJson();
+    if (parser.isSet(outputOption)) {
+        QFile file(parser.value(outputOption));
+        if (!file.open(QIODevice::WriteOnly) || file.write(json) != json.size()) {
+            qCritical("Cannot write %s", qPrintable(file.fileName()));
+            return 1;
+        }
+    }
+    QTextStream out(stdout);
+    if (parser.isSet(jsonOption)) {
+        out << json;
+        return 0;
+    }
+    out << QString("%1 %2 %3 %4 %5 %6\n")
+               .arg("workload", -10)
+               .arg("MB/s", 9)
+               .arg("frames/s", 9)
+               .arg("p50 ms", 8)
+               .arg("p99 ms", 8)
+               .arg("peak sb KB", 11);
+    for (const auto &value : results) {
+        QJsonObject r = value.toObject();
+        out << QString("%1 %2 %3 %4 %5 %6\n")
+                   .arg(r["name"].toString(), -10)
+                   .arg(r["mb_per_s"].toDouble(), 9, 'f', 1)
+                   .arg(r["frames_per_s"].toDouble(), 9, 'f', 1)
+                   .arg(r["render_p50_ms"].toDouble(), 8, 'f', 2)
+                   .arg(r["render_p99_ms"].toDouble(), 8, 'f', 2)
+                   .arg(r["peak_scrollback_bytes"].toInteger() / 1024, 11);
+    }
+    if (samples > 0) {
+        QJsonObject l = report["latency"].toObject();
+        out << QString("keystroke latency: p50 %1 ms, p99 %2 ms (%3 samples)\n")
+                   .arg(l["p50_ms"].toDouble(), 0, 'f', 2)
+                   .arg(l["p99_ms"].toDouble(), 0, 'f', 2)
+                   .arg(samples);
+    }
+    return 0;
+}
@@ -161,7 +161,7 @@ void AppConfig::cleanupOldLogs(int daysToKeep) {
 
     QDateTime limit = QDateTime::currentDateTime().addDays(-daysToKeep);
     QStringList filters;
-    filters << "kodoterm_*.log";
+    filters << "kodoterm_*.log" << "kodoterm_*.log.checkpoint";
 
     QFileInfoList files = dir.entryInfoList(filters, QDir::Files);
     for (const auto &fi : files) {
@@ -152,11 +152,6 @@ TabbedTerminal::TabbedTerminal(QWidget *parent) : QMainWindow(parent) {
         addAction(selectTabAction);
     }
 
-    QTimer *colorTimer = new QTimer(this);
-    colorTimer->setInterval(1000);
-    connect(colorTimer, &QTimer::timeout, this, &TabbedTerminal::updateTabColors);
-    colorTimer->start();
-
     m_autoSaveTimer = new QTimer(this);
     m_autoSaveTimer->setInterval(60 * 1000);
     connect(m_autoSaveTimer, &QTimer::timeout, this, &TabbedTerminal::saveSession);
@@ -170,18 +165,20 @@ TabbedTerminal::TabbedTerminal(QWidget *parent) : QMainWindow(parent) {
         m_config.load(s);
         restoreGeometry(s.value("Window/Geometry").toByteArray());
 
+        int activeTab = s.value("Session/ActiveTab", 0).toInt();
         int tabCount = s.beginReadArray("Session/Tabs");
         if (tabCount > 0) {
+            // Only the active tab is shown, so only its restore runs right away. The others
+            // restore in the background and are attached when first shown.
             for (int i = 0; i < tabCount; ++i) {
                 s.setArrayIndex(i);
                 QString program = s.value("program").toString();
                 QString cwd = s.value("cwd").toString();
                 QString logPath = s.value("logPath").toString();
-                addNewTab(program, cwd, logPath);
+                addNewTab(program, cwd, logPath, i == activeTab);
             }
             s.endArray();
 
-            int activeTab = s.value("Session/ActiveTab", 0).toInt();
             if (activeTab >= 0 && activeTab < m_tabs->count()) {
                 m_tabs->setCurrentIndex(activeTab);
             }
@@ -228,7 +225,7 @@ void TabbedTerminal::closeEvent(QCloseEvent *event) {
 }
 
 void TabbedTerminal::addNewTab(const QString &program, const QString &workingDirectory,
-                               const QString &logPath) {
+                               const QString &logPath, bool activate) {
     KodoTerm *console = new KodoTerm(m_tabs);
     if (!program.isEmpty()) {
         console->setProgram(program);
@@ -263,13 +260,16 @@ void TabbedTerminal::addNewTab(const QString &program, const QString &workingDir
         console->setProperty("cwdReceived", true);
         updateTabColors();
     });
+    connect(console, &KodoTerm::foregroundChanged, this, &TabbedTerminal::updateTabColors);
     connect(console, &KodoTerm::finished, this,
             [this, console](int exitCode, int exitStatus) { closeTab(console); });
 
     int index = m_tabs->addTab(console, tr("Terminal"));
-    m_tabs->setCurrentIndex(index);
     console->setConfig(m_config);
-    console->setFocus();
+    if (activate) {
+        m_tabs->setCurrentIndex(index);
+        console->setFocus();
+    }
     if (!logPath.isEmpty()) {
         console->setRestoreLog(logPath);
         console->start(false);
@@ -20,7 +20,7 @@ class TabbedTerminal : public QMainWindow {
 
   public slots:
     void addNewTab(const QString &program = QString(), const QString &workingDirectory = QString(),
-                   const QString &logPath = QString());
+                   const QString &logPath = QString(), bool activate = true);
     void closeCurrentTab();
     void closeTab(QWidget *w);
     void nextTab();
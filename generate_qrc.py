@@ -1,18 +1,66 @@
 import os
 import glob
+import json
+
+INDEX_FILE = 'KodoTermThemes.json'
+
+def theme_files(theme_dirs):
+    for theme_dir in theme_dirs:
+        files = sorted(glob.glob(os.path.join(theme_dir, '**/*'), recursive=True))
+        for file_path in files:
+            if os.path.isfile(file_path):
+                yield os.path.relpath(file_path).replace(os.sep, '/')
+
+def konsole_name(path):
+    # Same lookup as QSettings("General/Description")
+    section = None
+    with open(path, encoding='utf-8', errors='replace') as f:
+        for line in f:
+            line = line.strip()
+            if line.startswith('[') and line.endswith(']'):
+                section = line[1:-1]
+            elif section == 'General' and '=' in line:
+                key, value = line.split('=', 1)
+                if key.strip() == 'Description':
+                    return value.strip()
+    return None
+
+def windows_terminal_name(path):
+    try:
+        with open(path, encoding='utf-8') as f:
+            return json.load(f).get('name') or None
+    except (ValueError, OSError):
+        return None
+
+def generate_index(index_file, theme_dirs):
+    # Names and formats of the built-in themes, read by TerminalTheme::builtInThemes() so the
+    # theme files are only parsed once one is picked
+    themes = []
+    for rel_path in theme_files(theme_dirs):
+        file_name = os.path.basename(rel_path)
+        if rel_path.endswith('.colorscheme'):
+            fmt, name = 'konsole', konsole_name(rel_path) or file_name
+        elif rel_path.endswith('.itermcolors'):
+            fmt, name = 'iterm', os.path.splitext(file_name)[0]
+        elif rel_path.endswith('.json'):
+            fmt, name = 'windowsterminal', windows_terminal_name(rel_path) or file_name
+        else:
+            continue
+        themes.append({'name': name, 'path': rel_path, 'format': fmt})
+    with open(index_file, 'w', encoding='utf-8') as f:
+        json.dump({'version': 1, 'themes': themes}, f, ensure_ascii=False, indent=1)
+        f.write('\n')
 
 def generate_qrc(qrc_file, theme_dirs):
     with open(qrc_file, 'w') as f:
         f.write('<!DOCTYPE RCC><RCC version="1.0">\n')
         f.write('<qresource prefix="/">\n')
-        for theme_dir in theme_dirs:
-            files = sorted(glob.glob(os.path.join(theme_dir, '**/*'), recursive=True))
-            for file_path in files:
-                if os.path.isfile(file_path):
-                    rel_path = os.path.relpath(file_path).replace(os.sep, '/')
-                    f.write('    <file>' + rel_path + '</file>\n')
+        f.write('    <file>' + INDEX_FILE + '</file>\n')
+        for rel_path in theme_files(theme_dirs):
+            f.write('    <file>' + rel_path + '</file>\n')
         f.write('</qresource>\n')
         f.write('</RCC>\n')
 
 if __name__ == '__main__':
+    generate_index(INDEX_FILE, ['KodoTermThemes'])
     generate_qrc('KodoTermThemes.qrc', ['KodoTermThemes'])
@@ -9,23 +9,71 @@
 #include <QFont>
 #include <QMenu>
 #include <QProcessEnvironment>
+#include <QRegion>
 #include <QScrollBar>
 #include <QSocketNotifier>
 #include <QTimer>
 #include <QWidget>
-#include <deque>
 #include <functional>
+#include <memory>
 #include <vector>
 #include <vterm.h>
 
 #include "KodoTermConfig.hpp"
 
-class PtyProcess;
+class KodoTermCore;
+class DirtySpans;
+class GlyphCache;
+class GlTerminalView;
+struct ResolvedPalette;
+struct FontMetrics;
+class ScrollbackSearch;
+struct SearchMatch;
+class LinkCache;
+class SessionLogger;
+class SessionRestore;
+class TerminalSnapshot;
+class QDataStream;
+struct TerminalLink;
+
+// Runtime counters of a terminal. Rates and averages cover the last full second the
+// terminal was active, totals run since creation or resetStats().
+struct KodoTermStats {
+    // Upper bounds (ms) of the frame time histogram buckets, the last bucket has no bound
+    static constexpr int FrameTimeBuckets = 8;
+    static constexpr int FrameTimeLimits[FrameTimeBuckets - 1] = {1, 2, 4, 8, 16, 33, 66};
+
+    qint64 bytesIngested = 0;
+    double bytesPerSecond = 0;
+    qint64 parseTimeNs = 0; // inside vterm_input_write
+    double parseTimePerSecondMs = 0;
+
+    qint64 frames = 0;
+    double framesPerSecond = 0;
+    double averageFrameTimeMs = 0;
+    qint64 frameTimeHistogram[FrameTimeBuckets] = {};
+    qint64 lastFrameDamageCells = 0; // area of the damage rect
+    double averageDamageCells = 0;
+    qint64 cellsRedrawn = 0;
+    qint64 cellsSkipped = 0; // unchanged according to the cell cache
+
+    int scrollbackLines = 0;
+    qint64 scrollbackBytes = 0;
+
+    qint64 logWrites = 0; // drains of the session log that reached the disk
+    double logWriteLatencyMs = 0; // write and sync calls of a drain, on the writer thread
+    double maxLogWriteLatencyMs = 0;
+    double logEnqueueLatencyMs = 0; // what the GUI thread pays to queue output for the log
+    double maxLogEnqueueLatencyMs = 0;
+};
 
 class KodoTerm : public QWidget {
     Q_OBJECT
 
   public:
+    enum SearchFlag { SearchCaseSensitive = 0x1, SearchRegularExpression = 0x2 };
+    Q_DECLARE_FLAGS(SearchFlags, SearchFlag)
+
     explicit KodoTerm(QWidget *parent = nullptr);
     ~KodoTerm();
 
@@ -53,6 +101,25 @@ class KodoTerm : public QWidget {
 
     void saveState(const QString &path);
     void loadState(const QString &path);
+    // Writes the text of the scrollback and screen, or of the selection, as UTF-8. The text
+    // is streamed to the file a chunk at a time.
+    bool saveText(const QString &path, bool selectionOnly = false);
+    // Screen and scrollback as they are now, for reading on another thread. Search, links
+    // and text extraction all read the terminal through one.
+    std::shared_ptr<const TerminalSnapshot> snapshot();
+
+    // Searches the screen and scrollback in the background, all matches are highlighted and
+    // the one closest to the bottom becomes current as soon as it is found
+    void find(const QString &pattern, SearchFlags flags = {});
+    int searchMatchCount() const;
+    int currentSearchMatch() const { return m_searchCurrent; }
+
+    int scrollbackLines() const;
+    size_t scrollbackMemoryUsage() const;
+
+    KodoTermStats stats() const;
+    void resetStats();
+    bool statsOverlayVisible() const { return m_config.statsOverlay; }
 
   protected:
     void paintEvent(QPaintEvent *event) override;
@@ -67,11 +134,18 @@ class KodoTerm : public QWidget {
     bool focusNextPrevChild(bool next) override;
     void focusInEvent(QFocusEvent *event) override;
     void focusOutEvent(QFocusEvent *event) override;
+    void showEvent(QShowEvent *event) override;
+    void hideEvent(QHideEvent *event) override;
 
   signals:
     void contextMenuRequested(QMenu *menu, const QPoint &pos);
     void cwdChanged(const QString &cwd);
+    // foregroundProcessName() or isRoot() changed
+    void foregroundChanged();
     void finished(int exitCode, int exitStatus);
+    void searchResultsChanged(int current, int total, bool finished);
+    // Emitted about once per second while the terminal is busy
+    void statsUpdated(const KodoTermStats &stats);
 
   public slots:
     void onPtyReadyRead(const QByteArray &data);
@@ -83,13 +157,18 @@ class KodoTerm : public QWidget {
     void copyToClipboard();
     void pasteFromClipboard();
     void selectAll();
+    void saveScrollbackAs();
     void clearScrollback();
     void resetTerminal();
     void openFileBrowser();
     void kill();
+    void findNext();
+    void findPrevious();
+    void clearSearch();
+    void setStatsOverlayVisible(bool visible);
 
     void logData(const QByteArray &data);
-    QString logPath() const { return m_logFile.fileName(); }
+    QString logPath() const;
     void setRestoreLog(const QString &path) { m_pendingLogReplay = path; }
     void scrollToBottom();
     void processLogReplay();
@@ -100,7 +179,7 @@ class KodoTerm : public QWidget {
 
     QString foregroundProcessName() const;
     bool isRoot() const;
-    const QString &cwd() const { return m_cwd; }
+    QString cwd() const;
 
     bool copyOnSelect() const { return m_config.copyOnSelect; }
     void setCopyOnSelect(bool enable) { m_config.copyOnSelect = enable; }
@@ -115,56 +194,61 @@ class KodoTerm : public QWidget {
     void setAudibleBell(bool enable) { m_config.audibleBell = enable; }
 
   private:
-    void setupPty();
+    void connectCore();
+    void attachRestore();
     void updateTerminalSize();
+    // Pixel value of a color in the back buffer format
+    QRgb mapRgb(const VTermColor &c, const VTermState *state) const;
     QColor mapColor(const VTermColor &c, const VTermState *state) const;
     QString getTextRange(VTermPos start, VTermPos end);
     bool isSelected(int row, int col) const;
     VTermPos mouseToPos(const QPoint &pos) const;
-
-    // VTerm callbacks
-    static int onDamage(VTermRect rect, void *user);
-    static int onMoveRect(VTermRect dest, VTermRect src, void *user);
-    static int onMoveCursor(VTermPos pos, VTermPos oldpos, int visible, void *user);
-    static int onSetTermProp(VTermProp prop, VTermValue *val, void *user);
-    static int onBell(void *user);
-    static int onSbPushLine(int cols, const VTermScreenCell *cells, void *user);
-    static int onSbPopLine(int cols, VTermScreenCell *cells, void *user);
-    static int onOsc(int command, VTermStringFragment frag, void *user);
-
-    int pushScrollback(int cols, const VTermScreenCell *cells);
-    int popScrollback(int cols, VTermScreenCell *cells);
-
-    struct SavedCell {
-        uint32_t chars[VTERM_MAX_CHARS_PER_CELL];
-        VTermScreenCellAttrs attrs;
-        VTermColor fg, bg;
-        int width;
-    };
-    using SavedLine = std::vector<SavedCell>;
-
-    PtyProcess *m_pty = nullptr;
-    VTerm *m_vterm = nullptr;
-    VTermScreen *m_vtermScreen = nullptr;
+    const TerminalLink *linkAt(const QPoint &pos);
+    void openLink(const TerminalLink &link);
+
+    // Core signals
+    void takeCoreDamage();
+    void onCoreMoved(const QRect &dest, const QRect &src);
+    void onScrollbackPushed();
+    void onScrollbackPopped();
+    void onAltScreenChanged(bool altScreen);
+    void onCursorBlinkChanged(bool blink);
+    void onCoreReceived(const QByteArray &data);
+    void ringBell();
+
+    void onSearchMatches(const QList<SearchMatch> &matches, bool finished);
+    void scrollToSearchMatch();
+    void applyScrollbackTiering();
+
+    // Runs the child, parses, holds the screen and the scrollback, the widget only draws it
+    KodoTermCore *m_core = nullptr;
 
     QSocketNotifier *m_notifier = nullptr;
     QSize m_cellSize;
-    int m_cursorRow = 0;
-    int m_cursorCol = 0;
-    bool m_cursorVisible = true;
-    bool m_cursorBlink = false;
-    int m_cursorShape = 1; // VTERM_PROP_CURSORSHAPE_BLOCK
     bool m_cursorBlinkState = true;
-    bool m_altScreen = false;
     bool m_flowControlStopped = false;
     bool m_restorationBannerActive = false;
     QString m_restorationBannerText;
     QTimer *m_restorationBannerTimer = nullptr;
-    int m_mouseMode = 0; // VTERM_PROP_MOUSE_NONE
     QTimer *m_cursorBlinkTimer = nullptr;
 
+    // Frame pacing: PTY data is queued in the core and parsed at most once per frame, within
+    // maxParseTimePerFrame, the core's damage is then taken into m_dirtySpans until the frame
+    // is painted.
+    QTimer *m_frameTimer = nullptr;
+    QElapsedTimer m_lastFrame;
+    bool m_updatePending = false;
+
     QScrollBar *m_scrollBar = nullptr;
-    std::deque<SavedLine> m_scrollback;
+
+    // Matches are kept newest first, in the order the search streams them
+    ScrollbackSearch *m_search = nullptr;
+    std::vector<SearchMatch> m_searchMatches;
+    int m_searchCurrent = -1;
+    bool m_searchFinished = true;
+
+    LinkCache *m_links = nullptr;
+    bool m_linkHover = false;
 
     bool m_selecting = false;
     VTermPos m_selectionStart = {-1, -1};
@@ -175,35 +259,124 @@ class KodoTerm : public QWidget {
     QPoint m_lastClickPos;
 
     bool m_visualBellActive = false;
-    QString m_cwd;
-    QByteArray m_oscBuffer;
 
     QString m_program;
     QStringList m_arguments;
     QString m_workingDirectory;
     QProcessEnvironment m_environment = QProcessEnvironment::systemEnvironment();
     KodoTermConfig m_config;
-    QFile m_logFile;
+    SessionLogger *m_logger = nullptr;
     QString m_pendingLogReplay;
-    QFile *m_replayFile = nullptr;
+    SessionRestore *m_restoreJob = nullptr;
+    // Logical bytes written to the session log, and where the last checkpoint was taken
+    qint64 m_logBytes = 0;
+    qint64 m_checkpointOffset = -1;
+    QTimer *m_checkpointTimer = nullptr;
+    bool m_checkpointWriting = false;
+    static QString checkpointPath(const QString &logPath);
+    // Written from a snapshot on the thread pool, or right away when the terminal goes
+    void writeCheckpoint(bool background = true);
+    void writeState(QDataStream &out, qint64 logOffset);
+    bool readState(QDataStream &in, qint64 *logOffset);
     bool m_restoring = false;
 
-    mutable QColor m_paletteCache[256];
-    mutable bool m_paletteCacheValid[256];
-
-    mutable VTermColor m_lastVTermFg, m_lastVTermBg;
-    mutable QColor m_lastFg, m_lastBg;
-    double m_avgDrawTime = 0.0;
-
-    VTermRect m_dirtyRect;
-    void resetDirtyRect();
-
+    // Shared with the other terminals using the same theme and fonts, see SharedResources
+    std::shared_ptr<const ResolvedPalette> m_palette;
+    std::shared_ptr<const FontMetrics> m_fontMetrics;
+    std::shared_ptr<const FontMetrics> m_renderMetrics; // of m_renderFont, cells are drawn in it
+    QFont m_renderFont;
+
+    KodoTermStats m_stats;
+    QElapsedTimer m_statsWindow;
+    struct {
+        qint64 bytes = 0;
+        qint64 parseTimeNs = 0;
+        qint64 frames = 0;
+        qint64 frameTimeNs = 0;
+        qint64 damageCells = 0;
+        qint64 logEnqueues = 0;
+        qint64 logEnqueueNs = 0;
+        qint64 maxLogEnqueueNs = 0;
+    } m_statsPending;
+    void parseInput(const char *data, size_t size);
+    void recordParse(size_t size, qint64 ns);
+    void writeLog(const QByteArray &data);
+    void recordFrameTime(qint64 ns);
+    void updateStats();
+    void drawStatsOverlay(QPainter &painter);
+
+    // Damage waiting for the next render, a span of columns per view row (screen rows unless
+    // scrolled back)
+    DirtySpans *m_dirtySpans = nullptr;
+    void markDirty(int top, int bottom, int startCol, int endCol);
+    QRect cellRect(int top, int bottom, int startCol, int endCol) const;
+    // Back buffer pixels not on screen yet, and the cursor as last painted over them
+    QRegion m_blitRegion;
+    QRect m_cursorPainted;
+    void updateDamaged();
+
+    // Vertical scrolls of the back buffer are coalesced here and blitted once per frame,
+    // delta > 0 moves the rows [top, bottom) up
+    struct {
+        int top = 0;
+        int bottom = 0;
+        int delta = 0;
+        bool active = false;
+    } m_pendingScroll;
+    int m_viewTop = 0;
+    bool m_viewAtBottom = true;
+    void scrollRows(int top, int bottom, int delta);
+    void applyPendingScroll();
+    bool moveBackBuffer(VTermRect dest, VTermRect src);
+
+    // Hidden terminals keep parsing but leave the back buffer alone, see hideEvent()
     bool m_dirty = false;
     QImage m_backBuffer;
-    std::vector<VTermScreenCell> m_cellCache;
-    std::vector<bool> m_selectedCache;
+    std::shared_ptr<GlyphCache> m_glyphCache;
+    // What each back buffer cell was drawn from, packed and zero padded so that whole spans
+    // compare with memcmp. chars[0] == -1 marks a cell that must be drawn again.
+    struct ShadowCell {
+        uint32_t chars[VTERM_MAX_CHARS_PER_CELL];
+        uint32_t fg;
+        uint32_t bg;
+        VTermScreenCellAttrs attrs;
+        uint8_t width;
+        uint8_t mark; // CellSelected | CellMatch | CellCurrentMatch
+        uint16_t reserved;
+    };
+    std::vector<ShadowCell> m_cellCache;
+    static void packCell(const VTermScreenCell &cell, uint8_t mark, ShadowCell &out);
+    void invalidateCellCache();
     void renderToBackbuffer();
-    void flushTerminal();
+    void releaseBuffers();
+    void writeToTerminal(const QByteArray &data);
+    void scheduleFrame();
+    void requestUpdate();
+    void processFrame();
     void damageAll();
     void drawRestorationBanner(QPainter &painter);
+    void paintOverlays(QPainter &painter);
+    bool cursorShown() const;
+    // Highlight marks of columns [startCol, endCol) of a view row, and the colors a cell is
+    // drawn in under them
+    void rowMarks(int row, int startCol, int endCol, uint8_t *marks) const;
+    void cellColors(const VTermScreenCell &cell, uint8_t mark, const VTermState *state,
+                    QRgb defFg, QRgb defBg, QRgb &fg, QRgb &bg) const;
+    QFont cellFont() const;
+
+    // GPU backend (gpuRendering), covering the terminal area when active. Null when cells are
+    // drawn into the back buffer, always so when built without OpenGL.
+    GlTerminalView *m_gpuView = nullptr;
+    bool m_gpuFailed = false;
+    QElapsedTimer m_gpuFrameTimer;
+    int m_gpuAtlasGeneration = -1;
+    quint64 m_gpuAtlasRevision = 0;
+    QPoint m_gpuCursor{-1, -1}; // cell drawn inverted as the block cursor
+    void applyRenderBackend();
+    void renderToGpu();
+    bool moveGpuCells(VTermRect src, int dr, int dc);
+    // Repaints a rect of the terminal area, or all of it, on whichever backend is active
+    void updateView(const QRect &rect = QRect());
 };
+
+Q_DECLARE_OPERATORS_FOR_FLAGS(KodoTerm::SearchFlags)
@@ -55,6 +55,21 @@ class KodoTermConfig {
     QString logDirectory;
     QString wordSelectionRegex;
     int maxScrollback;
+    int targetFrameRate;
+    int maxParseTimePerFrame;
+    bool threadedPtyReader;
+    bool glyphAtlas;
+    int scrollbackHotLines;
+    int scrollbackMemoryLimit; // MiB of compressed scrollback kept in memory
+    bool scrollbackSpillToDisk;
+    bool statsOverlay;
+    int logFlushInterval; // ms between syncs of the session log to disk
+    int logFlushSize; // KiB of pending log data that triggers a write
+    bool logCompression;
+    int checkpointInterval; // seconds between session log checkpoints, 0 disables them
+    bool releaseHiddenBuffers; // hidden terminals free their back buffer and glyph cache
+    bool directBackgrounds; // cell backgrounds are written to the back buffer without QPainter
+    bool gpuRendering; // draw with OpenGL when built with it, falls back to the back buffer
     TerminalTheme theme;
 
     void setDefaults();
@@ -0,0 +1,201 @@
+// SPDX-License-Identifier: MIT
+// Author: Diego Iastrubni <diegoiast@gmail.com>
+
+#pragma once
+
+#include <QElapsedTimer>
+#include <QList>
+#include <QObject>
+#include <QPoint>
+#include <QProcessEnvironment>
+#include <QRect>
+#include <QString>
+#include <QStringList>
+#include <functional>
+#include <memory>
+#include <vector>
+#include <vterm.h>
+
+class DirtySpans;
+class PtyProcess;
+class QDataStream;
+class ScrollbackBuffer;
+class SnapshotCache;
+class TerminalSnapshot;
+class QTimer;
+
+// A terminal without a widget: the VTerm, its scrollback and optionally the child process
+// writing to it, needing nothing but QtCore. Use it to parse or replay sessions where there is
+// no display, e.g. in a log processor, or to run many terminals on worker threads.
+//
+// Damage is pulled: it accumulates until takeDamage(), damaged() tells when there is some
+// again. A core belongs to the thread it was created on, move it before start().
+//
+// Views such as KodoTerm draw a core: they render from takeDamage() and fetchRow(), and the
+// signals emitted while parsing let them keep pixels, scrollbars and search in step. Those
+// are emitted from within feed(), connect them directly. A view that paces parsing to its
+// frames sets setPaced(), child output then waits until it calls parsePending().
+class KodoTermCore : public QObject {
+    Q_OBJECT
+
+  public:
+    explicit KodoTermCore(int rows = 25, int cols = 80, QObject *parent = nullptr);
+    ~KodoTermCore();
+
+    int rows() const;
+    int cols() const;
+    void resize(int rows, int cols);
+    void setMaxScrollback(int lines) { m_maxScrollback = lines; }
+    int maxScrollback() const { return m_maxScrollback; }
+
+    // The child is read on a thread of its own, or on the core's thread when threaded is
+    // false. Takes effect on the next start().
+    void setThreadedReader(bool threaded) { m_threadedReader = threaded; }
+    bool start(const QString &program, const QStringList &arguments = {},
+               const QString &workingDirectory = {},
+               const QProcessEnvironment &environment = QProcessEnvironment::systemEnvironment());
+    // Ends the child right away, finished() is not emitted
+    void kill();
+    // Asks the child to end, finished() follows once it did
+    void terminate();
+    bool isRunning() const { return m_pty != nullptr; }
+    // Takes over the child of other, with its output not parsed yet and its input not sent
+    // yet. For a core that replaces the one the child was started in, e.g. after a restore.
+    void takeProcess(KodoTermCore *other);
+    // Goes to the child as if typed, after the paste still going out if there is one
+    void sendInput(const QByteArray &data);
+    // Goes to the child bracketed, if the application asked for it, a chunk at a time so a
+    // slow child never has megabytes waiting on it
+    void paste(const QByteArray &data);
+    // Both describe the foreground process, looked at whenever it is likely to have changed
+    QString foregroundProcessName() const;
+    bool isRoot() const;
+
+    // Output of the child, or data handed in as if the child wrote it. Parsed right away
+    // unless paced, then queued for parsePending(). Reading from the child stops while too
+    // much is queued.
+    void receive(const QByteArray &data);
+    void setPaced(bool paced) { m_paced = paced; }
+    qsizetype pendingBytes() const { return m_pending.size() - m_pendingOffset; }
+    // Parses up to maxBytes of the queued output, returns how much it parsed
+    qsizetype parsePending(qsizetype maxBytes);
+    // Parses terminal output, as the child or a session log would produce it
+    void feed(const QByteArray &data);
+    // Replays a session log written by KodoTerm, from its checkpoint when there is one.
+    // keepGoing is asked between chunks of the log, the replay fails once it returns false.
+    bool replayLog(const QString &logPath, const QString &checkpointPath = QString(),
+                   const std::function<bool()> &keepGoing = {});
+    void reset();
+    void clearScrollback();
+
+    bool saveState(const QString &path);
+    bool loadState(const QString &path);
+    // The same, as part of a stream. logOffset is where in the session log the state was taken.
+    void writeState(QDataStream &out, qint64 logOffset = 0);
+    bool readState(QDataStream &in, qint64 *logOffset = nullptr);
+
+    // Rows count from the top of the scrollback and run on into the screen. fetchRow() fills
+    // cells [startCol, endCol) of a row, indexed by column, and returns its width.
+    int scrollbackRows() const;
+    int totalRows() const { return scrollbackRows() + rows(); }
+    int fetchRow(int row, int startCol, int endCol, VTermScreenCell *cells) const;
+    // Text of the screen, trailing blanks and blank rows at the bottom dropped
+    QString screenText();
+
+    // Screen and scrollback as they are now, for reading on another thread
+    std::shared_ptr<const TerminalSnapshot> snapshot();
+    ScrollbackBuffer *scrollback() const { return m_scrollback; }
+
+    QPoint cursor() const { return m_cursor; }
+    bool cursorVisible() const { return m_cursorVisible; }
+    bool cursorBlink() const { return m_cursorBlink; }
+    int cursorShape() const { return m_cursorShape; }
+    int mouseMode() const { return m_mouseMode; }
+    bool altScreen() const { return m_altScreen; }
+    QString title() const { return m_title; }
+    QString cwd() const { return m_cwd; }
+
+    // Screen rectangles (x = column, y = row) changed since the last call, one per run of
+    // rows sharing the same columns
+    QList<QRect> takeDamage();
+    bool hasDamage() const;
+
+    // For drawing code that needs libvterm directly, owned by the core
+    VTerm *vterm() const { return m_vterm; }
+
+  signals:
+    // Damage arrived while none was pending
+    void damaged();
+    // Cells of src were copied to dest, both are part of the damage as well
+    void moved(const QRect &dest, const QRect &src);
+    // A line went to the end of the scrollback, cells are only valid during the call. The
+    // oldest line was dropped to stay within maxScrollback() when dropped is set.
+    void scrollbackPushed(int cols, const VTermScreenCell *cells, bool dropped);
+    // count lines from line on were taken back, those from line on now are new
+    void scrollbackPopped(int line, int count);
+    void altScreenChanged(bool altScreen);
+    void cursorBlinkChanged(bool blink);
+    void titleChanged(const QString &title);
+    // Shells report the directory with every prompt, cwdChanged() is only emitted for a new one
+    void cwdReported(const QString &cwd);
+    void cwdChanged(const QString &cwd);
+    void bell();
+    // What the terminal answers or encodes for typed keys, while no child of its own runs
+    void output(const QByteArray &data);
+    // Everything receive() gets, before it is parsed, e.g. for a session log
+    void received(const QByteArray &data);
+    // foregroundProcessName() or isRoot() changed
+    void foregroundChanged();
+    void finished(int exitCode, int exitStatus);
+
+  private:
+    static int onDamage(VTermRect rect, void *user);
+    static int onMoveRect(VTermRect dest, VTermRect src, void *user);
+    static int onMoveCursor(VTermPos pos, VTermPos oldpos, int visible, void *user);
+    static int onSetTermProp(VTermProp prop, VTermValue *val, void *user);
+    static int onBell(void *user);
+    static int onSbPushLine(int cols, const VTermScreenCell *cells, bool continuation,
+                            void *user);
+    static int onSbPopLine(int cols, VTermScreenCell *cells, void *user);
+    static int onOsc(int command, VTermStringFragment frag, void *user);
+    static void onOutput(const char *s, size_t len, void *user);
+    void markDirty(int top, int bottom, int startCol, int endCol);
+    void connectPty();
+    void feedPaste();
+    // The foreground process is looked at once things settle rather than polled
+    void foregroundLikelyChanged();
+
+    VTerm *m_vterm = nullptr;
+    VTermScreen *m_screen = nullptr;
+    ScrollbackBuffer *m_scrollback = nullptr;
+    PtyProcess *m_pty = nullptr;
+    bool m_threadedReader = true;
+    SnapshotCache *m_snapshots = nullptr;
+    int m_maxScrollback = 1000;
+
+    QPoint m_cursor;
+    bool m_cursorVisible = true;
+    bool m_cursorBlink = false;
+    int m_cursorShape = 1; // VTERM_PROP_CURSORSHAPE_BLOCK
+    int m_mouseMode = 0;   // VTERM_PROP_MOUSE_NONE
+    bool m_altScreen = false;
+    QString m_title;
+    QString m_cwd;
+    QByteArray m_oscBuffer;
+
+    // Child output not parsed yet, from m_pendingOffset on
+    bool m_paced = false;
+    QByteArray m_pending;
+    qsizetype m_pendingOffset = 0;
+    bool m_readPaused = false;
+    // Paste still going out, sent from m_pasteOffset on, and what was typed since
+    QByteArray m_paste;
+    qsizetype m_pasteOffset = 0;
+    QByteArray m_pasteTail;
+    // Input went out since the last output, see receive()
+    bool m_inputSent = false;
+    QElapsedTimer m_sinceOutput;
+    QTimer *m_foregroundTimer = nullptr;
+
+    DirtySpans *m_dirtySpans = nullptr;
+};
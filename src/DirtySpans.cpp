@@ -0,0 +1,84 @@
+// SPDX-License-Identifier: MIT
+// Author: Diego Iastrubni <diegoiast@gmail.com>
+
+#include "DirtySpans.h"
+
+#include <algorithm>
+#include <cstdlib>
+
+void DirtySpans::mark(int rows, int cols, int top, int bottom, int startCol, int endCol) {
+    if ((int)m_spans.size() != rows) {
+        m_spans.assign(rows, {});
+        m_top = m_bottom = 0;
+    }
+    top = std::max(0, top);
+    bottom = std::min(rows, bottom);
+    startCol = std::max(0, startCol);
+    endCol = std::min(cols, endCol);
+    if (top >= bottom || startCol >= endCol) {
+        return;
+    }
+    for (int r = top; r < bottom; ++r) {
+        Span &span = m_spans[r];
+        if (span.isEmpty()) {
+            span = {startCol, endCol};
+        } else {
+            span.start = std::min(span.start, startCol);
+            span.end = std::max(span.end, endCol);
+        }
+    }
+    if (isEmpty()) {
+        m_top = top;
+        m_bottom = bottom;
+    } else {
+        m_top = std::min(m_top, top);
+        m_bottom = std::max(m_bottom, bottom);
+    }
+}
+
+void DirtySpans::scroll(int top, int bottom, int delta) {
+    top = std::max(0, top);
+    bottom = std::min(bottom, rows());
+    if (isEmpty() || delta == 0 || top >= bottom) {
+        return;
+    }
+    auto first = m_spans.begin() + top, last = m_spans.begin() + bottom;
+    if (std::abs(delta) >= bottom - top) {
+        std::fill(first, last, Span{});
+    } else if (delta > 0) {
+        std::fill(std::move(first + delta, last, first), last, Span{});
+    } else {
+        std::fill(first, std::move_backward(first, last + delta, last), Span{});
+    }
+    m_top = std::min(m_top, top);
+    m_bottom = std::max(m_bottom, bottom);
+}
+
+QList<QRect> DirtySpans::take() {
+    QList<QRect> rects;
+    for (int r = m_top; r < m_bottom; ++r) {
+        const Span span = m_spans[r];
+        m_spans[r] = {};
+        if (span.isEmpty()) {
+            continue;
+        }
+        if (!rects.isEmpty()) {
+            QRect &last = rects.last();
+            if (last.bottom() == r - 1 && last.left() == span.start &&
+                last.right() == span.end - 1) {
+                last.setBottom(r);
+                continue;
+            }
+        }
+        rects.append(QRect(span.start, r, span.end - span.start, 1));
+    }
+    m_top = m_bottom = 0;
+    return rects;
+}
+
+void DirtySpans::clear() {
+    for (int r = m_top; r < m_bottom && r < rows(); ++r) {
+        m_spans[r] = {};
+    }
+    m_top = m_bottom = 0;
+}
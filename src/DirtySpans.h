@@ -0,0 +1,42 @@
+// SPDX-License-Identifier: MIT
+// Author: Diego Iastrubni <diegoiast@gmail.com>
+
+#pragma once
+
+#include <QList>
+#include <QRect>
+#include <vector>
+
+// Damage as a span of columns per row, widened as more is marked. Only rows in
+// [top(), bottom()) can have a span, so clearing and walking it stays proportional to what
+// was marked. The core keeps its screen damage in one, views their own per view row.
+class DirtySpans {
+  public:
+    struct Span {
+        int start = 0;
+        int end = 0;
+        bool isEmpty() const { return start >= end; }
+    };
+
+    // Marks rows [top, bottom) from startCol to endCol, clipped to a grid of rows x cols. A
+    // grid with another row count drops what was marked before.
+    void mark(int rows, int cols, int top, int bottom, int startCol, int endCol);
+    // Moves the spans of rows [top, bottom) along with content scrolled up by delta rows
+    // (down when negative). The rows scrolled in are left without one.
+    void scroll(int top, int bottom, int delta);
+    // The spans as rectangles (x = column, y = row), one per run of rows sharing the same
+    // columns, and clears them
+    QList<QRect> take();
+    void clear();
+
+    bool isEmpty() const { return m_top >= m_bottom; }
+    int rows() const { return (int)m_spans.size(); }
+    int top() const { return m_top; }
+    int bottom() const { return m_bottom; }
+    const Span &span(int row) const { return m_spans[row]; }
+
+  private:
+    std::vector<Span> m_spans;
+    int m_top = 0;
+    int m_bottom = 0;
+};
@@ -0,0 +1,243 @@
+// SPDX-License-Identifier: MIT
+// Author: Diego Iastrubni <diegoiast@gmail.com>
+
+#include "GlTerminalView.h"
+
+#include <QOpenGLContext>
+#include <QPainter>
+#include <QSurfaceFormat>
+#include <QTimer>
+#include <QVector2D>
+#include <algorithm>
+
+// Bytes of a QRgb in memory, read as normalized unsigned bytes
+#if Q_BYTE_ORDER == Q_LITTLE_ENDIAN
+#define KODOTERM_RGB_SWIZZLE ".zyx"
+#else
+#define KODOTERM_RGB_SWIZZLE ".yzw"
+#endif
+
+static const char *VertexShader = R"(
+layout(location = 0) in vec2 corner;
+layout(location = 1) in vec2 glyph;
+layout(location = 2) in vec4 fgBytes;
+layout(location = 3) in vec4 bgBytes;
+uniform vec2 viewport;
+uniform vec2 cellSize;
+uniform vec2 atlasSize;
+uniform int cols;
+out vec2 uv;
+out vec3 fg;
+out vec3 bg;
+out float hasGlyph;
+void main() {
+    vec2 cell = vec2(float(gl_InstanceID % cols), float(gl_InstanceID / cols));
+    vec2 pos = (cell + corner) * cellSize;
+    gl_Position = vec4(pos.x / viewport.x * 2.0 - 1.0, 1.0 - pos.y / viewport.y * 2.0, 0.0, 1.0);
+    uv = (glyph + corner * cellSize) / atlasSize;
+    hasGlyph = glyph.x < 0.0 ? 0.0 : 1.0;
+    fg = fgBytes)" KODOTERM_RGB_SWIZZLE R"(;
+    bg = bgBytes)" KODOTERM_RGB_SWIZZLE R"(;
+}
+)";
+
+static const char *FragmentShader = R"(
+in vec2 uv;
+in vec3 fg;
+in vec3 bg;
+in float hasGlyph;
+uniform sampler2D atlas;
+out vec4 color;
+void main() {
+    float coverage = hasGlyph > 0.5 ? texture(atlas, uv).r : 0.0;
+    color = vec4(mix(bg, fg, coverage), 1.0);
+}
+)";
+
+GlTerminalView::GlTerminalView(QWidget *parent) : QOpenGLWidget(parent) {
+    QSurfaceFormat format = QSurfaceFormat::defaultFormat();
+    if (QOpenGLContext::openGLModuleType() == QOpenGLContext::LibGL) {
+        format.setVersion(3, 3);
+        format.setProfile(QSurfaceFormat::CoreProfile);
+    } else {
+        format.setVersion(3, 0);
+    }
+    setFormat(format);
+    setAttribute(Qt::WA_TransparentForMouseEvents);
+    setFocusPolicy(Qt::NoFocus);
+}
+
+GlTerminalView::~GlTerminalView() {
+    if (!context()) {
+        return;
+    }
+    makeCurrent();
+    if (m_atlas) {
+        glDeleteTextures(1, &m_atlas);
+    }
+    m_instances.destroy();
+    m_corners.destroy();
+    m_vao.destroy();
+    m_program.reset();
+    doneCurrent();
+}
+
+void GlTerminalView::setGrid(int rows, int cols, const QSizeF &cellSize, QRgb background) {
+    m_rows = std::max(rows, 0);
+    m_cols = std::max(cols, 0);
+    m_cellSize = cellSize;
+    m_background = background;
+    Cell blank;
+    blank.fg = blank.bg = background;
+    m_cells.assign((size_t)m_rows * m_cols, blank);
+    m_resized = true;
+    update();
+}
+
+void GlTerminalView::rowsChanged(int first, int last) {
+    first = std::max(first, 0);
+    last = std::min(last, m_rows);
+    if (first >= last) {
+        return;
+    }
+    if (m_dirtyFirst >= m_dirtyLast) {
+        m_dirtyFirst = first;
+        m_dirtyLast = last;
+    } else {
+        m_dirtyFirst = std::min(m_dirtyFirst, first);
+        m_dirtyLast = std::max(m_dirtyLast, last);
+    }
+}
+
+void GlTerminalView::uploadAtlas(const QImage &atlas) {
+    if (m_failed || atlas.isNull()) {
+        return;
+    }
+    // Glyphs are rasterized in white, the alpha is all the coverage needed
+    const QImage coverage = atlas.convertToFormat(QImage::Format_Alpha8);
+    if (!m_atlas) {
+        glGenTextures(1, &m_atlas);
+    }
+    glBindTexture(GL_TEXTURE_2D, m_atlas);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    if (coverage.size() != m_atlasSize) {
+        m_atlasSize = coverage.size();
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, m_atlasSize.width(), m_atlasSize.height(), 0,
+                     GL_RED, GL_UNSIGNED_BYTE, nullptr);
+    }
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, (GLint)coverage.bytesPerLine());
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, coverage.width(), coverage.height(), GL_RED,
+                    GL_UNSIGNED_BYTE, coverage.constBits());
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+}
+
+void GlTerminalView::initializeGL() {
+    initializeOpenGLFunctions();
+    QOpenGLContext *ctx = context();
+    const QSurfaceFormat format = ctx->format();
+    if (format.version() < qMakePair(3, ctx->isOpenGLES() ? 0 : 3)) {
+        fail();
+        return;
+    }
+    const QByteArray prefix =
+        ctx->isOpenGLES() ? "#version 300 es\nprecision highp float;\nprecision highp int;\n"
+                          : "#version 330 core\n";
+    m_program = std::make_unique<QOpenGLShaderProgram>();
+    if (!m_program->addShaderFromSourceCode(QOpenGLShader::Vertex, prefix + VertexShader) ||
+        !m_program->addShaderFromSourceCode(QOpenGLShader::Fragment, prefix + FragmentShader) ||
+        !m_program->link()) {
+        qWarning("KodoTerm: OpenGL renderer disabled: %s", qPrintable(m_program->log()));
+        fail();
+        return;
+    }
+
+    m_vao.create();
+    QOpenGLVertexArrayObject::Binder binder(&m_vao);
+    static const GLfloat corners[] = {0, 0, 1, 0, 0, 1, 1, 1};
+    m_corners.create();
+    m_corners.bind();
+    m_corners.allocate(corners, sizeof(corners));
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, nullptr);
+
+    m_instances.create();
+    m_instances.setUsagePattern(QOpenGLBuffer::DynamicDraw);
+    m_instances.bind();
+    const GLsizei stride = sizeof(Cell);
+    glEnableVertexAttribArray(1);
+    glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, stride,
+                          reinterpret_cast<void *>(offsetof(Cell, glyphX)));
+    glEnableVertexAttribArray(2);
+    glVertexAttribPointer(2, 4, GL_UNSIGNED_BYTE, GL_TRUE, stride,
+                          reinterpret_cast<void *>(offsetof(Cell, fg)));
+    glEnableVertexAttribArray(3);
+    glVertexAttribPointer(3, 4, GL_UNSIGNED_BYTE, GL_TRUE, stride,
+                          reinterpret_cast<void *>(offsetof(Cell, bg)));
+    glVertexAttribDivisor(1, 1);
+    glVertexAttribDivisor(2, 1);
+    glVertexAttribDivisor(3, 1);
+    m_resized = true;
+}
+
+void GlTerminalView::paintGL() {
+    if (m_failed) {
+        return;
+    }
+    if (prepare) {
+        prepare();
+    }
+    const qreal dpr = devicePixelRatioF();
+    const int w = qRound(width() * dpr), h = qRound(height() * dpr);
+    glViewport(0, 0, w, h);
+    glClearColor(qRed(m_background) / 255.0f, qGreen(m_background) / 255.0f,
+                 qBlue(m_background) / 255.0f, 1.0f);
+    glClear(GL_COLOR_BUFFER_BIT);
+
+    if (m_rows > 0 && m_cols > 0) {
+        QOpenGLVertexArrayObject::Binder binder(&m_vao);
+        m_instances.bind();
+        if (m_resized) {
+            m_instances.allocate(m_cells.data(), (int)(m_cells.size() * sizeof(Cell)));
+            m_resized = false;
+        } else if (m_dirtyFirst < m_dirtyLast) {
+            // Only the rows touched since the last frame go to the GPU
+            m_instances.write(m_dirtyFirst * m_cols * (int)sizeof(Cell), row(m_dirtyFirst),
+                              (m_dirtyLast - m_dirtyFirst) * m_cols * (int)sizeof(Cell));
+        }
+        m_dirtyFirst = m_dirtyLast = 0;
+
+        m_program->bind();
+        m_program->setUniformValue("viewport", QVector2D(w, h));
+        m_program->setUniformValue("cellSize", QVector2D(m_cellSize.width(), m_cellSize.height()));
+        m_program->setUniformValue("atlasSize",
+                                   QVector2D(m_atlasSize.width(), m_atlasSize.height()));
+        m_program->setUniformValue("cols", m_cols);
+        m_program->setUniformValue("atlas", 0);
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_2D, m_atlas);
+        glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, m_rows * m_cols);
+        m_program->release();
+    }
+
+    if (overlay) {
+        QPainter painter(this);
+        overlay(painter);
+    }
+}
+
+void GlTerminalView::fail() {
+    if (m_failed) {
+        return;
+    }
+    m_failed = true;
+    // The owner deletes this view in response, not from within its own GL callbacks
+    QTimer::singleShot(0, parentWidget(), [callback = onFailure]() {
+        if (callback) {
+            callback();
+        }
+    });
+}
@@ -0,0 +1,77 @@
+// SPDX-License-Identifier: MIT
+// Author: Diego Iastrubni <diegoiast@gmail.com>
+
+#pragma once
+
+#include <QColor>
+#include <QImage>
+#include <QOpenGLBuffer>
+#include <QOpenGLExtraFunctions>
+#include <QOpenGLShaderProgram>
+#include <QOpenGLVertexArrayObject>
+#include <QOpenGLWidget>
+#include <functional>
+#include <memory>
+#include <vector>
+
+// GPU backend of KodoTerm, drawn over the terminal area instead of the QImage back buffer.
+// Every cell is one instance of a quad, placed from its index in the grid, which samples its
+// glyph from the GlyphCache atlas (rasterized in white) and tints it with the cell colors.
+// Only rows that changed are uploaded, the whole grid is then drawn in a single call.
+//
+// The view takes no input, events go through to the terminal below it.
+class GlTerminalView : public QOpenGLWidget, protected QOpenGLExtraFunctions {
+  public:
+    struct Cell {
+        float glyphX = -1; // top left of the glyph in the atlas in pixels, < 0 for no glyph
+        float glyphY = 0;
+        QRgb fg = 0;
+        QRgb bg = 0;
+    };
+
+    explicit GlTerminalView(QWidget *parent);
+    ~GlTerminalView();
+
+    // cellSize is in device pixels, cells are reset to background
+    void setGrid(int rows, int cols, const QSizeF &cellSize, QRgb background);
+    int rows() const { return m_rows; }
+    int cols() const { return m_cols; }
+    QSizeF cellSize() const { return m_cellSize; }
+    Cell *row(int r) { return &m_cells[(size_t)r * m_cols]; }
+    void rowsChanged(int first, int last);
+    // Shown around the grid
+    void setBackground(QRgb background) { m_background = background; }
+    // Only valid while painting, from prepare
+    void uploadAtlas(const QImage &atlas);
+    bool failed() const { return m_failed; }
+
+    // Called from paintGL(): prepare fills in the changed cells before the grid is drawn,
+    // overlay paints over it. onFailure runs once if the context can not run the shaders.
+    std::function<void()> prepare;
+    std::function<void(QPainter &)> overlay;
+    std::function<void()> onFailure;
+
+  protected:
+    void initializeGL() override;
+    void paintGL() override;
+
+  private:
+    void fail();
+
+    std::vector<Cell> m_cells;
+    int m_rows = 0;
+    int m_cols = 0;
+    QSizeF m_cellSize;
+    QRgb m_background = 0;
+    int m_dirtyFirst = 0;
+    int m_dirtyLast = 0;
+    bool m_resized = true;
+    bool m_failed = false;
+
+    std::unique_ptr<QOpenGLShaderProgram> m_program;
+    QOpenGLVertexArrayObject m_vao;
+    QOpenGLBuffer m_corners{QOpenGLBuffer::VertexBuffer};
+    QOpenGLBuffer m_instances{QOpenGLBuffer::VertexBuffer};
+    GLuint m_atlas = 0;
+    QSize m_atlasSize;
+};
@@ -0,0 +1,297 @@
+// SPDX-License-Identifier: MIT
+// Author: Diego Iastrubni <diegoiast@gmail.com>
+
+#include "GlyphCache.h"
+
+#include <QtMath>
+#include <algorithm>
+#include <cstring>
+
+static constexpr int AtlasSize = 1024;
+
+bool isBoxChar(uint32_t c) { return (c >= 0x2500 && c <= 0x257F); }
+
+void drawBoxChar(QPainter &p, const QRect &r, uint32_t c, const QColor &fg) {
+    enum { L = 1, R = 2, U = 4, D = 8, H = 16, Db = 32 };
+    int f = 0;
+    switch (c) {
+    case 0x2500:
+        f = L | R;
+        break;
+    case 0x2501:
+        f = L | R | H;
+        break;
+    case 0x2502:
+        f = U | D;
+        break;
+    case 0x2503:
+        f = U | D | H;
+        break;
+    case 0x250C:
+        f = D | R;
+        break;
+    case 0x250F:
+        f = D | R | H;
+        break;
+    case 0x2510:
+        f = D | L;
+        break;
+    case 0x2513:
+        f = D | L | H;
+        break;
+    case 0x2514:
+        f = U | R;
+        break;
+    case 0x2517:
+        f = U | R | H;
+        break;
+    case 0x2518:
+        f = U | L;
+        break;
+    case 0x251B:
+        f = U | L | H;
+        break;
+    case 0x251C:
+        f = U | D | R;
+        break;
+    case 0x2523:
+        f = U | D | R | H;
+        break;
+    case 0x2524:
+        f = U | D | L;
+        break;
+    case 0x252B:
+        f = U | D | L | H;
+        break;
+    case 0x252C:
+        f = D | L | R;
+        break;
+    case 0x2533:
+        f = D | L | R | H;
+        break;
+    case 0x2534:
+        f = U | L | R;
+        break;
+    case 0x253B:
+        f = U | L | R | H;
+        break;
+    case 0x253C:
+        f = U | D | L | R;
+        break;
+    case 0x254B:
+        f = U | D | L | R | H;
+        break;
+    case 0x2550:
+        f = L | R | Db;
+        break;
+    case 0x2551:
+        f = U | D | Db;
+        break;
+    case 0x2554:
+        f = D | R | Db;
+        break;
+    case 0x2557:
+        f = D | L | Db;
+        break;
+    case 0x255A:
+        f = U | R | Db;
+        break;
+    case 0x255D:
+        f = U | L | Db;
+        break;
+    case 0x2560:
+        f = U | D | R | Db;
+        break;
+    case 0x2563:
+        f = U | D | L | Db;
+        break;
+    case 0x2566:
+        f = D | L | R | Db;
+        break;
+    case 0x2569:
+        f = U | L | R | Db;
+        break;
+    case 0x256C:
+        f = U | D | L | R | Db;
+        break;
+    }
+
+    if (f == 0) {
+        p.setPen(fg);
+        p.drawText(r, Qt::AlignCenter, QString::fromUcs4((const char32_t *)&c, 1));
+        return;
+    }
+
+    p.setPen(Qt::NoPen);
+    p.setBrush(fg);
+    int cx = r.center().x();
+    int cy = r.center().y();
+    int t = (f & H) ? 2 : 1;
+
+    if (f & Db) {
+        int g = 1; // gap
+        if (f & U) {
+            p.drawRect(cx - 1, r.top(), 1, cy - r.top() + g);
+            p.drawRect(cx + 1, r.top(), 1, cy - r.top() + g);
+        }
+        if (f & D) {
+            p.drawRect(cx - 1, cy - g, 1, r.bottom() - cy + 1 + g);
+            p.drawRect(cx + 1, cy - g, 1, r.bottom() - cy + 1 + g);
+        }
+        if (f & L) {
+            p.drawRect(r.left(), cy - 1, cx - r.left() + g, 1);
+            p.drawRect(r.left(), cy + 1, cx - r.left() + g, 1);
+        }
+        if (f & R) {
+            p.drawRect(cx - g, cy - 1, r.right() - cx + 1 + g, 1);
+            p.drawRect(cx - g, cy + 1, r.right() - cx + 1 + g, 1);
+        }
+    } else {
+        if (f & U) {
+            p.drawRect(cx, r.top(), t, cy - r.top() + t);
+        }
+        if (f & D) {
+            p.drawRect(cx, cy, t, r.bottom() - cy + 1);
+        }
+        if (f & L) {
+            p.drawRect(r.left(), cy, cx - r.left() + t, t);
+        }
+        if (f & R) {
+            p.drawRect(cx, cy, r.right() - cx + 1, t);
+        }
+    }
+}
+
+quint8 GlyphCache::styleFor(const VTermScreenCellAttrs &attrs) {
+    quint8 style = 0;
+    if (attrs.bold) {
+        style |= Bold;
+    }
+    if (attrs.italic) {
+        style |= Italic;
+    }
+    if (attrs.underline) {
+        style |= Underline;
+    }
+    if (attrs.strike) {
+        style |= Strike;
+    }
+    return style;
+}
+
+QFont GlyphCache::styledFont(const QFont &base, quint8 style) {
+    // Only adds decorations, style 0 is the base font as configured
+    QFont f = base;
+    if (style & Bold) {
+        f.setBold(true);
+    }
+    if (style & Italic) {
+        f.setItalic(true);
+    }
+    if (style & Underline) {
+        f.setUnderline(true);
+    }
+    if (style & Strike) {
+        f.setStrikeOut(true);
+    }
+    return f;
+}
+
+void GlyphCache::setup(const QFont &font, const QSize &cellSize, qreal dpr) {
+    if (matches(font, cellSize, dpr)) {
+        return;
+    }
+    m_font = font;
+    m_cellSize = cellSize;
+    m_dpr = dpr;
+    m_tileWidth = qCeil(cellSize.width() * dpr);
+    m_tileHeight = qCeil(cellSize.height() * dpr);
+    m_atlas = QImage();
+    clear();
+}
+
+void GlyphCache::clear() {
+    m_glyphs.clear();
+    m_generation++;
+    m_revision++;
+    m_nextX = 0;
+    m_nextY = 0;
+}
+
+void GlyphCache::release() {
+    clear();
+    m_atlas = QImage();
+}
+
+QRectF GlyphCache::glyph(const uint32_t *chars, int count, int width, quint8 style, QRgb fg) {
+    Key key;
+    memset(&key, 0, sizeof(key));
+    count = std::min(count, (int)VTERM_MAX_CHARS_PER_CELL);
+    memcpy(key.chars, chars, count * sizeof(uint32_t));
+    key.fg = fg;
+    key.width = (quint8)width;
+    key.style = style;
+
+    auto it = m_glyphs.constFind(key);
+    if (it != m_glyphs.constEnd()) {
+        return *it;
+    }
+
+    QRect tile = allocate(width);
+    if (tile.isEmpty()) {
+        return QRectF();
+    }
+    rasterize(key, count, tile);
+    QRectF source(tile.x(), tile.y(), m_cellSize.width() * width * m_dpr,
+                  m_cellSize.height() * m_dpr);
+    m_glyphs.insert(key, source);
+    return source;
+}
+
+QRect GlyphCache::allocate(int width) {
+    if (m_tileWidth <= 0 || m_tileHeight <= 0) {
+        return QRect();
+    }
+    int w = m_tileWidth * width;
+    if (w > AtlasSize || m_tileHeight > AtlasSize) {
+        return QRect();
+    }
+    if (m_atlas.isNull()) {
+        m_atlas = QImage(AtlasSize, AtlasSize, QImage::Format_ARGB32_Premultiplied);
+    }
+    if (m_nextX + w > AtlasSize) {
+        m_nextX = 0;
+        m_nextY += m_tileHeight;
+    }
+    if (m_nextY + m_tileHeight > AtlasSize) {
+        // Full, start over. Callers blit right after lookup, so nothing holds old rects.
+        clear();
+    }
+    QRect tile(m_nextX, m_nextY, w, m_tileHeight);
+    m_nextX += w;
+    return tile;
+}
+
+void GlyphCache::rasterize(const Key &key, int count, const QRect &tile) {
+    m_revision++;
+    QPainter p(&m_atlas);
+    p.setCompositionMode(QPainter::CompositionMode_Source);
+    p.fillRect(tile, Qt::transparent);
+    p.setCompositionMode(QPainter::CompositionMode_SourceOver);
+    p.setRenderHint(QPainter::Antialiasing, false);
+    p.setRenderHint(QPainter::TextAntialiasing,
+                    !(m_font.styleStrategy() & QFont::NoAntialias));
+    p.setClipRect(tile);
+    p.translate(tile.x(), tile.y());
+    p.scale(m_dpr, m_dpr);
+
+    QRect cell(0, 0, m_cellSize.width() * key.width, m_cellSize.height());
+    QColor fg = QColor::fromRgb(key.fg);
+    p.setFont(styledFont(m_font, key.style));
+    if (key.style & BoxDrawing) {
+        drawBoxChar(p, cell, key.chars[0], fg);
+        return;
+    }
+    p.setPen(fg);
+    p.drawText(cell, Qt::AlignCenter, QString::fromUcs4((const char32_t *)key.chars, count));
+}
@@ -0,0 +1,75 @@
+// SPDX-License-Identifier: MIT
+// Author: Diego Iastrubni <diegoiast@gmail.com>
+
+#pragma once
+
+#include <vterm.h>
+
+#include <QColor>
+#include <QFont>
+#include <QHash>
+#include <QImage>
+#include <QPainter>
+#include <QRect>
+
+bool isBoxChar(uint32_t c);
+void drawBoxChar(QPainter &p, const QRect &r, uint32_t c, const QColor &fg);
+
+// Rasterizes every distinct (text, style, color) combination once into an atlas image, so
+// drawing a cell becomes a single blit. Glyphs are stored in device pixels, the atlas is
+// dropped whenever the font, cell size or device pixel ratio change. When the atlas fills up
+// it is cleared and refilled with whatever is drawn next. Terminals drawing with the same font
+// share one through SharedResources.
+class GlyphCache {
+  public:
+    enum Style : quint8 { Bold = 1, Italic = 2, Underline = 4, Strike = 8, BoxDrawing = 16 };
+
+    static quint8 styleFor(const VTermScreenCellAttrs &attrs);
+    static QFont styledFont(const QFont &base, quint8 style);
+
+    // Cheap when nothing changed, otherwise drops all glyphs
+    void setup(const QFont &font, const QSize &cellSize, qreal dpr);
+    bool matches(const QFont &font, const QSize &cellSize, qreal dpr) const {
+        return font == m_font && cellSize == m_cellSize && qFuzzyCompare(dpr, m_dpr);
+    }
+    void clear();
+    // Also frees the atlas, it is allocated again by the next glyph
+    void release();
+
+    // Returns the atlas rectangle (device pixels) holding the glyph, rasterizing it on first
+    // use. An empty rectangle means it does not fit and must be drawn directly.
+    QRectF glyph(const uint32_t *chars, int count, int width, quint8 style, QRgb fg);
+    const QImage &atlas() const { return m_atlas; }
+    int size() const { return m_glyphs.size(); }
+    // Bumped whenever rectangles handed out before become invalid, and whenever the atlas
+    // gains a glyph, for users keeping a copy of the atlas
+    int generation() const { return m_generation; }
+    quint64 revision() const { return m_revision; }
+
+  private:
+    struct Key {
+        uint32_t chars[VTERM_MAX_CHARS_PER_CELL];
+        QRgb fg;
+        quint8 width;
+        quint8 style;
+        bool operator==(const Key &o) const = default;
+    };
+    friend size_t qHash(const Key &k, size_t seed = 0) {
+        return qHashMulti(seed, qHashBits(k.chars, sizeof(k.chars)), k.fg, k.width, k.style);
+    }
+
+    QRect allocate(int width);
+    void rasterize(const Key &key, int count, const QRect &tile);
+
+    QHash<Key, QRectF> m_glyphs;
+    QImage m_atlas;
+    QFont m_font;
+    QSize m_cellSize;
+    qreal m_dpr = 0;
+    int m_tileWidth = 0;
+    int m_tileHeight = 0;
+    int m_nextX = 0;
+    int m_nextY = 0;
+    int m_generation = 0;
+    quint64 m_revision = 0;
+};
@@ -2,7 +2,20 @@
 // Author: Diego Iastrubni <diegoiast@gmail.com>
 
 #include "KodoTerm/KodoTerm.hpp"
-#include "PtyProcess.h"
+#include "DirtySpans.h"
+#include "GlyphCache.h"
+#include "KodoTerm/KodoTermCore.hpp"
+#include "LinkCache.h"
+#include "Scrollback.h"
+#include "ScrollbackSearch.h"
+#include "SessionLogger.h"
+#include "SessionRestore.h"
+#include "SharedResources.h"
+#include "TerminalSnapshot.h"
+#include "TerminalState.h"
+#ifdef KODOTERM_OPENGL
+#include "GlTerminalView.h"
+#endif
 
 #include <vterm.h>
 
@@ -14,27 +27,32 @@
 #include <QDesktopServices>
 #include <QDir>
 #include <QFile>
+#include <QFileDialog>
 #include <QFileInfo>
 #include <QJsonDocument>
 #include <QJsonObject>
 #include <QKeyEvent>
 #include <QMap>
 #include <QMenu>
+#include <QMessageBox>
 #include <QMouseEvent>
 #include <QPainter>
+#include <QPointer>
 #include <QRegularExpression>
+#include <QSaveFile>
 #include <QSettings>
 #include <QTextStream>
+#include <QThreadPool>
 #include <QUrl>
 #include <algorithm>
+#include <cmath>
 #include <cstring>
 
-static void vterm_output_callback(const char *s, size_t len, void *user) {
-    auto *pty = static_cast<PtyProcess *>(user);
-    if (pty) {
-        pty->write(QByteArray(s, (int)len));
-    }
-}
+// Granularity at which the parse budget is checked
+static constexpr qsizetype ParseSliceSize = 16 * 1024;
+
+// Per cell highlight state, cached next to the cell contents
+enum : uint8_t { CellSelected = 1, CellMatch = 2, CellCurrentMatch = 4 };
 
 static VTermColor toVTermColor(const QColor &c) {
     VTermColor vc;
@@ -45,44 +63,62 @@ static VTermColor toVTermColor(const QColor &c) {
     return vc;
 }
 
+// Core rects have x = column and y = row
+static VTermRect toVTermRect(const QRect &r) {
+    return {r.top(), r.bottom() + 1, r.left(), r.right() + 1};
+}
+
 void KodoTerm::setConfig(const KodoTermConfig &config) {
     m_config = config;
+    m_core->setMaxScrollback(m_config.maxScrollback);
     setFont(m_config.font);
+    applyScrollbackTiering();
     setTheme(m_config.theme);
+    applyRenderBackend();
 
     // Force a full redraw by resetting cell size and calling updateTerminalSize
     m_cellSize = QSize(0, 0);
     updateTerminalSize();
 }
 
+void KodoTerm::applyScrollbackTiering() {
+    m_core->scrollback()->setTiering(
+        m_config.scrollbackHotLines, (qint64)m_config.scrollbackMemoryLimit * 1024 * 1024,
+        m_config.scrollbackSpillToDisk ? m_config.logDirectory : QString());
+}
+
 void KodoTerm::setTheme(const TerminalTheme &theme) {
     m_config.theme = theme;
-    VTermState *state = vterm_obtain_state(m_vterm);
+    VTermState *state = vterm_obtain_state(m_core->vterm());
     VTermColor fg = toVTermColor(theme.foreground), bg = toVTermColor(theme.background);
     vterm_state_set_default_colors(state, &fg, &bg);
     for (int i = 0; i < 16; ++i) {
         VTermColor c = toVTermColor(theme.palette[i]);
         vterm_state_set_palette_color(state, i, &c);
     }
-    for (int i = 0; i < 256; ++i) {
-        m_paletteCacheValid[i] = false;
-    }
-    for (auto &cell : m_cellCache) {
-        cell.chars[0] = (uint32_t)-1;
+    m_palette = SharedResources::palette(theme, state);
+#ifdef KODOTERM_OPENGL
+    if (m_gpuView) {
+        m_gpuView->setBackground(mapRgb(bg, state));
     }
+#endif
+    invalidateCellCache();
     damageAll();
 }
 
 KodoTerm::KodoTerm(QWidget *parent) : QWidget(parent) {
     m_restoring = false;
-    for (int i = 0; i < 256; ++i) {
-        m_paletteCacheValid[i] = false;
-    }
     setAttribute(Qt::WA_OpaquePaintEvent);
     setAttribute(Qt::WA_NoSystemBackground);
-    memset(&m_lastVTermFg, 0, sizeof(VTermColor));
-    memset(&m_lastVTermBg, 0, sizeof(VTermColor));
     m_config.font.setStyleHint(QFont::Monospace);
+    m_core = new KodoTermCore(25, 80, this);
+    m_core->setMaxScrollback(m_config.maxScrollback);
+    m_core->setPaced(true);
+    m_search = new ScrollbackSearch(this);
+    m_links = new LinkCache;
+    m_dirtySpans = new DirtySpans;
+    m_logger = new SessionLogger;
+    applyScrollbackTiering();
     setFocusPolicy(Qt::StrongFocus);
     m_scrollBar = new QScrollBar(Qt::Vertical, this);
     m_scrollBar->setRange(0, 0);
@@ -96,38 +132,23 @@ KodoTerm::KodoTerm(QWidget *parent) : QWidget(parent) {
     m_restorationBannerTimer->setInterval(3000);
     connect(m_restorationBannerTimer, &QTimer::timeout, this, [this]() {
         m_restorationBannerActive = false;
-        update();
+        updateView();
     });
+    m_checkpointTimer = new QTimer(this);
+    connect(m_checkpointTimer, &QTimer::timeout, this, &KodoTerm::writeCheckpoint);
+    m_frameTimer = new QTimer(this);
+    m_frameTimer->setSingleShot(true);
+    m_frameTimer->setTimerType(Qt::PreciseTimer);
+    connect(m_frameTimer, &QTimer::timeout, this, &KodoTerm::processFrame);
     connect(m_cursorBlinkTimer, &QTimer::timeout, this, [this]() {
-        if (m_cursorBlink) {
+        if (m_core->cursorBlink()) {
             m_cursorBlinkState = !m_cursorBlinkState;
-            QRect r(m_cursorCol * m_cellSize.width(), m_cursorRow * m_cellSize.height(),
-                    m_cellSize.width(), m_cellSize.height());
-            update(r);
+            const QPoint cursor = m_core->cursor();
+            updateView(QRect(cursor.x() * m_cellSize.width(), cursor.y() * m_cellSize.height(),
+                             m_cellSize.width(), m_cellSize.height()));
         }
     });
-    m_vterm = vterm_new(25, 80);
-    if (!m_vterm) {
-        return;
-    }
-    vterm_set_utf8(m_vterm, 1);
-    m_vtermScreen = vterm_obtain_screen(m_vterm);
-    if (!m_vtermScreen) {
-        return;
-    }
-    vterm_screen_enable_altscreen(m_vtermScreen, 1);
-    static VTermScreenCallbacks callbacks = {.damage = &KodoTerm::onDamage,
-                                             .moverect = &KodoTerm::onMoveRect,
-                                             .movecursor = &KodoTerm::onMoveCursor,
-                                             .settermprop = &KodoTerm::onSetTermProp,
-                                             .bell = &KodoTerm::onBell,
-                                             .resize = nullptr,
-                                             .sb_pushline = &KodoTerm::onSbPushLine,
-                                             .sb_popline = &KodoTerm::onSbPopLine,
-                                             .sb_clear = nullptr,
-                                             .sb_pushline4 = nullptr};
-    vterm_screen_set_callbacks(m_vtermScreen, &callbacks, this);
-    vterm_screen_reset(m_vtermScreen, 1);
+    connectCore();
     if (!m_environment.contains("TERM")) {
         m_environment.insert("TERM", "xterm-256color");
     }
@@ -135,108 +156,320 @@ KodoTerm::KodoTerm(QWidget *parent) : QWidget(parent) {
         m_environment.insert("COLORTERM", "truecolor");
     }
     setTheme(m_config.theme);
-    resetDirtyRect();
-    VTermState *state = vterm_obtain_state(m_vterm);
-    static VTermStateFallbacks fallbacks = {.control = nullptr,
-                                            .csi = nullptr,
-                                            .osc = &KodoTerm::onOsc,
-                                            .dcs = nullptr,
-                                            .apc = nullptr,
-                                            .pm = nullptr,
-                                            .sos = nullptr};
-    vterm_state_set_unrecognised_fallbacks(state, &fallbacks, this);
+    m_dirtySpans->clear();
+}
+
+// The core is parsed from within parseInput(), its signals arrive while it parses
+void KodoTerm::connectCore() {
+    connect(m_core, &KodoTermCore::damaged, this, [this]() {
+        if (m_pendingLogReplay.isEmpty() && isVisible()) {
+            requestUpdate();
+        }
+    });
+    connect(m_core, &KodoTermCore::moved, this, &KodoTerm::onCoreMoved);
+    connect(m_core, &KodoTermCore::scrollbackPushed, this, &KodoTerm::onScrollbackPushed);
+    connect(m_core, &KodoTermCore::scrollbackPopped, this, &KodoTerm::onScrollbackPopped);
+    connect(m_core, &KodoTermCore::altScreenChanged, this, &KodoTerm::onAltScreenChanged);
+    connect(m_core, &KodoTermCore::cursorBlinkChanged, this, &KodoTerm::onCursorBlinkChanged);
+    connect(m_core, &KodoTermCore::titleChanged, this, [this](const QString &title) {
+        if (!m_pendingLogReplay.isEmpty()) {
+            return;
+        }
+        setWindowTitle(title);
+    });
+    connect(m_core, &KodoTermCore::cwdChanged, this, &KodoTerm::cwdChanged);
+    connect(m_core, &KodoTermCore::bell, this, &KodoTerm::ringBell);
+    connect(m_core, &KodoTermCore::received, this, &KodoTerm::onCoreReceived);
+    connect(m_core, &KodoTermCore::foregroundChanged, this, &KodoTerm::foregroundChanged);
+    connect(m_core, &KodoTermCore::finished, this, &KodoTerm::finished);
 }
 
 KodoTerm::~KodoTerm() {
-    if (m_replayFile) {
-        m_replayFile->close();
-        delete m_replayFile;
-    }
-    if (m_pty) {
-        m_pty->kill();
-    }
-    if (m_vterm) {
-        vterm_free(m_vterm);
-    }
+    writeCheckpoint(false);
+    delete m_restoreJob;
+    delete m_logger;
+    m_core->kill();
+    delete m_links;
+    delete m_dirtySpans;
 }
 
 bool KodoTerm::start(bool reset) {
-    if (m_pty) {
-        m_pty->kill();
-        delete m_pty;
-        m_pty = nullptr;
+    if (m_restoreJob) {
+        delete m_restoreJob;
+        m_restoreJob = nullptr;
+        m_restoring = false;
+        m_restorationBannerActive = false;
     }
+    // The previous child goes, along with its output not parsed and its input not sent yet
+    m_core->kill();
     if (reset) {
         resetTerminal();
     }
-    setupPty();
     if (m_program.isEmpty()) {
         return false;
     }
-    m_pty->setProgram(m_program);
-    m_pty->setArguments(m_arguments);
-    m_pty->setWorkingDirectory(m_workingDirectory);
-    m_pty->setProcessEnvironment(m_environment);
+    m_core->setThreadedReader(m_config.threadedPtyReader);
     if (m_config.enableLogging) {
         QDir logDir(m_config.logDirectory);
         if (!logDir.exists()) {
             logDir.mkpath(".");
         }
         QString timestamp = QDateTime::currentDateTime().toString("yyyyMMdd_HHmmss_zzz");
-        m_logFile.setFileName(logDir.filePath(QString("kodoterm_%1.log").arg(timestamp)));
-        if (m_logFile.open(QIODevice::WriteOnly)) {
-            QString h = QString("-- KodoTerm Session Log ---\nProgram: %1\nArguments: %2\nCWD: "
-                                "%3\nLOG_START_MARKER\n")
-                            .arg(m_program)
-                            .arg(m_arguments.join(" "))
-                            .arg(m_workingDirectory);
-            m_logFile.write(h.toUtf8());
-            m_logFile.flush();
+        QString h = QString("-- KodoTerm Session Log ---\nProgram: %1\nArguments: %2\nCWD: "
+                            "%3\nLOG_START_MARKER\n")
+                        .arg(m_program)
+                        .arg(m_arguments.join(" "))
+                        .arg(m_workingDirectory);
+        SessionLogger::Options options;
+        options.flushInterval = m_config.logFlushInterval;
+        options.flushSize = (qint64)m_config.logFlushSize * 1024;
+        options.compress = m_config.logCompression;
+        m_logBytes = 0;
+        m_checkpointOffset = -1;
+        if (m_logger->open(logDir.filePath(QString("kodoterm_%1.log").arg(timestamp)),
+                           h.toUtf8(), options) &&
+            m_config.checkpointInterval > 0) {
+            m_checkpointTimer->start(m_config.checkpointInterval * 1000);
         }
     }
     updateTerminalSize();
-    int r, c;
-    vterm_get_size(m_vterm, &r, &c);
-    return m_pty->start(QSize(c, r));
+    return m_core->start(m_program, m_arguments, m_workingDirectory, m_environment);
 }
 
-void KodoTerm::setupPty() {
-    if (m_pty) {
+void KodoTerm::onPtyReadyRead(const QByteArray &data) { m_core->receive(data); }
+
+void KodoTerm::onCoreReceived(const QByteArray &data) {
+    writeLog(data);
+    scheduleFrame();
+}
+
+void KodoTerm::writeToTerminal(const QByteArray &data) {
+    if (data.isEmpty()) {
         return;
     }
-    m_pty = PtyProcess::create(this);
-    if (!m_pty) {
+    writeLog(data);
+    parseInput(data.constData(), data.size());
+}
+
+void KodoTerm::parseInput(const char *data, size_t size) {
+    QElapsedTimer timer;
+    timer.start();
+    m_core->feed(QByteArray::fromRawData(data, (qsizetype)size));
+    recordParse(size, timer.nsecsElapsed());
+}
+
+void KodoTerm::recordParse(size_t size, qint64 ns) {
+    m_stats.bytesIngested += size;
+    m_stats.parseTimeNs += ns;
+    m_statsPending.bytes += size;
+    m_statsPending.parseTimeNs += ns;
+}
+
+void KodoTerm::writeLog(const QByteArray &data) {
+    if (!m_logger->isOpen()) {
         return;
     }
-    connect(m_pty, &PtyProcess::readyRead, this, &KodoTerm::onPtyReadyRead);
-    connect(m_pty, &PtyProcess::finished, this, &KodoTerm::finished);
-    vterm_output_set_callback(m_vterm, vterm_output_callback, m_pty);
+    // Only queues the data, the time measured here is what the GUI thread pays. The disk
+    // time is measured by the writer thread.
+    QElapsedTimer timer;
+    timer.start();
+    m_logger->write(data);
+    m_logBytes += data.size();
+    qint64 ns = timer.nsecsElapsed();
+    m_statsPending.logEnqueues++;
+    m_statsPending.logEnqueueNs += ns;
+    m_statsPending.maxLogEnqueueNs = std::max(m_statsPending.maxLogEnqueueNs, ns);
 }
 
-void KodoTerm::flushTerminal() {
-    if (m_vtermScreen) {
-        vterm_screen_flush_damage(m_vtermScreen);
+void KodoTerm::scheduleFrame() {
+    if (m_frameTimer->isActive()) {
+        return;
     }
+    int fps = std::clamp(m_config.targetFrameRate, 1, 1000);
+    qint64 interval = 1000 / fps;
+    // After an idle period the first chunk (usually a keystroke echo) is handled right away,
+    // under load we produce at most one frame per interval.
+    qint64 elapsed = m_lastFrame.isValid() ? m_lastFrame.elapsed() : interval;
+    m_frameTimer->start((int)std::max<qint64>(0, interval - elapsed));
+}
+
+void KodoTerm::requestUpdate() {
+    m_updatePending = true;
+    scheduleFrame();
 }
-void KodoTerm::onPtyReadyRead(const QByteArray &data) {
-    if (!data.isEmpty()) {
-        if (m_logFile.isOpen()) {
-            m_logFile.write(data);
-            m_logFile.flush();
+
+void KodoTerm::processFrame() {
+    m_lastFrame.restart();
+    // Output arriving during a session restore waits for the restored screen
+    if (!m_restoreJob && m_core->pendingBytes() > 0) {
+        QElapsedTimer budget;
+        budget.start();
+        qint64 budgetNs = std::max(1, m_config.maxParseTimePerFrame) * 1000000LL;
+        while (m_core->pendingBytes() > 0) {
+            QElapsedTimer timer;
+            timer.start();
+            const qsizetype n = m_core->parsePending(ParseSliceSize);
+            recordParse(n, timer.nsecsElapsed());
+            if (budget.nsecsElapsed() >= budgetNs) {
+                break;
+            }
+        }
+    }
+    takeCoreDamage();
+    if (m_updatePending || m_dirty) {
+        m_updatePending = false;
+        if (!m_restoring) {
+            updateDamaged();
         }
-        vterm_input_write(m_vterm, data.constData(), data.size());
-        flushTerminal();
+    }
+    // Damage reported while parsing is already covered by this frame
+    m_frameTimer->stop();
+    if (!m_restoreJob && m_core->pendingBytes() > 0) {
+        scheduleFrame();
+    }
+    updateStats();
+}
+
+void KodoTerm::recordFrameTime(qint64 ns) {
+    int bucket = 0;
+    while (bucket < KodoTermStats::FrameTimeBuckets - 1 &&
+           ns > KodoTermStats::FrameTimeLimits[bucket] * 1000000LL) {
+        bucket++;
+    }
+    m_stats.frameTimeHistogram[bucket]++;
+    m_stats.frames++;
+    m_statsPending.frames++;
+    m_statsPending.frameTimeNs += ns;
+}
+
+void KodoTerm::updateStats() {
+    if (!m_statsWindow.isValid()) {
+        m_statsWindow.start();
+        return;
+    }
+    qint64 elapsed = m_statsWindow.elapsed();
+    if (elapsed < 1000) {
+        return;
+    }
+    const double seconds = elapsed / 1000.0;
+    const auto &p = m_statsPending;
+    m_stats.bytesPerSecond = p.bytes / seconds;
+    m_stats.parseTimePerSecondMs = p.parseTimeNs / 1e6 / seconds;
+    m_stats.framesPerSecond = p.frames / seconds;
+    m_stats.averageFrameTimeMs = p.frames ? p.frameTimeNs / 1e6 / p.frames : 0;
+    m_stats.averageDamageCells = p.frames ? (double)p.damageCells / p.frames : 0;
+    const SessionLogger::DiskStats disk = m_logger->takeDiskStats();
+    m_stats.logWrites += disk.operations;
+    m_stats.logWriteLatencyMs = disk.operations ? disk.totalNs / 1e6 / disk.operations : 0;
+    m_stats.maxLogWriteLatencyMs = disk.maxNs / 1e6;
+    m_stats.logEnqueueLatencyMs = p.logEnqueues ? p.logEnqueueNs / 1e6 / p.logEnqueues : 0;
+    m_stats.maxLogEnqueueLatencyMs = p.maxLogEnqueueNs / 1e6;
+    m_statsPending = {};
+    m_statsWindow.restart();
+    if (m_config.statsOverlay) {
+        updateView();
+    }
+    emit statsUpdated(stats());
+}
+
+KodoTermStats KodoTerm::stats() const {
+    KodoTermStats s = m_stats;
+    s.scrollbackLines = m_core->scrollback()->size();
+    s.scrollbackBytes = (qint64)m_core->scrollback()->memoryUsage();
+    return s;
+}
+
+void KodoTerm::resetStats() {
+    m_stats = {};
+    m_statsPending = {};
+    m_logger->takeDiskStats();
+    m_statsWindow.invalidate();
+}
+
+void KodoTerm::setStatsOverlayVisible(bool visible) {
+    m_config.statsOverlay = visible;
+    updateView();
+}
+
+void KodoTerm::drawStatsOverlay(QPainter &painter) {
+    const KodoTermStats s = stats();
+    QStringList lines;
+    lines << QString("%1 KB/s in, parse %2 ms/s")
+                 .arg(s.bytesPerSecond / 1024, 0, 'f', 1)
+                 .arg(s.parseTimePerSecondMs, 0, 'f', 1);
+    lines << QString("%1 fps, frame %2 ms")
+                 .arg(s.framesPerSecond, 0, 'f', 1)
+                 .arg(s.averageFrameTimeMs, 0, 'f', 2);
+    lines << QString("damage %1 cells, redrawn %2 / skipped %3")
+                 .arg(s.averageDamageCells, 0, 'f', 0)
+                 .arg(s.cellsRedrawn)
+                 .arg(s.cellsSkipped);
+    QString histogram;
+    for (qint64 count : s.frameTimeHistogram) {
+        histogram += QString::number(count) + ' ';
+    }
+    lines << QString("frame ms <1,2,4,8,16,33,66,+: %1").arg(histogram.trimmed());
+    lines << QString("scrollback %1 lines, %2 KB")
+                 .arg(s.scrollbackLines)
+                 .arg(s.scrollbackBytes / 1024);
+    if (s.logWrites) {
+        lines << QString("log write %1 ms, max %2 ms, enqueue %3 ms, max %4 ms")
+                     .arg(s.logWriteLatencyMs, 0, 'f', 2)
+                     .arg(s.maxLogWriteLatencyMs, 0, 'f', 2)
+                     .arg(s.logEnqueueLatencyMs, 0, 'f', 2)
+                     .arg(s.maxLogEnqueueLatencyMs, 0, 'f', 2);
+    }
+
+    QFont f = font();
+    if (f.pointSizeF() > 0) {
+        f.setPointSizeF(std::max(6.0, f.pointSizeF() * 0.8));
+    }
+    painter.setFont(f);
+    painter.setCompositionMode(QPainter::CompositionMode_SourceOver);
+    QFontMetrics fm(f);
+    int w = 0;
+    for (const QString &line : lines) {
+        w = std::max(w, fm.horizontalAdvance(line));
+    }
+    int sb = m_scrollBar->isVisible() ? m_scrollBar->width() : 0;
+    QRect r(width() - sb - w - 16, 4, w + 12, fm.height() * lines.size() + 8);
+    painter.fillRect(r, QColor(0, 0, 0, 180));
+    painter.setPen(Qt::green);
+    int y = r.top() + 4 + fm.ascent();
+    for (const QString &line : lines) {
+        painter.drawText(r.left() + 6, y, line);
+        y += fm.height();
     }
 }
 void KodoTerm::onScrollValueChanged(int value) {
-    if (m_vterm && !m_backBuffer.isNull()) {
-        VTermState *state = vterm_obtain_state(m_vterm);
+    m_links->invalidateAll();
+    bool atBottom = value == m_scrollBar->maximum();
+    bool following = m_viewAtBottom && atBottom;
+    int delta = value - m_viewTop;
+    m_viewTop = value;
+    m_viewAtBottom = atBottom;
+    const int rows = m_core->rows();
+    if (value < m_core->scrollback()->rows()) {
+        // Inflate cold pages now rather than one by one while painting
+        m_core->scrollback()->prefetchRows(value, rows);
+    }
+    // While following the output the screen scrolls the back buffer itself
+    if (following || !isVisible()) {
+        return;
+    }
+    if ((m_gpuView || !m_backBuffer.isNull()) && std::abs(delta) < rows) {
+        scrollRows(0, rows, delta);
+        m_dirty = true;
+        updateView();
+        return;
+    }
+    if (!m_backBuffer.isNull()) {
+        m_pendingScroll.active = false;
+        VTermState *state = vterm_obtain_state(m_core->vterm());
         VTermColor dfg, dbg;
         vterm_state_get_default_colors(state, &dfg, &dbg);
         m_backBuffer.fill(mapColor(dbg, state));
-        for (auto &cell : m_cellCache) {
-            cell.chars[0] = (uint32_t)-1;
-        }
+        invalidateCellCache();
     }
     damageAll();
 }
@@ -244,96 +477,27 @@ void KodoTerm::scrollUp(int lines) { m_scrollBar->setValue(m_scrollBar->value()
 void KodoTerm::scrollDown(int lines) { m_scrollBar->setValue(m_scrollBar->value() + lines); }
 void KodoTerm::pageUp() { scrollUp(m_scrollBar->pageStep()); }
 void KodoTerm::pageDown() { scrollDown(m_scrollBar->pageStep()); }
-int KodoTerm::onSbPushLine(int cols, const VTermScreenCell *cells, void *user) {
-    return static_cast<KodoTerm *>(user)->pushScrollback(cols, cells);
-}
-int KodoTerm::onSbPopLine(int cols, VTermScreenCell *cells, void *user) {
-    return static_cast<KodoTerm *>(user)->popScrollback(cols, cells);
-}
-
-int KodoTerm::onOsc(int command, VTermStringFragment frag, void *user) {
-    auto *w = static_cast<KodoTerm *>(user);
-    if (frag.initial) {
-        w->m_oscBuffer.clear();
-    }
-    w->m_oscBuffer.append(frag.str, frag.len);
-    if (frag.final && command == 7) {
-        QString s = QString::fromUtf8(w->m_oscBuffer);
-        while (!s.isEmpty() &&
-               (s.endsWith(';') || s.endsWith('') || s.endsWith('\n') || s.endsWith(' '))) {
-            s.chop(1);
-        }
-        if (s.startsWith("file://")) {
-            QUrl u(s);
-            QString p = u.toLocalFile();
-            if (p.isEmpty() || (p.startsWith("//") && !u.host().isEmpty())) {
-                p = u.path();
-            }
-            if (!p.isEmpty() && w->m_cwd != p) {
-                w->m_cwd = p;
-                emit w->cwdChanged(p);
-            }
-        } else if (!s.isEmpty() && w->m_cwd != s) {
-            w->m_cwd = s;
-            emit w->cwdChanged(s);
-        }
-    }
-    return 1;
-}
-
-int KodoTerm::pushScrollback(int cols, const VTermScreenCell *cells) {
-    if (m_altScreen) {
-        return 0;
-    }
-    SavedLine line;
-    line.reserve(cols);
-    for (int i = 0; i < cols; ++i) {
-        SavedCell sc;
-        memcpy(sc.chars, cells[i].chars, sizeof(sc.chars));
-        sc.attrs = cells[i].attrs;
-        sc.fg = cells[i].fg;
-        sc.bg = cells[i].bg;
-        sc.width = cells[i].width;
-        line.push_back(sc);
-    }
-    m_scrollback.push_back(std::move(line));
-    if ((int)m_scrollback.size() > m_config.maxScrollback) {
-        m_scrollback.pop_front();
-    }
+void KodoTerm::onScrollbackPushed() {
+    m_links->invalidateAll();
     bool bottom = m_scrollBar->value() == m_scrollBar->maximum();
-    m_scrollBar->setRange(0, (int)m_scrollback.size());
+    m_scrollBar->setRange(0, m_core->scrollback()->rows());
     if (bottom) {
         m_scrollBar->setValue(m_scrollBar->maximum());
+    } else {
+        // The view stays put while the lines under it shift
+        damageAll();
     }
-    return 1;
 }
 
-int KodoTerm::popScrollback(int cols, VTermScreenCell *cells) {
-    if (m_scrollback.empty()) {
-        return 0;
-    }
-    const SavedLine &line = m_scrollback.back();
-    int n = std::min(cols, (int)line.size());
-    for (int i = 0; i < n; ++i) {
-        memcpy(cells[i].chars, line[i].chars, sizeof(cells[i].chars));
-        cells[i].attrs = line[i].attrs;
-        cells[i].fg = line[i].fg;
-        cells[i].bg = line[i].bg;
-        cells[i].width = line[i].width;
-    }
-    for (int i = n; i < cols; ++i) {
-        memset(&cells[i], 0, sizeof(VTermScreenCell));
-        cells[i].width = 1;
-    }
-    m_scrollback.pop_back();
-    m_scrollBar->setRange(0, (int)m_scrollback.size());
-    return 1;
+void KodoTerm::onScrollbackPopped() {
+    m_links->invalidateAll();
+    m_scrollBar->setRange(0, m_core->scrollback()->rows());
 }
 
 void KodoTerm::updateTerminalSize() {
-    QFontMetrics fm(m_config.font);
+    m_fontMetrics = SharedResources::fontMetrics(m_config.font);
     QSize oldCellSize = m_cellSize;
-    m_cellSize = QSize(fm.horizontalAdvance('W'), fm.height());
+    m_cellSize = m_fontMetrics->cellSize;
     if (m_cellSize.width() <= 0 || m_cellSize.height() <= 0) {
         m_cellSize = QSize(10, 20);
     }
@@ -346,137 +510,368 @@ void KodoTerm::updateTerminalSize() {
     if (cols <= 0) {
         cols = 1;
     }
-    int orows, ocols;
-    if (m_vterm) {
-        vterm_get_size(m_vterm, &orows, &ocols);
-        if (rows == orows && cols == ocols && m_cellSize == oldCellSize &&
-            m_pendingLogReplay.isEmpty()) {
-            return;
-        }
-        vterm_set_size(m_vterm, rows, cols);
-        vterm_screen_flush_damage(m_vtermScreen);
-        qreal dpr = devicePixelRatioF();
+    const qreal dpr = devicePixelRatioF();
+    bool buffersCurrent = m_backBuffer.devicePixelRatio() == dpr;
+#ifdef KODOTERM_OPENGL
+    if (m_gpuView) {
+        m_gpuView->setGeometry(0, 0, width() - sb, height());
+        buffersCurrent = m_gpuView->rows() == rows && m_gpuView->cols() == cols &&
+                         m_gpuView->cellSize() == QSizeF(m_cellSize) * dpr;
+    }
+#endif
+    if (rows == m_core->rows() && cols == m_core->cols() && m_cellSize == oldCellSize &&
+        buffersCurrent && m_pendingLogReplay.isEmpty()) {
+        return;
+    }
+    const ScrollbackBuffer *scrollback = m_core->scrollback();
+    // The row at the top of the view is looked up again once the scrollback rewrapped
+    const bool atBottom = m_scrollBar->value() == m_scrollBar->maximum();
+    int topColumn = 0;
+    const qint64 topLine =
+        scrollback->lineOf(scrollback->firstRow() + m_scrollBar->value(), &topColumn);
+    m_core->resize(rows, cols);
+    m_pendingScroll.active = false;
+    VTermState *state = vterm_obtain_state(m_core->vterm());
+    VTermColor dfg, dbg;
+    vterm_state_get_default_colors(state, &dfg, &dbg);
+    if (m_gpuView) {
+        // The cell grid is small next to a back buffer, it is kept while hidden
+        m_backBuffer = QImage();
+#ifdef KODOTERM_OPENGL
+        m_gpuView->setGrid(rows, cols, QSizeF(m_cellSize) * dpr, mapRgb(dbg, state));
+        m_gpuCursor = QPoint(-1, -1);
+#endif
+    } else if (!isVisible() && m_config.releaseHiddenBuffers) {
+        // Allocated once the terminal is shown
+        releaseBuffers();
+    } else {
         m_backBuffer = QImage(cols * m_cellSize.width() * dpr, rows * m_cellSize.height() * dpr,
                               QImage::Format_RGB32);
         m_backBuffer.setDevicePixelRatio(dpr);
-        VTermState *state = vterm_obtain_state(m_vterm);
-        VTermColor dfg, dbg;
-        vterm_state_get_default_colors(state, &dfg, &dbg);
         m_backBuffer.fill(mapColor(dbg, state));
-        m_cellCache.assign(rows * cols, VTermScreenCell{});
-        for (auto &c : m_cellCache) {
-            c.chars[0] = (uint32_t)-1;
-        }
-        m_selectedCache.assign(rows * cols, false);
-        m_scrollBar->setPageStep(rows);
-        if (m_scrollBar->value() == m_scrollBar->maximum()) {
-            m_scrollBar->setValue(m_scrollBar->maximum());
-        }
-        if (!m_pendingLogReplay.isEmpty() && cols > 40) {
-            QTimer::singleShot(100, this, &KodoTerm::processLogReplay);
-        }
+        m_cellCache.assign(rows * cols, ShadowCell{});
+        invalidateCellCache();
     }
-    if (m_pty) {
-        m_pty->resize(QSize(cols, rows));
+    m_links->resize(rows, cols);
+    m_scrollBar->setPageStep(rows);
+    m_scrollBar->setRange(0, scrollback->rows());
+    if (atBottom) {
+        m_scrollBar->setValue(m_scrollBar->maximum());
+    } else {
+        m_scrollBar->setValue(
+            (int)(scrollback->rowOf(topLine, topColumn) - scrollback->firstRow()));
+    }
+    if (!m_pendingLogReplay.isEmpty() && cols > 40) {
+        QTimer::singleShot(100, this, &KodoTerm::processLogReplay);
     }
     damageAll();
 }
 
 void KodoTerm::processLogReplay() {
-    if (m_pendingLogReplay.isEmpty() && !m_replayFile) {
+    if (m_pendingLogReplay.isEmpty() || m_restoreJob) {
         return;
     }
+    m_restoring = true;
+    m_restorationBannerActive = true;
+    m_restorationBannerText = tr("Restoring session...");
 
-    if (!m_replayFile) {
-        m_restoring = true;
-        m_restorationBannerActive = true;
-        m_restorationBannerText = tr("Restoring session...");
+    // Thorough reset
+    m_core->reset();
+    m_core->clearScrollback();
+    clearSearch();
+    m_scrollBar->setRange(0, 0);
+    m_scrollBar->setValue(0);
+
+    VTermState *state = vterm_obtain_state(m_core->vterm());
+    VTermColor dfg, dbg;
+    vterm_state_get_default_colors(state, &dfg, &dbg);
+    if (!m_backBuffer.isNull()) {
+        m_backBuffer.fill(mapColor(dbg, state));
+    }
 
-        // Thorough reset
-        vterm_screen_reset(m_vtermScreen, 1);
-        m_scrollback.clear();
-        m_scrollBar->setRange(0, 0);
-        m_scrollBar->setValue(0);
+    invalidateCellCache();
+    updateView();
 
-        VTermState *state = vterm_obtain_state(m_vterm);
-        VTermColor dfg, dbg;
-        vterm_state_get_default_colors(state, &dfg, &dbg);
-        if (!m_backBuffer.isNull()) {
-            m_backBuffer.fill(mapColor(dbg, state));
-        }
+    // A hidden tab is not laid out yet, it will get the size of the area it is shown in
+    int rows = m_core->rows(), cols = m_core->cols();
+    if (!isVisible() && parentWidget() && m_cellSize.width() > 0 && m_cellSize.height() > 0) {
+        QSize area = parentWidget()->size();
+        rows = std::max(1, area.height() / m_cellSize.height());
+        cols = std::max(1, (area.width() - m_scrollBar->sizeHint().width()) / m_cellSize.width());
+    }
 
-        for (auto &c : m_cellCache) {
-            c.chars[0] = (uint32_t)-1;
+    SessionRestore::Options options;
+    options.logPath = m_pendingLogReplay;
+    options.checkpointPath = checkpointPath(m_pendingLogReplay);
+    if (m_logger->isOpen()) {
+        options.newCheckpointPath = checkpointPath(m_logger->fileName());
+    }
+    options.rows = rows;
+    options.cols = cols;
+    options.maxScrollback = m_config.maxScrollback;
+    m_pendingLogReplay.clear();
+    m_restoreJob = new SessionRestore(options, this, [this]() {
+        if (isVisible()) {
+            attachRestore();
         }
-        m_selectedCache.assign(m_selectedCache.size(), false);
+    });
+    SessionRestore::schedule(m_restoreJob, isVisible());
+}
 
-        update();
-        m_replayFile = new QFile(m_pendingLogReplay);
-        m_pendingLogReplay.clear();
-        if (!m_replayFile->open(QIODevice::ReadOnly)) {
-            delete m_replayFile;
-            m_replayFile = nullptr;
-            m_restoring = false;
-            m_restorationBannerActive = false;
-            return;
+void KodoTerm::attachRestore() {
+    // showEvent() and the queued finish callback can both get here for the same job
+    if (!m_restoreJob || !m_restoreJob->isFinished()) {
+        return;
+    }
+    SessionRestore *job = m_restoreJob;
+    m_restoreJob = nullptr;
+    const bool restored = job->succeeded();
+    if (restored) {
+        // The child keeps running, output it wrote meanwhile is parsed into the new core
+        KodoTermCore *core = job->takeCore();
+        core->takeProcess(m_core);
+        delete m_core;
+        m_core = core;
+        m_core->setParent(this);
+        m_core->setMaxScrollback(m_config.maxScrollback);
+        m_core->setPaced(true);
+        connectCore();
+        applyScrollbackTiering();
+        if (job->checkpointWritten()) {
+            m_checkpointOffset = 0;
         }
-        // Read header
-        QByteArray header;
-        while (!m_replayFile->atEnd()) {
-            char c;
-            if (m_replayFile->getChar(&c)) {
-                header.append(c);
-                if (c == '\n' && header.endsWith("LOG_START_MARKER\n")) {
-                    break;
-                }
-                if (header.size() > 1024) { // Header too big or invalid
-                    break;
-                }
-            } else {
-                break;
-            }
+
+        // What the log left set, the new core only reports what changes from now on
+        m_scrollBar->setVisible(!m_core->altScreen());
+        onCursorBlinkChanged(m_core->cursorBlink());
+        if (!m_core->title().isEmpty()) {
+            setWindowTitle(m_core->title());
         }
     }
+    delete job;
+    m_restoring = false;
+    m_links->invalidateAll();
+
+    // The new core still has the default palette and the size the restore ran at
+    setTheme(m_config.theme);
+    m_cellSize = QSize(0, 0);
+    updateTerminalSize();
+    m_scrollBar->setRange(0, m_core->scrollback()->rows());
+    scrollToBottom();
+    if (restored) {
+        m_restorationBannerTimer->start();
+    } else {
+        m_restorationBannerActive = false;
+    }
+    damageAll();
+    // Output held back while restoring
+    scheduleFrame();
+}
 
-    if (m_replayFile) {
-        QByteArray chunk = m_replayFile->read(65536); // 64KB
-        if (!chunk.isEmpty()) {
-            onPtyReadyRead(chunk);
-            QTimer::singleShot(0, this, &KodoTerm::processLogReplay);
+void KodoTerm::showEvent(QShowEvent *event) {
+    QWidget::showEvent(event);
+    if (m_restoreJob) {
+        if (m_restoreJob->isFinished()) {
+            attachRestore();
         } else {
-            m_replayFile->close();
-            delete m_replayFile;
-            m_replayFile = nullptr;
-            onPtyReadyRead("\r\n");
-            scrollToBottom();
-            m_restoring = false;
-            m_restorationBannerTimer->start();
-            damageAll();
-            update();
+            m_restoreJob->promote();
         }
     }
+    // Nothing was drawn while hidden, one full redraw catches up
+    if (!m_gpuView &&
+        (m_backBuffer.isNull() || m_backBuffer.devicePixelRatio() != devicePixelRatioF())) {
+        m_cellSize = QSize(0, 0);
+        updateTerminalSize();
+    } else {
+        invalidateCellCache();
+        m_pendingScroll.active = false;
+    }
+    m_links->invalidateAll();
+    // Drawn again as a whole, what the core reported while hidden is covered
+    m_core->takeDamage();
+    damageAll();
 }
 
-void KodoTerm::resetDirtyRect() {
-    m_dirtyRect.start_row = 10000;
-    m_dirtyRect.start_col = 10000;
-    m_dirtyRect.end_row = -1;
-    m_dirtyRect.end_col = -1;
+void KodoTerm::hideEvent(QHideEvent *event) {
+    QWidget::hideEvent(event);
+    m_pendingScroll.active = false;
+    if (m_config.releaseHiddenBuffers) {
+        releaseBuffers();
+    }
 }
-void KodoTerm::damageAll() {
-    int r, c;
-    if (!m_vterm) {
+
+void KodoTerm::releaseBuffers() {
+    m_backBuffer = QImage();
+    m_blitRegion = QRegion();
+    m_cellCache.clear();
+    m_cellCache.shrink_to_fit();
+    m_glyphCache.reset();
+}
+
+void KodoTerm::markDirty(int top, int bottom, int startCol, int endCol) {
+    int rows, cols;
+    vterm_get_size(m_core->vterm(), &rows, &cols);
+    m_dirtySpans->mark(rows, cols, top, bottom, startCol, endCol);
+}
+
+QRect KodoTerm::cellRect(int top, int bottom, int startCol, int endCol) const {
+    return QRect(startCol * m_cellSize.width(), top * m_cellSize.height(),
+                 (endCol - startCol) * m_cellSize.width(), (bottom - top) * m_cellSize.height());
+}
+
+// Repaints what the next render and blit will change, rather than the whole widget
+void KodoTerm::updateDamaged() {
+    // The GPU view draws all of its grid every frame
+    if (m_gpuView) {
+        updateView();
+        return;
+    }
+    if (m_config.statsOverlay || m_visualBellActive || m_flowControlStopped ||
+        m_restorationBannerActive || m_backBuffer.isNull()) {
+        updateView();
         return;
     }
-    vterm_get_size(m_vterm, &r, &c);
-    m_dirtyRect.start_row = 0;
-    m_dirtyRect.start_col = 0;
-    m_dirtyRect.end_row = r;
-    m_dirtyRect.end_col = c;
+    QRegion region = m_blitRegion;
+    for (int r = m_dirtySpans->top(); r < m_dirtySpans->bottom(); ++r) {
+        const DirtySpans::Span &span = m_dirtySpans->span(r);
+        if (!span.isEmpty()) {
+            region += cellRect(r, r + 1, span.start, span.end);
+        }
+    }
+    if (m_pendingScroll.active) {
+        int rows, cols;
+        vterm_get_size(m_core->vterm(), &rows, &cols);
+        region += cellRect(m_pendingScroll.top, m_pendingScroll.bottom, 0, cols);
+    }
+    region += m_cursorPainted;
+    const QPoint cursor = m_core->cursor();
+    region += cellRect(cursor.y(), cursor.y() + 1, cursor.x(), cursor.x() + 1);
+    update(region);
+}
+
+void KodoTerm::damageAll() {
+    markDirty(0, m_core->rows(), 0, m_core->cols());
     m_dirty = true;
     if (!m_restoring) {
-        update();
+        updateView();
+    }
+}
+
+void KodoTerm::scrollRows(int top, int bottom, int delta) {
+    if (delta == 0 || top >= bottom) {
+        return;
+    }
+    if (m_pendingScroll.active &&
+        (m_pendingScroll.top != top || m_pendingScroll.bottom != bottom)) {
+        applyPendingScroll();
+    }
+    if (!m_pendingScroll.active) {
+        m_pendingScroll.top = top;
+        m_pendingScroll.bottom = bottom;
+        m_pendingScroll.delta = 0;
+        m_pendingScroll.active = true;
     }
+    m_pendingScroll.delta += delta;
+
+    // Pending damage moves along with the content, the rows scrolled in are new
+    int rows, cols;
+    vterm_get_size(m_core->vterm(), &rows, &cols);
+    top = std::max(0, top);
+    bottom = std::min(bottom, rows);
+    if (m_dirtySpans->rows() == rows) {
+        m_dirtySpans->scroll(top, bottom, delta);
+    }
+    int exposedTop = delta > 0 ? std::max(top, bottom - delta) : top;
+    int exposedBottom = delta > 0 ? bottom : std::min(bottom, top - delta);
+    markDirty(exposedTop, exposedBottom, 0, cols);
+}
+
+void KodoTerm::applyPendingScroll() {
+    if (!m_pendingScroll.active) {
+        return;
+    }
+    m_pendingScroll.active = false;
+    const int top = m_pendingScroll.top, bottom = m_pendingScroll.bottom;
+    const int delta = m_pendingScroll.delta;
+    // Scrolled by the whole region or more, every row of it is already dirty
+    if (delta == 0 || std::abs(delta) >= bottom - top) {
+        return;
+    }
+    int rows, cols;
+    vterm_get_size(m_core->vterm(), &rows, &cols);
+    VTermRect src, dest;
+    src.start_row = top + std::max(delta, 0);
+    src.end_row = bottom + std::min(delta, 0);
+    src.start_col = 0;
+    src.end_col = cols;
+    dest = src;
+    dest.start_row -= delta;
+    dest.end_row -= delta;
+    if (!moveBackBuffer(dest, src)) {
+        markDirty(top, bottom, 0, cols);
+    }
+}
+
+// Moves the pixels and the cached cells of src to dest. Returns false without touching
+// anything when the cell grid does not fall on whole device pixels.
+bool KodoTerm::moveBackBuffer(VTermRect dest, VTermRect src) {
+    int rows, cols;
+    vterm_get_size(m_core->vterm(), &rows, &cols);
+    const int dr = dest.start_row - src.start_row, dc = dest.start_col - src.start_col;
+    src.start_row = std::max({src.start_row, 0, -dr});
+    src.end_row = std::min({src.end_row, rows, rows - dr});
+    src.start_col = std::max({src.start_col, 0, -dc});
+    src.end_col = std::min({src.end_col, cols, cols - dc});
+    if (m_gpuView) {
+        return moveGpuCells(src, dr, dc);
+    }
+    if (m_backBuffer.isNull() || m_cellCache.size() != (size_t)rows * cols) {
+        return false;
+    }
+    if (src.start_row >= src.end_row || src.start_col >= src.end_col) {
+        return true;
+    }
+    const qreal dpr = m_backBuffer.devicePixelRatio();
+    const qreal cellW = m_cellSize.width() * dpr, cellH = m_cellSize.height() * dpr;
+    if (cellW != std::floor(cellW) || cellH != std::floor(cellH) ||
+        cols * (int)cellW > m_backBuffer.width() || rows * (int)cellH > m_backBuffer.height()) {
+        return false;
+    }
+    const int cw = (int)cellW, ch = (int)cellH;
+    m_blitRegion += cellRect(src.start_row + dr, src.end_row + dr, src.start_col + dc,
+                             src.end_col + dc);
+
+    uchar *bits = m_backBuffer.bits();
+    const qsizetype bpl = m_backBuffer.bytesPerLine();
+    const size_t lineBytes = (size_t)(src.end_col - src.start_col) * cw * 4;
+    const int lines = (src.end_row - src.start_row) * ch;
+    const int sx = src.start_col * cw * 4, sy = src.start_row * ch;
+    const int dx = (src.start_col + dc) * cw * 4, dy = (src.start_row + dr) * ch;
+    auto moveLine = [&](int y) {
+        std::memmove(bits + (dy + y) * bpl + dx, bits + (sy + y) * bpl + sx, lineBytes);
+    };
+    const size_t n = src.end_col - src.start_col;
+    auto moveRow = [&](int r) {
+        size_t from = (size_t)(src.start_row + r) * cols + src.start_col;
+        size_t to = (size_t)(src.start_row + r + dr) * cols + src.start_col + dc;
+        std::memmove(&m_cellCache[to], &m_cellCache[from], n * sizeof(ShadowCell));
+    };
+    if (dr <= 0) {
+        for (int y = 0; y < lines; ++y) {
+            moveLine(y);
+        }
+        for (int r = 0; r < src.end_row - src.start_row; ++r) {
+            moveRow(r);
+        }
+    } else {
+        for (int y = lines - 1; y >= 0; --y) {
+            moveLine(y);
+        }
+        for (int r = src.end_row - src.start_row - 1; r >= 0; --r) {
+            moveRow(r);
+        }
+    }
+    return true;
 }
 
 void KodoTerm::drawRestorationBanner(QPainter &painter) {
@@ -505,453 +900,589 @@ void KodoTerm::drawRestorationBanner(QPainter &painter) {
     painter.drawText(bannerRect, Qt::AlignCenter, m_restorationBannerText);
 }
 
-static bool colorsEqual(const VTermColor &a, const VTermColor &b) {
-    if (a.type != b.type) {
-        return false;
-    }
-    if (a.type == VTERM_COLOR_RGB) {
-        return a.rgb.red == b.rgb.red && a.rgb.green == b.rgb.green && a.rgb.blue == b.rgb.blue;
+static uint32_t packColor(const VTermColor &c) {
+    uint32_t packed = (uint32_t)c.type << 24;
+    if (VTERM_COLOR_IS_RGB(&c)) {
+        packed |= (uint32_t)c.rgb.red << 16 | (uint32_t)c.rgb.green << 8 | c.rgb.blue;
+    } else {
+        packed |= c.indexed.idx;
     }
-    if (a.type == VTERM_COLOR_INDEXED) {
-        return a.indexed.idx == b.indexed.idx;
+    return packed;
+}
+
+void KodoTerm::packCell(const VTermScreenCell &cell, uint8_t mark, ShadowCell &out) {
+    std::memset(&out, 0, sizeof(out));
+    for (int i = 0; i < VTERM_MAX_CHARS_PER_CELL && cell.chars[i]; ++i) {
+        out.chars[i] = cell.chars[i];
     }
-    return true;
+    out.fg = packColor(cell.fg);
+    out.bg = packColor(cell.bg);
+    out.attrs = cell.attrs;
+    out.width = cell.width;
+    out.mark = mark;
 }
 
-static bool cellsEqual(const VTermScreenCell &a, const VTermScreenCell &b) {
-    if (a.width != b.width) {
-        return false;
+void KodoTerm::invalidateCellCache() {
+    for (auto &cell : m_cellCache) {
+        cell.chars[0] = (uint32_t)-1;
     }
-    if (memcmp(&a.attrs, &b.attrs, sizeof(VTermScreenCellAttrs)) != 0) {
-        return false;
+}
+
+void KodoTerm::rowMarks(int row, int startCol, int endCol, uint8_t *marks) const {
+    int rows, cols;
+    vterm_get_size(m_core->vterm(), &rows, &cols);
+    std::fill(marks + startCol, marks + endCol, 0);
+    VTermPos sS = m_selectionStart, sE = m_selectionEnd;
+    if (sS.row != -1) {
+        if (sS.row > sE.row || (sS.row == sE.row && sS.col > sE.col)) {
+            std::swap(sS, sE);
+        }
+        if (row >= sS.row && row <= sE.row) {
+            int from = row == sS.row ? sS.col : 0;
+            int to = row == sE.row ? sE.col + 1 : cols;
+            for (int c = std::max(from, startCol); c < std::min(to, endCol); ++c) {
+                marks[c] = CellSelected;
+            }
+        }
     }
-    if (!colorsEqual(a.fg, b.fg) || !colorsEqual(a.bg, b.bg)) {
-        return false;
+    if (m_searchMatches.empty()) {
+        return;
     }
-    for (int i = 0; i < VTERM_MAX_CHARS_PER_CELL; ++i) {
-        if (a.chars[i] != b.chars[i]) {
-            return false;
+    // Matches are found per stored line, a row spans the lines holding its first and its
+    // last cell
+    const ScrollbackBuffer *scrollback = m_core->scrollback();
+    qint64 number = scrollback->firstRow() + row;
+    qint64 first = scrollback->lineOf(number), last = scrollback->lineOf(number + 1);
+    auto it = std::lower_bound(m_searchMatches.begin(), m_searchMatches.end(), last,
+                               [](const SearchMatch &m, qint64 n) { return m.line > n; });
+    for (; it != m_searchMatches.end() && it->line >= first; ++it) {
+        int column = 0;
+        if (scrollback->rowOf(it->line, it->column, &column) != number) {
+            continue;
         }
-        if (a.chars[i] == 0) {
-            break;
+        bool current = (it - m_searchMatches.begin()) == m_searchCurrent;
+        int end = std::min(cols, column + it->length);
+        for (int i = std::max(startCol, column); i < std::min(end, endCol); ++i) {
+            marks[i] |= current ? CellCurrentMatch : CellMatch;
         }
     }
-    return true;
 }
 
-static bool isBoxChar(uint32_t c) { return (c >= 0x2500 && c <= 0x257F); }
-
-static void drawBoxChar(QPainter &p, const QRect &r, uint32_t c, const QColor &fg) {
-    enum { L = 1, R = 2, U = 4, D = 8, H = 16, Db = 32 };
-    int f = 0;
-    switch (c) {
-    case 0x2500:
-        f = L | R;
-        break;
-    case 0x2501:
-        f = L | R | H;
-        break;
-    case 0x2502:
-        f = U | D;
-        break;
-    case 0x2503:
-        f = U | D | H;
-        break;
-    case 0x250C:
-        f = D | R;
-        break;
-    case 0x250F:
-        f = D | R | H;
-        break;
-    case 0x2510:
-        f = D | L;
-        break;
-    case 0x2513:
-        f = D | L | H;
-        break;
-    case 0x2514:
-        f = U | R;
-        break;
-    case 0x2517:
-        f = U | R | H;
-        break;
-    case 0x2518:
-        f = U | L;
-        break;
-    case 0x251B:
-        f = U | L | H;
-        break;
-    case 0x251C:
-        f = U | D | R;
-        break;
-    case 0x2523:
-        f = U | D | R | H;
-        break;
-    case 0x2524:
-        f = U | D | L;
-        break;
-    case 0x252B:
-        f = U | D | L | H;
-        break;
-    case 0x252C:
-        f = D | L | R;
-        break;
-    case 0x2533:
-        f = D | L | R | H;
-        break;
-    case 0x2534:
-        f = U | L | R;
-        break;
-    case 0x253B:
-        f = U | L | R | H;
-        break;
-    case 0x253C:
-        f = U | D | L | R;
-        break;
-    case 0x254B:
-        f = U | D | L | R | H;
-        break;
-    case 0x2550:
-        f = L | R | Db;
-        break;
-    case 0x2551:
-        f = U | D | Db;
-        break;
-    case 0x2554:
-        f = D | R | Db;
-        break;
-    case 0x2557:
-        f = D | L | Db;
-        break;
-    case 0x255A:
-        f = U | R | Db;
-        break;
-    case 0x255D:
-        f = U | L | Db;
-        break;
-    case 0x2560:
-        f = U | D | R | Db;
-        break;
-    case 0x2563:
-        f = U | D | L | Db;
-        break;
-    case 0x2566:
-        f = D | L | R | Db;
-        break;
-    case 0x2569:
-        f = U | L | R | Db;
-        break;
-    case 0x256C:
-        f = U | D | L | R | Db;
-        break;
-    }
-
-    if (f == 0) {
-        p.setPen(fg);
-        p.drawText(r, Qt::AlignCenter, QString::fromUcs4((const char32_t *)&c, 1));
-        return;
+void KodoTerm::cellColors(const VTermScreenCell &cell, uint8_t mark, const VTermState *state,
+                          QRgb defFg, QRgb defBg, QRgb &fg, QRgb &bg) const {
+    fg = VTERM_COLOR_IS_DEFAULT_FG(&cell.fg) ? defFg : mapRgb(cell.fg, state);
+    bg = VTERM_COLOR_IS_DEFAULT_BG(&cell.bg) ? defBg : mapRgb(cell.bg, state);
+    if (mark & (CellMatch | CellCurrentMatch)) {
+        fg = m_config.theme.background.rgb();
+        bg = m_config.theme.palette[(mark & CellCurrentMatch) ? 11 : 3].rgb();
     }
-
-    p.setPen(Qt::NoPen);
-    p.setBrush(fg);
-    int cx = r.center().x();
-    int cy = r.center().y();
-    int t = (f & H) ? 2 : 1;
-
-    if (f & Db) {
-        int g = 1; // gap
-        if (f & U) {
-            p.drawRect(cx - 1, r.top(), 1, cy - r.top() + g);
-            p.drawRect(cx + 1, r.top(), 1, cy - r.top() + g);
-        }
-        if (f & D) {
-            p.drawRect(cx - 1, cy - g, 1, r.bottom() - cy + 1 + g);
-            p.drawRect(cx + 1, cy - g, 1, r.bottom() - cy + 1 + g);
-        }
-        if (f & L) {
-            p.drawRect(r.left(), cy - 1, cx - r.left() + g, 1);
-            p.drawRect(r.left(), cy + 1, cx - r.left() + g, 1);
-        }
-        if (f & R) {
-            p.drawRect(cx - g, cy - 1, r.right() - cx + 1 + g, 1);
-            p.drawRect(cx - g, cy + 1, r.right() - cx + 1 + g, 1);
-        }
-    } else {
-        if (f & U) {
-            p.drawRect(cx, r.top(), t, cy - r.top() + t);
-        }
-        if (f & D) {
-            p.drawRect(cx, cy, t, r.bottom() - cy + 1);
-        }
-        if (f & L) {
-            p.drawRect(r.left(), cy, cx - r.left() + t, t);
-        }
-        if (f & R) {
-            p.drawRect(cx, cy, r.right() - cx + 1, t);
-        }
+    if (cell.attrs.reverse ^ bool(mark & CellSelected)) {
+        std::swap(fg, bg);
     }
 }
 
+QFont KodoTerm::cellFont() const {
+    QFont f = font();
+    f.setKerning(false);
+    f.setStyleStrategy(m_config.textAntialiasing ? QFont::PreferAntialias : QFont::NoAntialias);
+    return f;
+}
+
 void KodoTerm::renderToBackbuffer() {
     if (m_backBuffer.isNull()) {
         return;
     }
     int rows, cols;
-    vterm_get_size(m_vterm, &rows, &cols);
-    int cur = m_scrollBar->value(), sb = (int)m_scrollback.size();
-    bool useCache = (cur == sb);
-    if (useCache && (m_dirtyRect.start_row > m_dirtyRect.end_row)) {
+    vterm_get_size(m_core->vterm(), &rows, &cols);
+    applyPendingScroll();
+    int cur = m_scrollBar->value();
+    if (m_dirtySpans->isEmpty() || m_dirtySpans->rows() != rows) {
         m_dirty = false;
         return;
     }
 
+    // Cell backgrounds are written straight into the scanlines when cells cover whole device
+    // pixels, QPainter is left for the glyphs. Taken before the painter, bits() may detach.
+    const int cw = m_cellSize.width(), ch = m_cellSize.height();
+    const qreal dpr = m_backBuffer.devicePixelRatio();
+    const qreal cellW = cw * dpr, cellH = ch * dpr;
+    const bool rawFill = m_config.directBackgrounds && cellW == std::floor(cellW) &&
+                         cellH == std::floor(cellH) && cols * (int)cellW <= m_backBuffer.width() &&
+                         rows * (int)cellH <= m_backBuffer.height();
+    uchar *bits = rawFill ? m_backBuffer.bits() : nullptr;
+    const qsizetype bpl = m_backBuffer.bytesPerLine();
+
     QPainter painter(&m_backBuffer);
-    QFont f = font();
-    f.setKerning(false);
-    f.setStyleStrategy(m_config.textAntialiasing ? QFont::PreferAntialias : QFont::NoAntialias);
+    const QFont f = cellFont();
     painter.setFont(f);
     painter.setRenderHint(QPainter::TextAntialiasing, m_config.textAntialiasing);
     painter.setRenderHint(QPainter::Antialiasing,
                           false); // Always false for cell backgrounds to prevent gaps
 
-    VTermState *state = vterm_obtain_state(m_vterm);
+    VTermState *state = vterm_obtain_state(m_core->vterm());
     VTermColor dfg, dbg;
     vterm_state_get_default_colors(state, &dfg, &dbg);
-    QColor defBg = mapColor(dbg, state), defFg = mapColor(dfg, state);
+    // Colors stay packed pixel values, a QColor is only made where the painter needs one
+    const QRgb defBg = mapRgb(dbg, state), defFg = mapRgb(dfg, state);
+
+    // Scrolled back views go through the cell cache as well, it follows the view
+    const int sR = m_dirtySpans->top(), eR = m_dirtySpans->bottom();
+    m_stats.lastFrameDamageCells = 0;
+    qint64 redrawn = 0, skipped = 0;
+    // Consecutive changed ASCII cells sharing colors and style are merged into a run: one
+    // background fill per run, blank runs only get the fill. Wide, combining and box drawing
+    // cells break the run and are drawn one by one. With the glyph atlas enabled every glyph
+    // is a blit of a pre-rasterized tile, otherwise text goes through drawText.
+    if (!m_renderMetrics || f != m_renderFont) {
+        m_renderFont = f;
+        m_renderMetrics = SharedResources::fontMetrics(f);
+    }
+    const bool gridAligned = qFuzzyCompare(m_renderMetrics->advance, (qreal)cw);
+    const bool useAtlas = m_config.glyphAtlas;
+    if (useAtlas && (!m_glyphCache || !m_glyphCache->matches(f, m_cellSize, dpr))) {
+        m_glyphCache = SharedResources::glyphCache(f, m_cellSize, dpr);
+    }
+    quint8 painterStyle = 0;
+    auto setStyle = [&](quint8 style) {
+        if (style != painterStyle) {
+            painter.setFont(GlyphCache::styledFont(f, style));
+            painterStyle = style;
+        }
+    };
+    auto drawGlyph = [&](const QRectF &rect, const uint32_t *chars, int count, int width,
+                         quint8 style, QRgb fg) {
+        if (useAtlas) {
+            QRectF source = m_glyphCache->glyph(chars, count, width, style, fg);
+            if (!source.isEmpty()) {
+                painter.drawImage(rect, m_glyphCache->atlas(), source);
+                return;
+            }
+        }
+        setStyle(style & ~GlyphCache::BoxDrawing);
+        if (style & GlyphCache::BoxDrawing) {
+            drawBoxChar(painter, rect.toRect(), chars[0], QColor::fromRgb(fg));
+            return;
+        }
+        painter.setPen(QColor::fromRgb(fg));
+        painter.drawText(rect, Qt::AlignCenter, QString::fromUcs4((const char32_t *)chars, count));
+    };
 
-    VTermPos sS = m_selectionStart, sE = m_selectionEnd;
-    bool hasS = (sS.row != -1);
-    if (hasS && (sS.row > sE.row || (sS.row == sE.row && sS.col > sE.col))) {
-        std::swap(sS, sE);
-    }
-    int sR = 0, eR = rows, sC = 0, eC = cols;
-    if (useCache) {
-        sR = std::max(0, m_dirtyRect.start_row);
-        eR = std::min(rows, m_dirtyRect.end_row);
-        sC = std::max(0, m_dirtyRect.start_col);
-        eC = std::min(cols, m_dirtyRect.end_col);
-    }
+    auto fillCells = [&](int col, int row, int count, QRgb color) {
+        count = std::min(count, cols - col);
+        if (!rawFill) {
+            painter.fillRect(QRectF(col * cw, row * ch, count * cw, ch), QColor::fromRgb(color));
+            return;
+        }
+        const int x = col * (int)cellW, w = count * (int)cellW, y = row * (int)cellH;
+        for (int i = 0; i < (int)cellH; ++i) {
+            std::fill_n(reinterpret_cast<QRgb *>(bits + (y + i) * bpl) + x, w, color);
+        }
+    };
+
+    struct {
+        int start = -1;
+        int end = -1;
+        QRgb fg = 0, bg = 0;
+        quint8 style = 0;
+        QString text;
+        bool blank = true;
+    } run;
+    run.text.reserve(cols);
+    auto flushRun = [&](int row) {
+        if (run.start < 0) {
+            return;
+        }
+        QRectF rr(run.start * cw, row * ch, (run.end - run.start) * cw, ch);
+        fillCells(run.start, row, run.end - run.start, run.bg);
+        if (!run.blank) {
+            if (!useAtlas && gridAligned) {
+                setStyle(run.style);
+                painter.setPen(QColor::fromRgb(run.fg));
+                painter.drawText(rr, Qt::AlignLeft | Qt::AlignVCenter, run.text);
+            } else {
+                // Fractional advances would drift off the cell grid, place each glyph
+                for (int i = 0; i < run.text.size(); ++i) {
+                    uint32_t c = run.text[i].unicode();
+                    if (c != ' ' || (run.style & (GlyphCache::Underline | GlyphCache::Strike))) {
+                        drawGlyph(QRectF((run.start + i) * cw, row * ch, cw, ch), &c, 1, 1,
+                                  run.style, run.fg);
+                    }
+                }
+            }
+        }
+        run.start = -1;
+        run.text.resize(0);
+        run.blank = true;
+    };
+
+    std::vector<VTermScreenCell> line(cols);
+    std::vector<uint8_t> marks(cols, 0);
+    std::vector<ShadowCell> packed(cols);
     for (int r = sR; r < eR; ++r) {
+        // A span starting on the second half of a wide character takes the first along
+        const DirtySpans::Span &span = m_dirtySpans->span(r);
+        const int sC = std::max(0, span.start - 1), eC = span.end;
+        if (span.isEmpty()) {
+            continue;
+        }
+        m_stats.lastFrameDamageCells += eC - sC;
+        m_blitRegion += cellRect(r, r + 1, sC, eC);
         int absR = cur + r;
+        m_core->fetchRow(absR, sC, eC, line.data());
+        rowMarks(absR, sC, eC, marks.data());
+        // A span that packs to what is cached is skipped with a single compare
+        ShadowCell *cached = &m_cellCache[(size_t)r * cols];
         for (int c = sC; c < eC; ++c) {
-            VTermScreenCell cell;
-            if (absR < sb) {
-                const SavedLine &l = m_scrollback[absR];
-                if (c < (int)l.size()) {
-                    const SavedCell &sc = l[c];
-                    memcpy(cell.chars, sc.chars, sizeof(cell.chars));
-                    cell.attrs = sc.attrs;
-                    cell.fg = sc.fg;
-                    cell.bg = sc.bg;
-                    cell.width = sc.width;
-                } else {
-                    memset(&cell, 0, sizeof(cell));
-                    cell.width = 1;
-                }
-            } else {
-                vterm_screen_get_cell(m_vtermScreen, {r, c}, &cell);
-            }
-            if (cell.width == 0) {
+            packCell(line[c], marks[c], packed[c]);
+        }
+        if (std::memcmp(&packed[sC], &cached[sC], (eC - sC) * sizeof(ShadowCell)) == 0) {
+            skipped += eC - sC;
+            continue;
+        }
+        for (int c = sC; c < eC; ++c) {
+            const VTermScreenCell &cell = line[c];
+            // Second half of a wide character, drawn with the first
+            if (cell.chars[0] == (uint32_t)-1) {
                 continue;
             }
-            bool sel = false;
-            if (hasS) {
-                if (absR > sS.row && absR < sE.row) {
-                    sel = true;
-                } else if (absR == sS.row && absR == sE.row) {
-                    sel = (c >= sS.col && c <= sE.col);
-                } else if (absR == sS.row) {
-                    sel = (c >= sS.col);
-                } else if (absR == sE.row) {
-                    sel = (c <= sE.col);
-                }
-            }
-            if (useCache && sel == m_selectedCache[r * cols + c] &&
-                cellsEqual(cell, m_cellCache[r * cols + c])) {
+            const uint8_t mark = marks[c];
+            if (std::memcmp(&packed[c], &cached[c], sizeof(ShadowCell)) == 0) {
+                skipped++;
+                flushRun(r);
                 if (cell.width > 1) {
                     c += (cell.width - 1);
                 }
                 continue;
             }
-            if (useCache) {
-                m_cellCache[r * cols + c] = cell;
-                m_selectedCache[r * cols + c] = sel;
-            }
-            QColor fg = defFg, bg = defBg;
-            if (!VTERM_COLOR_IS_DEFAULT_FG(&cell.fg)) {
-                fg = mapColor(cell.fg, state);
-            }
-            if (!VTERM_COLOR_IS_DEFAULT_BG(&cell.bg)) {
-                bg = mapColor(cell.bg, state);
-            }
-            if (cell.attrs.reverse ^ sel) {
-                std::swap(fg, bg);
+            redrawn++;
+            QRgb fg, bg;
+            cellColors(cell, mark, state, defFg, defBg, fg, bg);
+
+            uint32_t ch0 = cell.attrs.conceal ? 0 : cell.chars[0];
+            quint8 style = GlyphCache::styleFor(cell.attrs);
+            bool batchable = cell.width == 1 && ch0 < 0x80 && (ch0 == 0 || cell.chars[1] == 0);
+            if (batchable) {
+                if (run.start >= 0 && run.end == c && run.fg == fg && run.bg == bg &&
+                    run.style == style) {
+                    run.end++;
+                } else {
+                    flushRun(r);
+                    run.start = c;
+                    run.end = c + 1;
+                    run.fg = fg;
+                    run.bg = bg;
+                    run.style = style;
+                }
+                bool blank = ch0 == 0 || ch0 == ' ';
+                run.text.append(blank ? QLatin1Char(' ') : QLatin1Char((char)ch0));
+                run.blank = run.blank && blank && !(style & GlyphCache::Underline) &&
+                            !(style & GlyphCache::Strike);
+                continue;
             }
 
-            QRectF rect(c * m_cellSize.width(), r * m_cellSize.height(),
-                        cell.width * m_cellSize.width(), m_cellSize.height());
-            painter.fillRect(rect, bg);
+            flushRun(r);
+            QRectF rect(c * cw, r * ch, cell.width * cw, ch);
+            fillCells(c, r, cell.width, bg);
 
-            if (m_config.customBoxDrawing && isBoxChar(cell.chars[0])) {
-                drawBoxChar(painter, rect.toRect(), cell.chars[0], fg);
-            } else if (cell.chars[0] != 0) {
+            if (m_config.customBoxDrawing && isBoxChar(ch0)) {
+                drawGlyph(rect, &ch0, 1, cell.width, style | GlyphCache::BoxDrawing, fg);
+            } else if (ch0 != 0) {
                 int n_chars = 0;
                 while (n_chars < VTERM_MAX_CHARS_PER_CELL && cell.chars[n_chars]) {
                     n_chars++;
                 }
-                painter.setPen(fg);
-                painter.drawText(rect, Qt::AlignCenter,
-                                 QString::fromUcs4((const char32_t *)cell.chars, n_chars));
+                drawGlyph(rect, cell.chars, n_chars, cell.width, style, fg);
             }
 
             if (cell.width > 1) {
                 c += (cell.width - 1);
             }
         }
+        flushRun(r);
+        std::memcpy(&cached[sC], &packed[sC], (eC - sC) * sizeof(ShadowCell));
     }
-    resetDirtyRect();
+    m_stats.cellsRedrawn += redrawn;
+    m_stats.cellsSkipped += skipped;
+    m_statsPending.damageCells += m_stats.lastFrameDamageCells;
+    m_dirtySpans->clear();
     m_dirty = false;
 }
 
-int KodoTerm::onDamage(VTermRect r, void *u) {
-    auto *w = static_cast<KodoTerm *>(u);
-    if (!w->m_pendingLogReplay.isEmpty()) {
-        return 1;
-    }
-    w->m_dirtyRect.start_row = std::min(w->m_dirtyRect.start_row, r.start_row);
-    w->m_dirtyRect.start_col = std::min(w->m_dirtyRect.start_col, r.start_col);
-    w->m_dirtyRect.end_row = std::max(w->m_dirtyRect.end_row, r.end_row);
-    w->m_dirtyRect.end_col = std::max(w->m_dirtyRect.end_col, r.end_col);
-    w->m_dirty = true;
-    if (!w->m_restoring) {
-        w->update();
-    }
-    return 1;
-}
-
-int KodoTerm::onMoveRect(VTermRect d, VTermRect s, void *u) {
-    auto *w = static_cast<KodoTerm *>(u);
-    if (!w->m_pendingLogReplay.isEmpty()) {
-        return 1;
-    }
-
-    int cols, rows;
-    vterm_get_size(w->m_vterm, &rows, &cols);
-    int h = s.end_row - s.start_row;
-    if (d.start_row < s.start_row) {
-        for (int r = 0; r < h; ++r) {
-            int sr = s.start_row + r, dr = d.start_row + r;
-            if (sr >= 0 && sr < rows && dr >= 0 && dr < rows) {
-                std::copy(w->m_cellCache.begin() + sr * cols,
-                          w->m_cellCache.begin() + sr * cols + cols,
-                          w->m_cellCache.begin() + dr * cols);
-                std::copy(w->m_selectedCache.begin() + sr * cols,
-                          w->m_selectedCache.begin() + sr * cols + cols,
-                          w->m_selectedCache.begin() + dr * cols);
-            }
+void KodoTerm::updateView(const QRect &rect) {
+#ifdef KODOTERM_OPENGL
+    if (m_gpuView) {
+        m_gpuView->update();
+        return;
+    }
+#endif
+    if (rect.isNull()) {
+        update();
+    } else {
+        update(rect);
+    }
+}
+
+#ifdef KODOTERM_OPENGL
+void KodoTerm::applyRenderBackend() {
+    const bool gpu = m_config.gpuRendering && !m_gpuFailed;
+    if (gpu == (m_gpuView != nullptr)) {
+        return;
+    }
+    m_glyphCache.reset();
+    m_backBuffer = QImage();
+    m_blitRegion = QRegion();
+    if (!gpu) {
+        delete m_gpuView;
+        m_gpuView = nullptr;
+        return;
+    }
+    m_gpuView = new GlTerminalView(this);
+    m_gpuView->prepare = [this]() {
+        m_gpuFrameTimer.start();
+        renderToGpu();
+    };
+    m_gpuView->overlay = [this](QPainter &painter) {
+        if (m_restorationBannerActive) {
+            drawRestorationBanner(painter);
+        }
+        if (!m_restoring) {
+            paintOverlays(painter);
+        }
+        recordFrameTime(m_gpuFrameTimer.nsecsElapsed());
+        if (m_config.statsOverlay) {
+            drawStatsOverlay(painter);
+        }
+        updateStats();
+    };
+    m_gpuView->onFailure = [this]() {
+        m_gpuFailed = true;
+        applyRenderBackend();
+        m_cellSize = QSize(0, 0);
+        updateTerminalSize();
+    };
+    m_gpuAtlasGeneration = -1;
+    m_gpuCursor = QPoint(-1, -1);
+    m_gpuView->show();
+    m_scrollBar->raise();
+}
+
+bool KodoTerm::moveGpuCells(VTermRect src, int dr, int dc) {
+    int rows, cols;
+    vterm_get_size(m_core->vterm(), &rows, &cols);
+    if (m_gpuView->rows() != rows || m_gpuView->cols() != cols) {
+        return false;
+    }
+    if (src.start_row >= src.end_row || src.start_col >= src.end_col) {
+        return true;
+    }
+    const size_t n = (src.end_col - src.start_col) * sizeof(GlTerminalView::Cell);
+    auto moveRow = [&](int r) {
+        std::memmove(m_gpuView->row(r + dr) + src.start_col + dc,
+                     m_gpuView->row(r) + src.start_col, n);
+    };
+    if (dr <= 0) {
+        for (int r = src.start_row; r < src.end_row; ++r) {
+            moveRow(r);
         }
     } else {
-        for (int r = h - 1; r >= 0; --r) {
-            int sr = s.start_row + r, dr = d.start_row + r;
-            if (sr >= 0 && sr < rows && dr >= 0 && dr < rows) {
-                std::copy(w->m_cellCache.begin() + sr * cols,
-                          w->m_cellCache.begin() + sr * cols + cols,
-                          w->m_cellCache.begin() + dr * cols);
-                std::copy(w->m_selectedCache.begin() + sr * cols,
-                          w->m_selectedCache.begin() + sr * cols + cols,
-                          w->m_selectedCache.begin() + dr * cols);
-            }
+        for (int r = src.end_row - 1; r >= src.start_row; --r) {
+            moveRow(r);
         }
     }
+    m_gpuView->rowsChanged(src.start_row + dr, src.end_row + dr);
+    // The inverted cursor cell moved along, wherever it landed is drawn again
+    if (m_gpuCursor.y() >= src.start_row && m_gpuCursor.y() < src.end_row &&
+        m_gpuCursor.x() >= src.start_col && m_gpuCursor.x() < src.end_col) {
+        markDirty(m_gpuCursor.y() + dr, m_gpuCursor.y() + dr + 1, m_gpuCursor.x() + dc,
+                  m_gpuCursor.x() + dc + 1);
+    }
+    return true;
+}
+
+// Same cells as renderToBackbuffer(), written into the GPU view's grid. Glyphs come from the
+// shared atlas rasterized in white, the shader tints them with the cell foreground.
+void KodoTerm::renderToGpu() {
+    int rows, cols;
+    vterm_get_size(m_core->vterm(), &rows, &cols);
+    const qreal dpr = devicePixelRatioF();
+    if (m_gpuView->cellSize() != QSizeF(m_cellSize) * dpr) {
+        // Moved to a screen with another pixel ratio
+        updateTerminalSize();
+    }
+    if (m_restoring || m_gpuView->rows() != rows || m_gpuView->cols() != cols) {
+        return;
+    }
+    applyPendingScroll();
 
-    w->m_dirtyRect.start_row = std::min({w->m_dirtyRect.start_row, d.start_row, s.start_row});
-    w->m_dirtyRect.end_row = std::max({w->m_dirtyRect.end_row, d.end_row, s.end_row});
-    w->m_dirtyRect.start_col = 0;
-    w->m_dirtyRect.end_col = cols;
+    const QFont f = cellFont();
+    if (!m_glyphCache || !m_glyphCache->matches(f, m_cellSize, dpr)) {
+        m_glyphCache = SharedResources::glyphCache(f, m_cellSize, dpr);
+        m_gpuAtlasGeneration = -1;
+        m_gpuAtlasRevision = ~0ull;
+    }
+    // Atlas positions from before the atlas was last cleared, maybe by another terminal
+    // sharing it, are stale
+    if (m_glyphCache->generation() != m_gpuAtlasGeneration) {
+        markDirty(0, rows, 0, cols);
+    }
+    QPoint cursor(-1, -1);
+    if (cursorShown() && (m_core->cursorShape() < 2 || m_core->cursorShape() > 5)) {
+        cursor = m_core->cursor();
+    }
+    if (cursor != m_gpuCursor) {
+        markDirty(m_gpuCursor.y(), m_gpuCursor.y() + 1, m_gpuCursor.x(), m_gpuCursor.x() + 1);
+        markDirty(cursor.y(), cursor.y() + 1, cursor.x(), cursor.x() + 1);
+        m_gpuCursor = cursor;
+    }
 
-    w->m_dirty = true;
-    if (!w->m_restoring) {
-        w->update();
+    VTermState *state = vterm_obtain_state(m_core->vterm());
+    VTermColor dfg, dbg;
+    vterm_state_get_default_colors(state, &dfg, &dbg);
+    const QRgb defBg = mapRgb(dbg, state), defFg = mapRgb(dfg, state);
+    const qreal cellW = m_cellSize.width() * dpr;
+    const int cur = m_scrollBar->value();
+    int generation = m_glyphCache->generation();
+    bool retried = false;
+    std::vector<VTermScreenCell> line(cols);
+    std::vector<uint8_t> marks(cols, 0);
+    m_stats.lastFrameDamageCells = 0;
+    for (int r = m_dirtySpans->top(); r < m_dirtySpans->bottom() && m_dirtySpans->rows() == rows;
+         ++r) {
+        // A span starting on the second half of a wide character takes the first along
+        const DirtySpans::Span &span = m_dirtySpans->span(r);
+        const int sC = std::max(0, span.start - 1), eC = span.end;
+        if (span.isEmpty()) {
+            continue;
+        }
+        m_stats.lastFrameDamageCells += eC - sC;
+        m_core->fetchRow(cur + r, sC, eC, line.data());
+        rowMarks(cur + r, sC, eC, marks.data());
+        GlTerminalView::Cell *out = m_gpuView->row(r);
+        for (int c = sC; c < eC; ++c) {
+            const VTermScreenCell &cell = line[c];
+            // Second half of a wide character, drawn with the first
+            if (cell.chars[0] == (uint32_t)-1) {
+                continue;
+            }
+            QRgb fg, bg;
+            cellColors(cell, marks[c], state, defFg, defBg, fg, bg);
+            if (c == cursor.x() && r == cursor.y()) {
+                std::swap(fg, bg);
+            }
+            uint32_t ch0 = cell.attrs.conceal ? 0 : cell.chars[0];
+            const quint8 style = GlyphCache::styleFor(cell.attrs);
+            QRectF glyph;
+            if (m_config.customBoxDrawing && isBoxChar(ch0)) {
+                glyph = m_glyphCache->glyph(&ch0, 1, cell.width, style | GlyphCache::BoxDrawing,
+                                            0xffffffff);
+            } else if (ch0 > ' ') {
+                int count = 0;
+                while (count < VTERM_MAX_CHARS_PER_CELL && cell.chars[count]) {
+                    count++;
+                }
+                glyph = m_glyphCache->glyph(cell.chars, count, cell.width, style, 0xffffffff);
+            } else if (style & (GlyphCache::Underline | GlyphCache::Strike)) {
+                const uint32_t space = ' ';
+                glyph = m_glyphCache->glyph(&space, 1, cell.width, style, 0xffffffff);
+            }
+            for (int k = 0; k < cell.width && c + k < cols; ++k) {
+                out[c + k].glyphX = glyph.isEmpty() ? -1.0f : float(glyph.x() + k * cellW);
+                out[c + k].glyphY = float(glyph.y());
+                out[c + k].fg = fg;
+                out[c + k].bg = bg;
+            }
+            c += cell.width - 1;
+        }
+        m_gpuView->rowsChanged(r, r + 1);
+        if (m_glyphCache->generation() != generation && !retried) {
+            // The atlas filled up and was cleared halfway through, start over once
+            retried = true;
+            generation = m_glyphCache->generation();
+            markDirty(0, rows, 0, cols);
+            r = m_dirtySpans->top() - 1;
+        }
     }
-    return 1;
+    m_statsPending.damageCells += m_stats.lastFrameDamageCells;
+    m_gpuAtlasGeneration = m_glyphCache->generation();
+    if (m_glyphCache->revision() != m_gpuAtlasRevision) {
+        m_gpuView->uploadAtlas(m_glyphCache->atlas());
+        m_gpuAtlasRevision = m_glyphCache->revision();
+    }
+    m_dirtySpans->clear();
+    m_dirty = false;
 }
-
-int KodoTerm::onMoveCursor(VTermPos p, VTermPos op, int v, void *u) {
-    auto *w = static_cast<KodoTerm *>(u);
-    if (!w->m_pendingLogReplay.isEmpty()) {
-        return 1;
+#else
+void KodoTerm::applyRenderBackend() {}
+bool KodoTerm::moveGpuCells(VTermRect, int, int) { return false; }
+void KodoTerm::renderToGpu() {}
+#endif
+
+// Core damage is in screen rows, the view is offset from them when scrolled back
+void KodoTerm::takeCoreDamage() {
+    const QList<QRect> damage = m_core->takeDamage();
+    if (damage.isEmpty() || !m_pendingLogReplay.isEmpty() || !isVisible()) {
+        return;
     }
-    w->m_cursorRow = p.row;
-    w->m_cursorCol = p.col;
-    w->m_cursorVisible = v;
-    if (!w->m_restoring) {
-        w->update();
+    const int viewOffset = m_core->scrollback()->rows() - m_scrollBar->value();
+    for (const QRect &r : damage) {
+        const VTermRect rect = toVTermRect(r);
+        m_links->invalidateRows(rect.start_row + viewOffset, rect.end_row + viewOffset);
+        markDirty(rect.start_row + viewOffset, rect.end_row + viewOffset, rect.start_col,
+                  rect.end_col);
     }
-    return 1;
+    m_dirty = true;
 }
 
-int KodoTerm::onSetTermProp(VTermProp p, VTermValue *v, void *u) {
-    auto *w = static_cast<KodoTerm *>(u);
-    if (!w->m_pendingLogReplay.isEmpty()) {
-        return 1;
+// The cells move along with their pixels, the damage covering them only compares them again.
+// Scrolled back, the view shows other rows than the screen and redraws from the damage.
+void KodoTerm::onCoreMoved(const QRect &dest, const QRect &src) {
+    if (!m_pendingLogReplay.isEmpty() || !isVisible() ||
+        m_scrollBar->value() != m_core->scrollback()->rows()) {
+        return;
     }
-    switch (p) {
-    case VTERM_PROP_CURSORVISIBLE:
-        w->m_cursorVisible = v->boolean;
-        break;
-    case VTERM_PROP_CURSORBLINK:
-        w->m_cursorBlink = v->boolean;
-        if (w->m_cursorBlink) {
-            w->m_cursorBlinkTimer->start();
-        } else {
-            w->m_cursorBlinkTimer->stop();
-            w->m_cursorBlinkState = true;
-        }
-        break;
-    case VTERM_PROP_CURSORSHAPE:
-        w->m_cursorShape = v->number;
-        break;
-    case VTERM_PROP_ALTSCREEN:
-        w->m_altScreen = v->boolean;
-        if (w->m_altScreen) {
-            w->m_scrollBar->hide();
-        } else {
-            w->m_scrollBar->show();
-        }
-        w->updateTerminalSize();
-        break;
-    case VTERM_PROP_TITLE:
-        w->setWindowTitle(QString::fromUtf8(v->string.str, (int)v->string.len));
-        break;
-    case VTERM_PROP_MOUSE:
-        w->m_mouseMode = v->number;
-        break;
-    default:
-        break;
+    const VTermRect d = toVTermRect(dest), s = toVTermRect(src);
+    if (d.start_col == 0 && s.start_col == 0 && s.end_col == m_core->cols()) {
+        // Line scrolls arrive one at a time, a burst of output becomes a single blit
+        scrollRows(std::min(d.start_row, s.start_row), std::max(d.end_row, s.end_row),
+                   s.start_row - d.start_row);
+    } else {
+        applyPendingScroll();
+        moveBackBuffer(d, s);
     }
-    if (!w->m_restoring) {
-        w->damageAll();
+}
+
+void KodoTerm::onAltScreenChanged(bool altScreen) {
+    if (!m_pendingLogReplay.isEmpty()) {
+        return;
+    }
+    m_scrollBar->setVisible(!altScreen);
+    updateTerminalSize();
+}
+
+void KodoTerm::onCursorBlinkChanged(bool blink) {
+    if (blink) {
+        m_cursorBlinkTimer->start();
+    } else {
+        m_cursorBlinkTimer->stop();
+        m_cursorBlinkState = true;
     }
-    return 1;
 }
 
-int KodoTerm::onBell(void *u) {
-    auto *w = static_cast<KodoTerm *>(u);
-    if (w->m_restoring || !w->m_pendingLogReplay.isEmpty()) {
-        return 1;
+void KodoTerm::ringBell() {
+    if (m_restoring || !m_pendingLogReplay.isEmpty()) {
+        return;
     }
-    if (w->m_config.audibleBell) {
+    if (m_config.audibleBell) {
         QApplication::beep();
     }
-    if (w->m_config.visualBell) {
-        w->m_visualBellActive = true;
-        w->update();
-        QTimer::singleShot(100, w, [w]() {
-            w->m_visualBellActive = false;
-            w->update();
+    if (m_config.visualBell) {
+        m_visualBellActive = true;
+        updateView();
+        QTimer::singleShot(100, this, [this]() {
+            m_visualBellActive = false;
+            updateView();
         });
     }
-    return 1;
 }
 
 void KodoTerm::resizeEvent(QResizeEvent *e) {
@@ -970,7 +1501,7 @@ void KodoTerm::wheelEvent(QWheelEvent *e) {
         }
         return;
     }
-    if (m_mouseMode > 0 && !(e->modifiers() & Qt::ShiftModifier)) {
+    if (m_core->mouseMode() > 0 && !(e->modifiers() & Qt::ShiftModifier)) {
         VTermModifier m = VTERM_MOD_NONE;
         if (e->modifiers() & Qt::ShiftModifier) {
             m = (VTermModifier)(m | VTERM_MOD_SHIFT);
@@ -984,9 +1515,8 @@ void KodoTerm::wheelEvent(QWheelEvent *e) {
         int r = e->position().toPoint().y() / m_cellSize.height(),
             c = e->position().toPoint().x() / m_cellSize.width(),
             b = e->angleDelta().y() > 0 ? 4 : 5;
-        vterm_mouse_move(m_vterm, r, c, m);
-        vterm_mouse_button(m_vterm, b, true, m);
-        vterm_screen_flush_damage(m_vtermScreen);
+        vterm_mouse_move(m_core->vterm(), r, c, m);
+        vterm_mouse_button(m_core->vterm(), b, true, m);
         return;
     }
     m_scrollBar->event(e);
@@ -1003,8 +1533,15 @@ void KodoTerm::mousePressEvent(QMouseEvent *e) {
     if (e->modifiers() & Qt::AltModifier) {
         m = (VTermModifier)(m | VTERM_MOD_ALT);
     }
+    if (e->button() == Qt::LeftButton && (e->modifiers() & Qt::ControlModifier)) {
+        if (const TerminalLink *link = linkAt(e->pos())) {
+            openLink(*link);
+            e->accept();
+            return;
+        }
+    }
     int r = e->pos().y() / m_cellSize.height(), c = e->pos().x() / m_cellSize.width();
-    if (m_mouseMode > 0 && !(e->modifiers() & Qt::ShiftModifier)) {
+    if (m_core->mouseMode() > 0 && !(e->modifiers() & Qt::ShiftModifier)) {
         int b = 0;
         if (e->button() == Qt::LeftButton) {
             b = 1;
@@ -1014,9 +1551,8 @@ void KodoTerm::mousePressEvent(QMouseEvent *e) {
             b = 3;
         }
         if (b > 0) {
-            vterm_mouse_move(m_vterm, r, c, m);
-            vterm_mouse_button(m_vterm, b, true, m);
-            vterm_screen_flush_damage(m_vtermScreen);
+            vterm_mouse_move(m_core->vterm(), r, c, m);
+            vterm_mouse_button(m_core->vterm(), b, true, m);
             e->accept();
             return;
         }
@@ -1034,7 +1570,7 @@ void KodoTerm::mousePressEvent(QMouseEvent *e) {
         VTermPos vp = mouseToPos(e->pos());
         if (m_clickCount == 3 && m_config.tripleClickSelectsLine) {
             int rows, cols;
-            vterm_get_size(m_vterm, &rows, &cols);
+            vterm_get_size(m_core->vterm(), &rows, &cols);
             m_selectionStart = {vp.row, 0};
             m_selectionEnd = {vp.row, cols - 1};
             m_selecting = false;
@@ -1048,7 +1584,7 @@ void KodoTerm::mousePressEvent(QMouseEvent *e) {
             m_selectionEnd = m_selectionStart;
             damageAll();
         }
-        update();
+        updateView();
     } else if (e->button() == Qt::MiddleButton && m_config.pasteOnMiddleClick) {
         pasteFromClipboard();
     }
@@ -1057,7 +1593,7 @@ void KodoTerm::mousePressEvent(QMouseEvent *e) {
 
 void KodoTerm::mouseDoubleClickEvent(QMouseEvent *e) {
     if (e->button() != Qt::LeftButton ||
-        (m_mouseMode > 0 && !(e->modifiers() & Qt::ShiftModifier))) {
+        (m_core->mouseMode() > 0 && !(e->modifiers() & Qt::ShiftModifier))) {
         return;
     }
     m_clickCount = 2;
@@ -1065,29 +1601,16 @@ void KodoTerm::mouseDoubleClickEvent(QMouseEvent *e) {
     m_lastClickPos = e->pos();
     m_selecting = false;
     VTermPos vp = mouseToPos(e->pos());
-    int sb = (int)m_scrollback.size(), rows, cols;
-    vterm_get_size(m_vterm, &rows, &cols);
+    int rows, cols;
+    vterm_get_size(m_core->vterm(), &rows, &cols);
     QString line;
     line.fill(' ', cols);
     int cc = vp.col;
-    if (vp.row < sb) {
-        const SavedLine &l = m_scrollback[vp.row];
-        int n = std::min((int)l.size(), cols);
-        for (int c = 0; c < n; ++c) {
-            if (l[c].chars[0] != 0) {
-                line[c] = QChar(static_cast<ushort>(l[c].chars[0] & 0xFFFF));
-            }
-        }
-    } else {
-        int vr = vp.row - sb;
-        if (vr < rows) {
-            for (int c = 0; c < cols; ++c) {
-                VTermScreenCell cell;
-                vterm_screen_get_cell(m_vtermScreen, {vr, c}, &cell);
-                if (cell.chars[0] != 0) {
-                    line[c] = QChar(static_cast<ushort>(cell.chars[0] & 0xFFFF));
-                }
-            }
+    std::vector<VTermScreenCell> l(cols);
+    m_core->fetchRow(vp.row, 0, cols, l.data());
+    for (int c = 0; c < cols; ++c) {
+        if (l[c].chars[0] != 0 && l[c].chars[0] != (uint32_t)-1) {
+            line[c] = QChar(static_cast<ushort>(l[c].chars[0] & 0xFFFF));
         }
     }
     QRegularExpression re(m_config.wordSelectionRegex);
@@ -1122,15 +1645,23 @@ void KodoTerm::mouseMoveEvent(QMouseEvent *e) {
     }
     VTermPos vp = mouseToPos(e->pos());
     int r = e->pos().y() / m_cellSize.height(), c = e->pos().x() / m_cellSize.width();
-    if (m_mouseMode > 0 && !(e->modifiers() & Qt::ShiftModifier)) {
-        vterm_mouse_move(m_vterm, r, c, m);
-        vterm_screen_flush_damage(m_vtermScreen);
+    if (m_core->mouseMode() > 0 && !(e->modifiers() & Qt::ShiftModifier)) {
+        vterm_mouse_move(m_core->vterm(), r, c, m);
         return;
     }
     if (m_selecting) {
         m_selectionEnd = vp;
         damageAll();
     }
+    bool overLink = !m_selecting && (e->modifiers() & Qt::ControlModifier) && linkAt(e->pos());
+    if (overLink != m_linkHover) {
+        m_linkHover = overLink;
+        if (overLink) {
+            setCursor(Qt::PointingHandCursor);
+        } else {
+            unsetCursor();
+        }
+    }
     QWidget::mouseMoveEvent(e);
 }
 
@@ -1146,7 +1677,7 @@ void KodoTerm::mouseReleaseEvent(QMouseEvent *e) {
         m = (VTermModifier)(m | VTERM_MOD_ALT);
     }
     int r = e->pos().y() / m_cellSize.height(), c = e->pos().x() / m_cellSize.width();
-    if (m_mouseMode > 0 && !(e->modifiers() & Qt::ShiftModifier)) {
+    if (m_core->mouseMode() > 0 && !(e->modifiers() & Qt::ShiftModifier)) {
         int b = 0;
         if (e->button() == Qt::LeftButton) {
             b = 1;
@@ -1156,9 +1687,8 @@ void KodoTerm::mouseReleaseEvent(QMouseEvent *e) {
             b = 3;
         }
         if (b > 0) {
-            vterm_mouse_move(m_vterm, r, c, m);
-            vterm_mouse_button(m_vterm, b, false, m);
-            vterm_screen_flush_damage(m_vtermScreen);
+            vterm_mouse_move(m_core->vterm(), r, c, m);
+            vterm_mouse_button(m_core->vterm(), b, false, m);
             e->accept();
             return;
         }
@@ -1183,13 +1713,57 @@ VTermPos KodoTerm::mouseToPos(const QPoint &p) const {
         return {0, 0};
     }
     int r = p.y() / m_cellSize.height(), c = p.x() / m_cellSize.width(),
-        sb = (int)m_scrollback.size(), cur = m_scrollBar->value();
+        sb = m_core->scrollback()->rows(), cur = m_scrollBar->value();
     VTermPos vp;
     vp.row = cur + r;
     vp.col = c;
     return vp;
 }
 
+const TerminalLink *KodoTerm::linkAt(const QPoint &pos) {
+    if (m_cellSize.width() <= 0 || m_cellSize.height() <= 0) {
+        return nullptr;
+    }
+    int rows, cols;
+    vterm_get_size(m_core->vterm(), &rows, &cols);
+    int row = pos.y() / m_cellSize.height(), col = pos.x() / m_cellSize.width();
+    if (row < 0 || row >= rows || col < 0 || col >= cols) {
+        return nullptr;
+    }
+    if (!m_links->isValid(row)) {
+        // First look at this row since it last changed
+        std::vector<VTermScreenCell> cells(cols);
+        m_core->fetchRow(m_scrollBar->value() + row, 0, cols, cells.data());
+        m_links->setRow(row, SearchLine::fromCells(cells.data(), cols));
+    }
+    return m_links->linkAt(row, col);
+}
+
+void KodoTerm::openLink(const TerminalLink &link) {
+    const QString &t = link.target;
+    QUrl url;
+    if (t.startsWith("www.")) {
+        url = QUrl("http://" + t);
+    } else if (t.contains("://") || t.startsWith("mailto:")) {
+        url = QUrl(t);
+    } else {
+        QString path = t;
+        if (path.startsWith('~')) {
+            path = QDir::homePath() + path.mid(1);
+        } else if (path.startsWith('.')) {
+            const QString cwd = m_core->cwd();
+            path = QDir(cwd.isEmpty() ? m_workingDirectory : cwd).absoluteFilePath(path);
+        }
+        if (!QFileInfo::exists(path)) {
+            return;
+        }
+        url = QUrl::fromLocalFile(path);
+    }
+    if (url.isValid()) {
+        QDesktopServices::openUrl(url);
+    }
+}
+
 bool KodoTerm::isSelected(int r, int c) const {
     if (m_selectionStart.row == -1) {
         return false;
@@ -1214,40 +1788,140 @@ bool KodoTerm::isSelected(int r, int c) const {
 }
 
 QString KodoTerm::getTextRange(VTermPos s, VTermPos e) {
-    if (s.row > e.row || (s.row == e.row && s.col > e.col)) {
-        std::swap(s, e);
-    }
     QString t;
-    int sb = (int)m_scrollback.size(), rs, cs;
-    vterm_get_size(m_vterm, &rs, &cs);
-    for (int r = s.row; r <= e.row; ++r) {
-        int sc = (r == s.row) ? s.col : 0, ec = (r == e.row) ? e.col : 1000;
-        if (r < sb) {
-            const SavedLine &l = m_scrollback[r];
-            for (int c = sc; c <= ec && c < (int)l.size(); ++c) {
-                for (int i = 0; i < VTERM_MAX_CHARS_PER_CELL && l[c].chars[i]; ++i) {
-                    t.append(QChar::fromUcs4(l[c].chars[i]));
-                }
-            }
-        } else {
-            int vr = r - sb;
-            if (vr < rs) {
-                for (int c = sc; c <= ec && c < cs; ++c) {
-                    VTermScreenCell cell;
-                    vterm_screen_get_cell(m_vtermScreen, {vr, c}, &cell);
-                    for (int i = 0; i < VTERM_MAX_CHARS_PER_CELL && cell.chars[i]; ++i) {
-                        t.append(QChar::fromUcs4(cell.chars[i]));
-                    }
-                }
-            }
-        }
-        if (r < e.row) {
-            t.append('\n');
-        }
-    }
+    const auto snap = snapshot();
+    // Selections rarely fill whole rows, half of them is a fair first guess
+    t.reserve((qsizetype)(std::abs(e.row - s.row) + 1) * (snap->cols() / 2 + 1));
+    snap->writeText(s, e, [&t](const QString &chunk) {
+        t.append(chunk);
+        return true;
+    });
+    t.squeeze();
     return t;
 }
 
+bool KodoTerm::saveText(const QString &path, bool selectionOnly) {
+    if (selectionOnly && m_selectionStart.row == -1) {
+        return false;
+    }
+    QSaveFile f(path);
+    if (!f.open(QIODevice::WriteOnly)) {
+        return false;
+    }
+    const auto snap = snapshot();
+    VTermPos s = m_selectionStart, e = m_selectionEnd;
+    if (!selectionOnly) {
+        s = {0, 0};
+        e = {snap->scrollback().rows() + snap->rows() - 1, snap->cols() - 1};
+    }
+    bool ok = snap->writeText(s, e, [&f](const QString &chunk) {
+        return f.write(chunk.toUtf8()) >= 0;
+    });
+    if (!ok || (!selectionOnly && f.write("\n", 1) != 1)) {
+        f.cancelWriting();
+        return false;
+    }
+    return f.commit();
+}
+
+std::shared_ptr<const TerminalSnapshot> KodoTerm::snapshot() {
+    return m_core->snapshot();
+}
+
+int KodoTerm::searchMatchCount() const { return (int)m_searchMatches.size(); }
+int KodoTerm::scrollbackLines() const { return m_core->scrollback()->size(); }
+size_t KodoTerm::scrollbackMemoryUsage() const { return m_core->scrollback()->memoryUsage(); }
+
+void KodoTerm::find(const QString &pattern, SearchFlags flags) {
+    m_searchMatches.clear();
+    m_searchCurrent = -1;
+    if (pattern.isEmpty()) {
+        clearSearch();
+        return;
+    }
+    m_searchFinished = false;
+
+    // The terminal goes on while the worker scans, screen and scrollback are searched as
+    // they were at this point
+    m_search->search(pattern, (int)flags, snapshot(),
+                     [this](const QList<SearchMatch> &matches, bool finished) {
+                         onSearchMatches(matches, finished);
+                     });
+    damageAll();
+    emit searchResultsChanged(-1, 0, false);
+}
+
+void KodoTerm::onSearchMatches(const QList<SearchMatch> &matches, bool finished) {
+    m_searchMatches.insert(m_searchMatches.end(), matches.begin(), matches.end());
+    m_searchFinished = finished;
+    if (m_searchCurrent < 0 && !m_searchMatches.empty()) {
+        m_searchCurrent = 0;
+        scrollToSearchMatch();
+    }
+    if (!matches.isEmpty()) {
+        damageAll();
+    }
+    emit searchResultsChanged(m_searchCurrent, (int)m_searchMatches.size(), finished);
+}
+
+void KodoTerm::findNext() {
+    if (m_searchMatches.empty()) {
+        return;
+    }
+    // Towards the bottom, wrapping once the whole history has been searched
+    if (m_searchCurrent > 0) {
+        m_searchCurrent--;
+    } else if (m_searchFinished) {
+        m_searchCurrent = (int)m_searchMatches.size() - 1;
+    }
+    scrollToSearchMatch();
+    emit searchResultsChanged(m_searchCurrent, (int)m_searchMatches.size(), m_searchFinished);
+}
+
+void KodoTerm::findPrevious() {
+    if (m_searchMatches.empty()) {
+        return;
+    }
+    if (m_searchCurrent + 1 < (int)m_searchMatches.size()) {
+        m_searchCurrent++;
+    } else if (m_searchFinished) {
+        m_searchCurrent = 0;
+    }
+    scrollToSearchMatch();
+    emit searchResultsChanged(m_searchCurrent, (int)m_searchMatches.size(), m_searchFinished);
+}
+
+void KodoTerm::clearSearch() {
+    m_search->cancel();
+    bool hadMatches = !m_searchMatches.empty();
+    m_searchMatches.clear();
+    m_searchCurrent = -1;
+    m_searchFinished = true;
+    if (hadMatches) {
+        damageAll();
+    }
+    emit searchResultsChanged(-1, 0, true);
+}
+
+void KodoTerm::scrollToSearchMatch() {
+    if (m_searchCurrent < 0 || m_searchCurrent >= (int)m_searchMatches.size()) {
+        return;
+    }
+    const SearchMatch &match = m_searchMatches[m_searchCurrent];
+    const ScrollbackBuffer *scrollback = m_core->scrollback();
+    qint64 row = scrollback->rowOf(match.line, match.column) - scrollback->firstRow();
+    int rows, cols, sb = scrollback->rows(), cur = m_scrollBar->value();
+    vterm_get_size(m_core->vterm(), &rows, &cols);
+    if (row < 0) {
+        // Scrolled out of the history since it was found
+        return;
+    }
+    if (row < cur || row >= cur + rows) {
+        m_scrollBar->setValue((int)std::clamp<qint64>(row - rows / 2, 0, sb));
+    }
+    damageAll();
+}
+
 void KodoTerm::copyToClipboard() {
     if (m_selectionStart.row != -1) {
         QApplication::clipboard()->setText(getTextRange(m_selectionStart, m_selectionEnd));
@@ -1256,28 +1930,56 @@ void KodoTerm::copyToClipboard() {
 void KodoTerm::pasteFromClipboard() {
     QString t = QApplication::clipboard()->text();
     if (!t.isEmpty()) {
-        m_pty->write(t.toUtf8());
+        m_core->paste(t.toUtf8());
     }
 }
 void KodoTerm::selectAll() {
     int rs, cs;
-    vterm_get_size(m_vterm, &rs, &cs);
-    int sb = (int)m_scrollback.size();
+    vterm_get_size(m_core->vterm(), &rs, &cs);
+    int sb = m_core->scrollback()->rows();
     m_selectionStart = {0, 0};
     m_selectionEnd = {sb + rs - 1, cs - 1};
     damageAll();
 }
+void KodoTerm::saveScrollbackAs() {
+    const QString cwd = m_core->cwd();
+    QString path = QFileDialog::getSaveFileName(this, tr("Save Scrollback"),
+                                                cwd.isEmpty() ? QDir::homePath() : cwd,
+                                                tr("Text files (*.txt);;All files (*)"));
+    if (path.isEmpty()) {
+        return;
+    }
+    // Long histories take a while to write out, the terminal keeps running meanwhile
+    QThreadPool::globalInstance()->start([self = QPointer<KodoTerm>(this), snap = snapshot(),
+                                          path]() {
+        QSaveFile f(path);
+        bool ok = f.open(QIODevice::WriteOnly) &&
+                  snap->writeText({0, 0},
+                                  {snap->scrollback().rows() + snap->rows() - 1, snap->cols() - 1},
+                                  [&f](const QString &chunk) {
+                                      return f.write(chunk.toUtf8()) >= 0;
+                                  }) &&
+                  f.write("\n", 1) == 1 && f.commit();
+        QMetaObject::invokeMethod(QCoreApplication::instance(), [self, path, ok]() {
+            if (self && !ok) {
+                QMessageBox::warning(self, tr("Save Scrollback"),
+                                     tr("Could not write %1.").arg(path));
+            }
+        });
+    });
+}
 void KodoTerm::clearScrollback() {
-    m_scrollback.clear();
+    m_core->clearScrollback();
+    clearSearch();
     m_scrollBar->setRange(0, 0);
     m_scrollBar->setValue(0);
     damageAll();
 }
 void KodoTerm::resetTerminal() {
-    vterm_screen_reset(m_vtermScreen, 1);
+    m_core->reset();
     m_flowControlStopped = false;
-    if (m_vterm && !m_backBuffer.isNull()) {
-        VTermState *state = vterm_obtain_state(m_vterm);
+    if (!m_backBuffer.isNull()) {
+        VTermState *state = vterm_obtain_state(m_core->vterm());
         VTermColor dfg, dbg;
         vterm_state_get_default_colors(state, &dfg, &dbg);
         m_backBuffer.fill(mapColor(dbg, state));
@@ -1286,24 +1988,16 @@ void KodoTerm::resetTerminal() {
     damageAll();
 }
 void KodoTerm::openFileBrowser() {
-    if (!m_cwd.isEmpty()) {
-        QDir d(m_cwd);
+    if (!m_core->cwd().isEmpty()) {
+        QDir d(m_core->cwd());
         if (d.exists()) {
             QDesktopServices::openUrl(QUrl::fromLocalFile(d.absolutePath()));
         }
     }
 }
-void KodoTerm::kill() {
-    if (m_pty) {
-        m_pty->kill();
-    }
-}
-void KodoTerm::logData(const QByteArray &d) {
-    if (m_logFile.isOpen()) {
-        m_logFile.write(d);
-        m_logFile.flush();
-    }
-}
+void KodoTerm::kill() { m_core->terminate(); }
+void KodoTerm::logData(const QByteArray &d) { writeLog(d); }
+QString KodoTerm::logPath() const { return m_logger->fileName(); }
 void KodoTerm::scrollToBottom() {
     if (m_scrollBar) {
         m_scrollBar->setValue(m_scrollBar->maximum());
@@ -1311,7 +2005,7 @@ void KodoTerm::scrollToBottom() {
 }
 
 void KodoTerm::contextMenuEvent(QContextMenuEvent *e) {
-    if (m_mouseMode > 0 && !(QGuiApplication::keyboardModifiers() & Qt::ShiftModifier)) {
+    if (m_core->mouseMode() > 0 && !(QGuiApplication::keyboardModifiers() & Qt::ShiftModifier)) {
         return;
     }
     auto *m = new QMenu(this);
@@ -1323,13 +2017,14 @@ void KodoTerm::contextMenuEvent(QContextMenuEvent *e) {
     pA->setShortcut(QKeySequence(Qt::CTRL | Qt::SHIFT | Qt::Key_V));
     m->addSeparator();
     m->addAction(tr("Select All"), this, &KodoTerm::selectAll);
+    m->addAction(tr("Save Scrollback..."), this, &KodoTerm::saveScrollbackAs);
     m->addSeparator();
     m->addAction(tr("Clear Scrollback"), this, &KodoTerm::clearScrollback);
     m->addAction(tr("Reset"), this, &KodoTerm::resetTerminal);
     m->addSeparator();
     auto *oB = m->addAction(tr("Open current directory in file browser"), this,
                             &KodoTerm::openFileBrowser);
-    oB->setEnabled(!m_cwd.isEmpty() && QDir(m_cwd).exists());
+    oB->setEnabled(!m_core->cwd().isEmpty() && QDir(m_core->cwd()).exists());
     m->addSeparator();
     m->addAction(tr("Zoom In"), this, &KodoTerm::zoomIn);
     m->addAction(tr("Zoom Out"), this, &KodoTerm::zoomOut);
@@ -1357,7 +2052,7 @@ void KodoTerm::zoomIn() {
                                                              : QFont::NoAntialias);
     setFont(m_config.font);
     updateTerminalSize();
-    update();
+    updateView();
 }
 void KodoTerm::zoomOut() {
     qreal s = m_config.font.pointSizeF();
@@ -1370,7 +2065,7 @@ void KodoTerm::zoomOut() {
                                                                  : QFont::NoAntialias);
         setFont(m_config.font);
         updateTerminalSize();
-        update();
+        updateView();
     }
 }
 void KodoTerm::resetZoom() {
@@ -1379,43 +2074,36 @@ void KodoTerm::resetZoom() {
                                                              : QFont::NoAntialias);
     setFont(m_config.font);
     updateTerminalSize();
-    update();
+    updateView();
 }
-QString KodoTerm::foregroundProcessName() const {
-    return m_pty ? m_pty->foregroundProcessName() : QString();
-}
-bool KodoTerm::isRoot() const { return m_pty && m_pty->isRoot(); }
+QString KodoTerm::foregroundProcessName() const { return m_core->foregroundProcessName(); }
+bool KodoTerm::isRoot() const { return m_core->isRoot(); }
+QString KodoTerm::cwd() const { return m_core->cwd(); }
 
-QColor KodoTerm::mapColor(const VTermColor &c, const VTermState *s) const {
+QRgb KodoTerm::mapRgb(const VTermColor &c, const VTermState *s) const {
     if (VTERM_COLOR_IS_RGB(&c)) {
-        if (c.rgb.red == m_lastVTermFg.rgb.red && c.rgb.green == m_lastVTermFg.rgb.green &&
-            c.rgb.blue == m_lastVTermFg.rgb.blue) {
-            return m_lastFg;
-        }
-        if (c.rgb.red == m_lastVTermBg.rgb.red && c.rgb.green == m_lastVTermBg.rgb.green &&
-            c.rgb.blue == m_lastVTermBg.rgb.blue) {
-            return m_lastBg;
-        }
-        QColor col(c.rgb.red, c.rgb.green, c.rgb.blue);
-        m_lastVTermBg = m_lastVTermFg;
-        m_lastBg = m_lastFg;
-        m_lastVTermFg = c;
-        m_lastFg = col;
-        return col;
+        // The pixel value is the color itself, no lookup needed
+        return qRgb(c.rgb.red, c.rgb.green, c.rgb.blue);
     } else if (VTERM_COLOR_IS_INDEXED(&c)) {
-        uint8_t i = c.indexed.idx;
-        if (!m_paletteCacheValid[i]) {
-            VTermColor rgb = c;
-            vterm_state_convert_color_to_rgb(s, &rgb);
-            m_paletteCache[i] = QColor(rgb.rgb.red, rgb.rgb.green, rgb.rgb.blue);
-            m_paletteCacheValid[i] = true;
+        if (m_palette) {
+            return m_palette->colors[c.indexed.idx];
         }
-        return m_paletteCache[i];
+        VTermColor rgb = c;
+        vterm_state_convert_color_to_rgb(s, &rgb);
+        return qRgb(rgb.rgb.red, rgb.rgb.green, rgb.rgb.blue);
     }
-    return Qt::white;
+    return qRgb(255, 255, 255);
+}
+
+QColor KodoTerm::mapColor(const VTermColor &c, const VTermState *s) const {
+    return QColor::fromRgb(mapRgb(c, s));
 }
 
 void KodoTerm::paintEvent(QPaintEvent *e) {
+    // Covered by the GPU view, which paints everything from its own paintGL()
+    if (m_gpuView) {
+        return;
+    }
     QElapsedTimer timer;
     timer.start();
 
@@ -1428,17 +2116,27 @@ void KodoTerm::paintEvent(QPaintEvent *e) {
         renderToBackbuffer();
     }
     QPainter painter(this);
-    // Fill background to cover gaps
-    if (m_vterm) {
-        VTermState *state = vterm_obtain_state(m_vterm);
-        VTermColor dfg, dbg;
-        vterm_state_get_default_colors(state, &dfg, &dbg);
-        painter.fillRect(rect(), mapColor(dbg, state));
-    }
-
+    // Only the damaged parts of the back buffer are blitted, the background covers the gaps
+    // around it
+    QRegion background = e->region();
     if (!m_restoring && !m_backBuffer.isNull()) {
+        const QRect image(QPoint(0, 0), m_backBuffer.deviceIndependentSize().toSize());
+        const qreal dpr = m_backBuffer.devicePixelRatio();
         painter.setRenderHint(QPainter::Antialiasing, false);
-        painter.drawImage(0, 0, m_backBuffer);
+        for (const QRect &r : e->region() & image) {
+            painter.drawImage(QRectF(r), m_backBuffer,
+                              QRectF(r.x() * dpr, r.y() * dpr, r.width() * dpr, r.height() * dpr));
+        }
+        background -= image;
+        m_blitRegion -= e->region();
+    }
+    if (!background.isEmpty()) {
+        VTermState *state = vterm_obtain_state(m_core->vterm());
+        VTermColor dfg, dbg;
+        vterm_state_get_default_colors(state, &dfg, &dbg);
+        for (const QRect &r : background) {
+            painter.fillRect(r, mapColor(dbg, state));
+        }
     }
 
     if (m_restorationBannerActive) {
@@ -1448,31 +2146,59 @@ void KodoTerm::paintEvent(QPaintEvent *e) {
     if (m_restoring) {
         return;
     }
-    int sb = (int)m_scrollback.size(), cur = m_scrollBar->value();
-    if (hasFocus() && m_cursorVisible && cur == sb && (!m_cursorBlink || m_cursorBlinkState)) {
-        QRect r(m_cursorCol * m_cellSize.width(), m_cursorRow * m_cellSize.height(),
+    paintOverlays(painter);
+
+    recordFrameTime(timer.nsecsElapsed());
+    if (m_config.statsOverlay) {
+        drawStatsOverlay(painter);
+    }
+    updateStats();
+    // Rendered outside of the region asked for, it goes out with the next frame
+    if (!m_blitRegion.isEmpty()) {
+        update(m_blitRegion);
+    }
+}
+
+// Cursor, visual bell and the flow control notice, drawn over the cells by either backend.
+// The GPU view has no difference blending, it draws block cursors into the grid instead.
+void KodoTerm::paintOverlays(QPainter &painter) {
+    const bool gpu = m_gpuView != nullptr;
+    m_cursorPainted = QRect();
+    if (cursorShown()) {
+        const QPoint cursor = m_core->cursor();
+        QRect r(cursor.x() * m_cellSize.width(), cursor.y() * m_cellSize.height(),
                 m_cellSize.width(), m_cellSize.height());
-        painter.setCompositionMode(QPainter::CompositionMode_Difference);
-        switch (m_cursorShape) {
+        m_cursorPainted = r;
+        const QColor color = gpu ? m_config.theme.foreground : QColor(Qt::white);
+        if (!gpu) {
+            painter.setCompositionMode(QPainter::CompositionMode_Difference);
+        }
+        switch (m_core->cursorShape()) {
         case 2:
         case 3:
-            painter.fillRect(r.x(), r.y() + r.height() - 2, r.width(), 2, Qt::white);
+            painter.fillRect(r.x(), r.y() + r.height() - 2, r.width(), 2, color);
             break;
         case 4:
         case 5:
-            painter.fillRect(r.x(), r.y(), 2, r.height(), Qt::white);
+            painter.fillRect(r.x(), r.y(), 2, r.height(), color);
             break;
         case 1:
         default:
-            painter.fillRect(r, Qt::white);
+            if (!gpu) {
+                painter.fillRect(r, color);
+            }
             break;
         }
         painter.setCompositionMode(QPainter::CompositionMode_SourceOver);
     }
     if (m_visualBellActive) {
-        painter.setCompositionMode(QPainter::CompositionMode_Difference);
-        painter.fillRect(rect(), Qt::white);
-        painter.setCompositionMode(QPainter::CompositionMode_SourceOver);
+        if (gpu) {
+            painter.fillRect(rect(), QColor(255, 255, 255, 96));
+        } else {
+            painter.setCompositionMode(QPainter::CompositionMode_Difference);
+            painter.fillRect(rect(), Qt::white);
+            painter.setCompositionMode(QPainter::CompositionMode_SourceOver);
+        }
     }
     if (m_flowControlStopped) {
         QString m = tr("Terminal stopped (Ctrl+S). Press Ctrl+Q to resume.");
@@ -1488,18 +2214,12 @@ void KodoTerm::paintEvent(QPaintEvent *e) {
         painter.setPen(Qt::black);
         painter.drawText(r, Qt::AlignCenter, m);
     }
+}
 
-    qint64 ns = timer.nsecsElapsed();
-    double ms = ns / 1000000.0;
-    m_avgDrawTime = (m_avgDrawTime == 0.0) ? ms : (m_avgDrawTime * 0.9 + ms * 0.1);
-
-    /*    auto r = rect().adjusted(0, 0, -5, -5);
-        painter.setPen(Qt::red);
-        //painter.fillRect(r, Qt::yellow);
-        painter.setCompositionMode(QPainter::CompositionMode_SourceOver);
-        painter.drawText(r, Qt::AlignBottom | Qt::AlignRight, QString::number(m_avgDrawTime, 'f', 2)
-       + " ms"); qDebug() << "Average draw time" << QString::number(m_avgDrawTime, 'f', 2);
-    */
+bool KodoTerm::cursorShown() const {
+    return hasFocus() && m_core->cursorVisible() &&
+           m_scrollBar->value() == m_core->scrollback()->rows() &&
+           (!m_core->cursorBlink() || m_cursorBlinkState);
 }
 
 void KodoTerm::keyPressEvent(QKeyEvent *e) {
@@ -1515,67 +2235,67 @@ void KodoTerm::keyPressEvent(QKeyEvent *e) {
     }
     int k = e->key();
     if (k >= Qt::Key_F1 && k <= Qt::Key_F12) {
-        vterm_keyboard_key(m_vterm, (VTermKey)(VTERM_KEY_FUNCTION(1 + k - Qt::Key_F1)), m);
+        vterm_keyboard_key(m_core->vterm(), (VTermKey)(VTERM_KEY_FUNCTION(1 + k - Qt::Key_F1)), m);
     } else {
         switch (k) {
         case Qt::Key_Enter:
         case Qt::Key_Return:
-            vterm_keyboard_key(m_vterm, VTERM_KEY_ENTER, m);
+            vterm_keyboard_key(m_core->vterm(), VTERM_KEY_ENTER, m);
             break;
         case Qt::Key_Backspace:
-            vterm_keyboard_key(m_vterm, VTERM_KEY_BACKSPACE, m);
+            vterm_keyboard_key(m_core->vterm(), VTERM_KEY_BACKSPACE, m);
             break;
         case Qt::Key_Tab:
-            vterm_keyboard_key(m_vterm, VTERM_KEY_TAB, m);
+            vterm_keyboard_key(m_core->vterm(), VTERM_KEY_TAB, m);
             break;
         case Qt::Key_Escape:
-            vterm_keyboard_key(m_vterm, VTERM_KEY_ESCAPE, m);
+            vterm_keyboard_key(m_core->vterm(), VTERM_KEY_ESCAPE, m);
             break;
         case Qt::Key_Up:
-            vterm_keyboard_key(m_vterm, VTERM_KEY_UP, m);
+            vterm_keyboard_key(m_core->vterm(), VTERM_KEY_UP, m);
             break;
         case Qt::Key_Down:
-            vterm_keyboard_key(m_vterm, VTERM_KEY_DOWN, m);
+            vterm_keyboard_key(m_core->vterm(), VTERM_KEY_DOWN, m);
             break;
         case Qt::Key_Left:
-            vterm_keyboard_key(m_vterm, VTERM_KEY_LEFT, m);
+            vterm_keyboard_key(m_core->vterm(), VTERM_KEY_LEFT, m);
             break;
         case Qt::Key_Right:
-            vterm_keyboard_key(m_vterm, VTERM_KEY_RIGHT, m);
+            vterm_keyboard_key(m_core->vterm(), VTERM_KEY_RIGHT, m);
             break;
         case Qt::Key_PageUp:
             if (e->modifiers() & Qt::ShiftModifier) {
                 pageUp();
             } else {
-                vterm_keyboard_key(m_vterm, VTERM_KEY_PAGEUP, m);
+                vterm_keyboard_key(m_core->vterm(), VTERM_KEY_PAGEUP, m);
             }
             break;
         case Qt::Key_PageDown:
             if (e->modifiers() & Qt::ShiftModifier) {
                 pageDown();
             } else {
-                vterm_keyboard_key(m_vterm, VTERM_KEY_PAGEDOWN, m);
+                vterm_keyboard_key(m_core->vterm(), VTERM_KEY_PAGEDOWN, m);
             }
             break;
         case Qt::Key_Home:
             if (e->modifiers() & Qt::ShiftModifier) {
                 m_scrollBar->setValue(m_scrollBar->minimum());
             } else {
-                vterm_keyboard_key(m_vterm, VTERM_KEY_HOME, m);
+                vterm_keyboard_key(m_core->vterm(), VTERM_KEY_HOME, m);
             }
             break;
         case Qt::Key_End:
             if (e->modifiers() & Qt::ShiftModifier) {
                 m_scrollBar->setValue(m_scrollBar->maximum());
             } else {
-                vterm_keyboard_key(m_vterm, VTERM_KEY_END, m);
+                vterm_keyboard_key(m_core->vterm(), VTERM_KEY_END, m);
             }
             break;
         case Qt::Key_Insert:
-            vterm_keyboard_key(m_vterm, VTERM_KEY_INS, m);
+            vterm_keyboard_key(m_core->vterm(), VTERM_KEY_INS, m);
             break;
         case Qt::Key_Delete:
-            vterm_keyboard_key(m_vterm, VTERM_KEY_DEL, m);
+            vterm_keyboard_key(m_core->vterm(), VTERM_KEY_DEL, m);
             break;
         default:
             if (e->modifiers() & Qt::ControlModifier) {
@@ -1602,15 +2322,15 @@ void KodoTerm::keyPressEvent(QKeyEvent *e) {
             if ((m & VTERM_MOD_CTRL) && k >= Qt::Key_A && k <= Qt::Key_Z) {
                 if (k == Qt::Key_S) {
                     m_flowControlStopped = true;
-                    update();
+                    updateView();
                 } else if (k == Qt::Key_Q) {
                     m_flowControlStopped = false;
-                    update();
+                    updateView();
                 }
-                vterm_keyboard_unichar(m_vterm, k - Qt::Key_A + 1, VTERM_MOD_NONE);
+                vterm_keyboard_unichar(m_core->vterm(), k - Qt::Key_A + 1, VTERM_MOD_NONE);
             } else if (!e->text().isEmpty()) {
                 for (const QChar &qc : e->text()) {
-                    vterm_keyboard_unichar(m_vterm, qc.unicode(), m);
+                    vterm_keyboard_unichar(m_core->vterm(), qc.unicode(), m);
                 }
             }
             break;
@@ -1666,182 +2386,72 @@ void KodoTerm::populateThemeMenu(QMenu *pM, const QString &t, TerminalTheme::The
     }
 }
 
-static QDataStream &operator<<(QDataStream &out, const VTermColor &c) {
-    out << (quint8)c.type;
-    if (c.type == VTERM_COLOR_RGB) {
-        out << c.rgb.red << c.rgb.green << c.rgb.blue;
-    } else if (c.type == VTERM_COLOR_INDEXED) {
-        out << c.indexed.idx;
-    }
-    return out;
-}
-
-static QDataStream &operator>>(QDataStream &in, VTermColor &c) {
-    quint8 t;
-    in >> t;
-    c.type = (VTermColorType)t;
-    if (c.type == VTERM_COLOR_RGB) {
-        in >> c.rgb.red >> c.rgb.green >> c.rgb.blue;
-    } else if (c.type == VTERM_COLOR_INDEXED) {
-        in >> c.indexed.idx;
-    }
-    return in;
-}
-
 void KodoTerm::saveState(const QString &path) {
-    QFile f(path);
+    QSaveFile f(path);
     if (!f.open(QIODevice::WriteOnly)) {
         return;
     }
     QDataStream out(&f);
-    out << (quint32)0x4B4F444F; // "KODO"
-    out << (quint32)3;          // Version 3
-    out << (quint32)m_cursorRow << (quint32)m_cursorCol;
-    out << (quint32)m_scrollback.size();
-    for (const auto &line : m_scrollback) {
-        out << (quint32)line.size();
-        if (!line.empty()) {
-            out.writeRawData((const char *)line.data(), line.size() * sizeof(SavedCell));
-        }
-    }
-
-    // Save current screen
-    int rows, cols;
-    vterm_get_size(m_vterm, &rows, &cols);
-    out << (quint32)rows << (quint32)cols;
-    for (int r = 0; r < rows; ++r) {
-        for (int c = 0; c < cols; ++c) {
-            VTermScreenCell cell;
-            vterm_screen_get_cell(m_vtermScreen, {r, c}, &cell);
-            // Save as SavedCell for consistency/speed?
-            // VTermScreenCell and SavedCell are slightly different.
-            // SavedCell has fixed char array. VTermScreenCell has uint32_t
-            // chars[VTERM_MAX_CHARS_PER_CELL]. SavedCell definition: uint32_t
-            // chars[VTERM_MAX_CHARS_PER_CELL]; ... They are structurally nearly identical. Let's
-            // stick to safe member-wise save for screen (it's small, 25x80).
-            out.writeRawData((const char *)cell.chars, sizeof(cell.chars));
-            quint32 attrs = 0;
-            memcpy(&attrs, &cell.attrs, std::min(sizeof(attrs), sizeof(cell.attrs)));
-            out << attrs;
-            out << cell.fg << cell.bg << (quint32)cell.width;
-        }
-    }
+    writeState(out, 0);
+    f.commit();
 }
 
-void KodoTerm::loadState(const QString &path) {
-    m_restoring = true;
-    QFile f(path);
-    if (!f.open(QIODevice::ReadOnly)) {
-        m_restoring = false;
+QString KodoTerm::checkpointPath(const QString &logPath) { return logPath + ".checkpoint"; }
+
+void KodoTerm::writeCheckpoint(bool background) {
+    if (!m_logger->isOpen() || m_core->altScreen() || m_restoreJob || m_restoring ||
+        !m_pendingLogReplay.isEmpty() || (background && m_checkpointWriting)) {
         return;
     }
-    QDataStream in(&f);
-    quint32 magic, ver;
-    in >> magic >> ver;
-    if (magic != 0x4B4F444F) {
-        m_restoring = false;
+    // Bytes still queued for the parser are not part of the snapshot yet
+    qint64 offset = m_logBytes - m_core->pendingBytes();
+    if (offset == m_checkpointOffset) {
         return;
     }
-
-    quint32 cR = 0, cC = 0;
-    if (ver >= 2) {
-        in >> cR >> cC;
-    }
-
-    quint32 sbSize;
-    in >> sbSize;
-    m_scrollback.clear();
-    // Fast path for Version 3+
-    if (ver >= 3) {
-        for (quint32 i = 0; i < sbSize; ++i) {
-            quint32 lineSize;
-            in >> lineSize;
-            SavedLine line;
-            line.resize(lineSize);
-            if (lineSize > 0) {
-                in.readRawData((char *)line.data(), lineSize * sizeof(SavedCell));
-            }
-            m_scrollback.push_back(std::move(line));
-        }
-    } else {
-        // Slow path for older versions
-        for (quint32 i = 0; i < sbSize; ++i) {
-            quint32 lineSize;
-            in >> lineSize;
-            SavedLine line;
-            line.resize(lineSize);
-            for (quint32 j = 0; j < lineSize; ++j) {
-                in.readRawData((char *)line[j].chars, sizeof(line[j].chars));
-                quint32 attrs;
-                in >> attrs;
-                memcpy(&line[j].attrs, &attrs, std::min(sizeof(attrs), sizeof(line[j].attrs)));
-                in >> line[j].fg >> line[j].bg;
-                quint32 width;
-                in >> width;
-                line[j].width = width;
-            }
-            m_scrollback.push_back(std::move(line));
+    const QString path = checkpointPath(m_logger->fileName());
+    if (!background) {
+        if (TerminalState::save(path, *snapshot(), offset)) {
+            m_checkpointOffset = offset;
         }
+        return;
     }
-
-    // Load screen lines and replay to vterm
-    quint32 rows, cols;
-    in >> rows >> cols;
-    QByteArray replayData;
-
-    for (quint32 r = 0; r < rows; ++r) {
-        for (quint32 c = 0; c < cols; ++c) {
-            SavedCell cell;
-            in.readRawData((char *)cell.chars, sizeof(cell.chars));
-            quint32 attrs;
-            in >> attrs;
-            in >> cell.fg >> cell.bg;
-            quint32 width;
-            in >> width;
-
-            // Replay Logic
-            if (cell.chars[0] == 0) {
-                replayData.append(' ');
-            } else {
-                if (cell.fg.type == VTERM_COLOR_RGB) {
-                    replayData.append(QString("\033[38;2;%1;%2;%3m")
-                                          .arg(cell.fg.rgb.red)
-                                          .arg(cell.fg.rgb.green)
-                                          .arg(cell.fg.rgb.blue)
-                                          .toUtf8());
-                }
-                if (cell.bg.type == VTERM_COLOR_RGB) {
-                    replayData.append(QString("\033[48;2;%1;%2;%3m")
-                                          .arg(cell.bg.rgb.red)
-                                          .arg(cell.bg.rgb.green)
-                                          .arg(cell.bg.rgb.blue)
-                                          .toUtf8());
-                }
-                int n = 0;
-                while (n < VTERM_MAX_CHARS_PER_CELL && cell.chars[n]) {
-                    n++;
-                }
-                if (n > 0) {
-                    replayData.append(QString::fromUcs4((const char32_t *)cell.chars, n).toUtf8());
+    // Long histories take a while to write out and sync, the terminal keeps running meanwhile
+    m_checkpointWriting = true;
+    QThreadPool::globalInstance()->start([self = QPointer<KodoTerm>(this), snap = snapshot(),
+                                          path, offset]() {
+        const bool ok = TerminalState::save(path, *snap, offset);
+        QMetaObject::invokeMethod(QCoreApplication::instance(), [self, ok, offset]() {
+            if (self) {
+                self->m_checkpointWriting = false;
+                if (ok) {
+                    self->m_checkpointOffset = offset;
                 }
             }
-            if (width > 1) {
-                c += (width - 1);
-            }
-        }
-        replayData.append("\r\n");
-    }
-    replayData.append("\033[0m");
+        });
+    });
+}
 
-    if (ver >= 2) {
-        replayData.append(QString("\033[%1;%2H").arg(cR + 1).arg(cC + 1).toUtf8());
-    }
+void KodoTerm::writeState(QDataStream &out, qint64 logOffset) {
+    m_core->writeState(out, logOffset);
+}
 
-    vterm_input_write(m_vterm, replayData.constData(), replayData.size());
+void KodoTerm::loadState(const QString &path) {
+    QFile f(path);
+    if (!f.open(QIODevice::ReadOnly)) {
+        return;
+    }
+    m_restoring = true;
+    QDataStream in(&f);
+    readState(in, nullptr);
+    m_restoring = false;
+    updateView();
+}
 
-    m_scrollBar->setRange(0, (int)m_scrollback.size());
+bool KodoTerm::readState(QDataStream &in, qint64 *logOffset) {
+    clearSearch();
+    bool ok = m_core->readState(in, logOffset);
+    m_scrollBar->setRange(0, m_core->scrollback()->rows());
     m_scrollBar->setValue(m_scrollBar->maximum());
     damageAll();
-    m_restoring = false;
-    update();
+    return ok;
 }
@@ -198,15 +198,50 @@ TerminalTheme TerminalTheme::loadITermTheme(const QString &path) {
     return theme;
 }
 
-QList<TerminalTheme::ThemeInfo> TerminalTheme::builtInThemes() {
-    Q_INIT_RESOURCE(KodoTermThemes);
-    QList<ThemeInfo> themes;
+// Names come from the index generate_qrc.py writes next to the themes, parsing every theme
+// file just for its name is reserved for resources built without one
+static QList<TerminalTheme::ThemeInfo> readThemeIndex() {
+    using ThemeFormat = TerminalTheme::ThemeFormat;
+    QList<TerminalTheme::ThemeInfo> themes;
+    QFile file(":/KodoTermThemes.json");
+    if (!file.open(QIODevice::ReadOnly)) {
+        return themes;
+    }
+    const QJsonObject index = QJsonDocument::fromJson(file.readAll()).object();
+    if (index.value("version").toInt() != 1) {
+        return themes;
+    }
+    const QJsonArray entries = index.value("themes").toArray();
+    themes.reserve(entries.size());
+    for (const QJsonValue &v : entries) {
+        const QJsonObject entry = v.toObject();
+        const QString format = entry.value("format").toString();
+        TerminalTheme::ThemeInfo info;
+        info.name = entry.value("name").toString();
+        info.path = ":/" + entry.value("path").toString();
+        if (format == "konsole") {
+            info.format = ThemeFormat::Konsole;
+        } else if (format == "iterm") {
+            info.format = ThemeFormat::ITerm;
+        } else if (format == "windowsterminal") {
+            info.format = ThemeFormat::WindowsTerminal;
+        } else {
+            continue;
+        }
+        themes.append(info);
+    }
+    return themes;
+}
+
+static QList<TerminalTheme::ThemeInfo> scanThemes() {
+    using ThemeFormat = TerminalTheme::ThemeFormat;
+    QList<TerminalTheme::ThemeInfo> themes;
     QDirIterator it(":/KodoTermThemes",
                     QStringList() << "*.colorscheme" << "*.json" << "*.itermcolors", QDir::Files,
                     QDirIterator::Subdirectories);
     while (it.hasNext()) {
         it.next();
-        ThemeInfo info;
+        TerminalTheme::ThemeInfo info;
         info.path = it.filePath();
         if (info.path.endsWith(".colorscheme")) {
             info.format = ThemeFormat::Konsole;
@@ -215,8 +250,6 @@ QList<TerminalTheme::ThemeInfo> TerminalTheme::builtInThemes() {
         } else if (info.path.endsWith(".itermcolors")) {
             info.format = ThemeFormat::ITerm;
             info.name = QFileInfo(info.path).baseName();
-            // Optional: Parse the file to find "Name" comment if available, but filename is usually
-            // good enough.
         } else {
             info.format = ThemeFormat::WindowsTerminal;
             QFile file(info.path);
@@ -230,9 +263,22 @@ QList<TerminalTheme::ThemeInfo> TerminalTheme::builtInThemes() {
         }
         themes.append(info);
     }
-    std::sort(themes.begin(), themes.end(), [](const ThemeInfo &a, const ThemeInfo &b) {
-        return a.name.compare(b.name, Qt::CaseInsensitive) < 0;
-    });
+    return themes;
+}
+
+QList<TerminalTheme::ThemeInfo> TerminalTheme::builtInThemes() {
+    // Built-in resources never change, the list is made once and shared
+    static const QList<ThemeInfo> themes = []() {
+        Q_INIT_RESOURCE(KodoTermThemes);
+        QList<ThemeInfo> list = readThemeIndex();
+        if (list.isEmpty()) {
+            list = scanThemes();
+        }
+        std::sort(list.begin(), list.end(), [](const ThemeInfo &a, const ThemeInfo &b) {
+            return a.name.compare(b.name, Qt::CaseInsensitive) < 0;
+        });
+        return list;
+    }();
     return themes;
 }
 
@@ -339,6 +385,21 @@ void KodoTermConfig::setDefaults() {
         QStandardPaths::writableLocation(QStandardPaths::GenericDataLocation) + "/KodoShell";
     wordSelectionRegex = "[a-zA-Z0-9_\\.\\-\\/~\\:]+";
     maxScrollback = 1000;
+    targetFrameRate = 60;
+    maxParseTimePerFrame = 8;
+    threadedPtyReader = true;
+    glyphAtlas = true;
+    scrollbackHotLines = 10000;
+    scrollbackMemoryLimit = 64;
+    scrollbackSpillToDisk = true;
+    statsOverlay = false;
+    logFlushInterval = 1000;
+    logFlushSize = 256;
+    logCompression = false;
+    checkpointInterval = 30;
+    releaseHiddenBuffers = true;
+    directBackgrounds = true;
+    gpuRendering = false;
     theme = TerminalTheme::defaultTheme();
 }
 
@@ -387,6 +448,51 @@ void KodoTermConfig::load(const QJsonObject &json) {
     if (json.contains("maxScrollback")) {
         maxScrollback = json["maxScrollback"].toInt();
     }
+    if (json.contains("targetFrameRate")) {
+        targetFrameRate = json["targetFrameRate"].toInt();
+    }
+    if (json.contains("maxParseTimePerFrame")) {
+        maxParseTimePerFrame = json["maxParseTimePerFrame"].toInt();
+    }
+    if (json.contains("threadedPtyReader")) {
+        threadedPtyReader = json["threadedPtyReader"].toBool();
+    }
+    if (json.contains("glyphAtlas")) {
+        glyphAtlas = json["glyphAtlas"].toBool();
+    }
+    if (json.contains("scrollbackHotLines")) {
+        scrollbackHotLines = json["scrollbackHotLines"].toInt();
+    }
+    if (json.contains("scrollbackMemoryLimit")) {
+        scrollbackMemoryLimit = json["scrollbackMemoryLimit"].toInt();
+    }
+    if (json.contains("scrollbackSpillToDisk")) {
+        scrollbackSpillToDisk = json["scrollbackSpillToDisk"].toBool();
+    }
+    if (json.contains("statsOverlay")) {
+        statsOverlay = json["statsOverlay"].toBool();
+    }
+    if (json.contains("logFlushInterval")) {
+        logFlushInterval = json["logFlushInterval"].toInt();
+    }
+    if (json.contains("logFlushSize")) {
+        logFlushSize = json["logFlushSize"].toInt();
+    }
+    if (json.contains("logCompression")) {
+        logCompression = json["logCompression"].toBool();
+    }
+    if (json.contains("checkpointInterval")) {
+        checkpointInterval = json["checkpointInterval"].toInt();
+    }
+    if (json.contains("releaseHiddenBuffers")) {
+        releaseHiddenBuffers = json["releaseHiddenBuffers"].toBool();
+    }
+    if (json.contains("directBackgrounds")) {
+        directBackgrounds = json["directBackgrounds"].toBool();
+    }
+    if (json.contains("gpuRendering")) {
+        gpuRendering = json["gpuRendering"].toBool();
+    }
     if (json.contains("theme")) {
         theme = TerminalTheme::fromJson(json["theme"].toObject());
     }
@@ -410,6 +516,21 @@ QJsonObject KodoTermConfig::saveToJson() const {
     obj["logDirectory"] = logDirectory;
     obj["wordSelectionRegex"] = wordSelectionRegex;
     obj["maxScrollback"] = maxScrollback;
+    obj["targetFrameRate"] = targetFrameRate;
+    obj["maxParseTimePerFrame"] = maxParseTimePerFrame;
+    obj["threadedPtyReader"] = threadedPtyReader;
+    obj["glyphAtlas"] = glyphAtlas;
+    obj["scrollbackHotLines"] = scrollbackHotLines;
+    obj["scrollbackMemoryLimit"] = scrollbackMemoryLimit;
+    obj["scrollbackSpillToDisk"] = scrollbackSpillToDisk;
+    obj["statsOverlay"] = statsOverlay;
+    obj["logFlushInterval"] = logFlushInterval;
+    obj["logFlushSize"] = logFlushSize;
+    obj["logCompression"] = logCompression;
+    obj["checkpointInterval"] = checkpointInterval;
+    obj["releaseHiddenBuffers"] = releaseHiddenBuffers;
+    obj["directBackgrounds"] = directBackgrounds;
+    obj["gpuRendering"] = gpuRendering;
     obj["theme"] = theme.toJson();
     return obj;
 }
@@ -434,6 +555,21 @@ void KodoTermConfig::load(QSettings &settings) {
     logDirectory = settings.value("logDirectory", logDirectory).toString();
     wordSelectionRegex = settings.value("wordSelectionRegex", wordSelectionRegex).toString();
     maxScrollback = settings.value("maxScrollback", maxScrollback).toInt();
+    targetFrameRate = settings.value("targetFrameRate", targetFrameRate).toInt();
+    maxParseTimePerFrame = settings.value("maxParseTimePerFrame", maxParseTimePerFrame).toInt();
+    threadedPtyReader = settings.value("threadedPtyReader", threadedPtyReader).toBool();
+    glyphAtlas = settings.value("glyphAtlas", glyphAtlas).toBool();
+    scrollbackHotLines = settings.value("scrollbackHotLines", scrollbackHotLines).toInt();
+    scrollbackMemoryLimit = settings.value("scrollbackMemoryLimit", scrollbackMemoryLimit).toInt();
+    scrollbackSpillToDisk = settings.value("scrollbackSpillToDisk", scrollbackSpillToDisk).toBool();
+    statsOverlay = settings.value("statsOverlay", statsOverlay).toBool();
+    logFlushInterval = settings.value("logFlushInterval", logFlushInterval).toInt();
+    logFlushSize = settings.value("logFlushSize", logFlushSize).toInt();
+    logCompression = settings.value("logCompression", logCompression).toBool();
+    checkpointInterval = settings.value("checkpointInterval", checkpointInterval).toInt();
+    releaseHiddenBuffers = settings.value("releaseHiddenBuffers", releaseHiddenBuffers).toBool();
+    directBackgrounds = settings.value("directBackgrounds", directBackgrounds).toBool();
+    gpuRendering = settings.value("gpuRendering", gpuRendering).toBool();
     theme.load(settings, "Theme");
 }
 
@@ -452,5 +588,20 @@ void KodoTermConfig::save(QSettings &settings) const {
     settings.setValue("logDirectory", logDirectory);
     settings.setValue("wordSelectionRegex", wordSelectionRegex);
     settings.setValue("maxScrollback", maxScrollback);
+    settings.setValue("targetFrameRate", targetFrameRate);
+    settings.setValue("maxParseTimePerFrame", maxParseTimePerFrame);
+    settings.setValue("threadedPtyReader", threadedPtyReader);
+    settings.setValue("glyphAtlas", glyphAtlas);
+    settings.setValue("scrollbackHotLines", scrollbackHotLines);
+    settings.setValue("scrollbackMemoryLimit", scrollbackMemoryLimit);
+    settings.setValue("scrollbackSpillToDisk", scrollbackSpillToDisk);
+    settings.setValue("statsOverlay", statsOverlay);
+    settings.setValue("logFlushInterval", logFlushInterval);
+    settings.setValue("logFlushSize", logFlushSize);
+    settings.setValue("logCompression", logCompression);
+    settings.setValue("checkpointInterval", checkpointInterval);
+    settings.setValue("releaseHiddenBuffers", releaseHiddenBuffers);
+    settings.setValue("directBackgrounds", directBackgrounds);
+    settings.setValue("gpuRendering", gpuRendering);
     theme.save(settings, "Theme");
 }
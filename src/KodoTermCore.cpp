@@ -0,0 +1,564 @@
+// SPDX-License-Identifier: MIT
+// Author: Diego Iastrubni <diegoiast@gmail.com>
+
+#include "KodoTerm/KodoTermCore.hpp"
+#include "DirtySpans.h"
+#include "PtyProcess.h"
+#include "Scrollback.h"
+#include "SessionLogger.h"
+#include "TerminalSnapshot.h"
+#include "TerminalState.h"
+
+#include <QDataStream>
+#include <QFile>
+#include <QTimer>
+#include <QUrl>
+#include <algorithm>
+#include <utility>
+
+// Log data parsed at a time by replayLog()
+static constexpr qint64 ReplayChunk = 64 * 1024;
+// Once this much child output is queued we stop reading from the child until it is parsed
+static constexpr qsizetype MaxPendingInput = 4 * 1024 * 1024;
+// Quiet time (ms) after a likely change before the foreground process is looked at
+static constexpr int ForegroundCheckDelay = 150;
+// Output after this long (ms) without any is a likely change too
+static constexpr int ForegroundIdleTime = 1000;
+// Pastes are handed to the PTY this much at a time, the next chunk once the child read it
+static constexpr qsizetype PasteChunkSize = 64 * 1024;
+
+KodoTermCore::KodoTermCore(int rows, int cols, QObject *parent) : QObject(parent) {
+    m_scrollback = new ScrollbackBuffer;
+    m_snapshots = new SnapshotCache;
+    m_dirtySpans = new DirtySpans;
+    m_vterm = vterm_new(std::max(rows, 1), std::max(cols, 1));
+    vterm_set_utf8(m_vterm, 1);
+    m_screen = vterm_obtain_screen(m_vterm);
+    vterm_screen_enable_altscreen(m_screen, 1);
+    static VTermScreenCallbacks callbacks = {.damage = &KodoTermCore::onDamage,
+                                             .moverect = &KodoTermCore::onMoveRect,
+                                             .movecursor = &KodoTermCore::onMoveCursor,
+                                             .settermprop = &KodoTermCore::onSetTermProp,
+                                             .bell = &KodoTermCore::onBell,
+                                             .resize = nullptr,
+                                             .sb_pushline = nullptr,
+                                             .sb_popline = &KodoTermCore::onSbPopLine,
+                                             .sb_clear = nullptr,
+                                             .sb_pushline4 = &KodoTermCore::onSbPushLine};
+    vterm_screen_set_callbacks(m_screen, &callbacks, this);
+    // Wrapped rows reach the scrollback flagged, so it can join them up again on resize
+    vterm_screen_callbacks_has_pushline4(m_screen);
+    vterm_screen_enable_reflow(m_screen, true);
+    static VTermStateFallbacks fallbacks = {.control = nullptr,
+                                            .csi = nullptr,
+                                            .osc = &KodoTermCore::onOsc,
+                                            .dcs = nullptr,
+                                            .apc = nullptr,
+                                            .pm = nullptr,
+                                            .sos = nullptr};
+    vterm_state_set_unrecognised_fallbacks(vterm_obtain_state(m_vterm), &fallbacks, this);
+    vterm_output_set_callback(m_vterm, &KodoTermCore::onOutput, this);
+    vterm_screen_reset(m_screen, 1);
+    m_scrollback->setWrapWidth(this->cols());
+
+    m_foregroundTimer = new QTimer(this);
+    m_foregroundTimer->setSingleShot(true);
+    m_foregroundTimer->setInterval(ForegroundCheckDelay);
+    connect(m_foregroundTimer, &QTimer::timeout, this, [this]() {
+        if (m_pty) {
+            m_pty->checkForeground();
+        }
+    });
+}
+
+KodoTermCore::~KodoTermCore() {
+    kill();
+    vterm_free(m_vterm);
+    delete m_scrollback;
+    delete m_snapshots;
+    delete m_dirtySpans;
+}
+
+int KodoTermCore::rows() const {
+    int rows, cols;
+    vterm_get_size(m_vterm, &rows, &cols);
+    return rows;
+}
+
+int KodoTermCore::cols() const {
+    int rows, cols;
+    vterm_get_size(m_vterm, &rows, &cols);
+    return cols;
+}
+
+void KodoTermCore::resize(int rows, int cols) {
+    rows = std::max(rows, 1);
+    cols = std::max(cols, 1);
+    if (rows == this->rows() && cols == this->cols()) {
+        return;
+    }
+    m_scrollback->setWrapWidth(cols);
+    vterm_set_size(m_vterm, rows, cols);
+    vterm_screen_flush_damage(m_screen);
+    m_dirtySpans->clear();
+    markDirty(0, rows, 0, cols);
+    if (m_pty) {
+        m_pty->resize(QSize(cols, rows));
+    }
+}
+
+bool KodoTermCore::start(const QString &program, const QStringList &arguments,
+                         const QString &workingDirectory,
+                         const QProcessEnvironment &environment) {
+    kill();
+    m_pty = PtyProcess::create(this);
+    if (!m_pty) {
+        return false;
+    }
+    QProcessEnvironment env = environment;
+    if (!env.contains("TERM")) {
+        env.insert("TERM", "xterm-256color");
+    }
+    m_pty->setWorkingDirectory(workingDirectory);
+    m_pty->setProcessEnvironment(env);
+    m_pty->setReadMode(m_threadedReader ? PtyProcess::ReadMode::Thread
+                                        : PtyProcess::ReadMode::Notifier);
+    connectPty();
+    if (!m_pty->start(program, arguments, QSize(cols(), rows()))) {
+        delete m_pty;
+        m_pty = nullptr;
+        return false;
+    }
+    m_foregroundTimer->start();
+    return true;
+}
+
+void KodoTermCore::connectPty() {
+    connect(m_pty, &PtyProcess::readyRead, this, &KodoTermCore::receive);
+    connect(m_pty, &PtyProcess::bytesWritten, this, &KodoTermCore::feedPaste);
+    connect(m_pty, &PtyProcess::foregroundChanged, this, &KodoTermCore::foregroundChanged);
+    connect(m_pty, &PtyProcess::finished, this, [this](int exitCode, int exitStatus) {
+        m_pty->deleteLater();
+        m_pty = nullptr;
+        emit finished(exitCode, exitStatus);
+    });
+}
+
+void KodoTermCore::kill() {
+    if (m_pty) {
+        m_pty->kill();
+        delete m_pty;
+        m_pty = nullptr;
+    }
+    m_pending.clear();
+    m_pendingOffset = 0;
+    m_readPaused = false;
+    m_paste.clear();
+    m_pasteOffset = 0;
+    m_pasteTail.clear();
+    m_inputSent = false;
+}
+
+void KodoTermCore::terminate() {
+    if (m_pty) {
+        m_pty->kill();
+    }
+}
+
+void KodoTermCore::takeProcess(KodoTermCore *other) {
+    kill();
+    m_pty = std::exchange(other->m_pty, nullptr);
+    m_pending = std::exchange(other->m_pending, QByteArray());
+    m_pendingOffset = std::exchange(other->m_pendingOffset, 0);
+    m_readPaused = std::exchange(other->m_readPaused, false);
+    m_paste = std::exchange(other->m_paste, QByteArray());
+    m_pasteOffset = std::exchange(other->m_pasteOffset, 0);
+    m_pasteTail = std::exchange(other->m_pasteTail, QByteArray());
+    m_inputSent = std::exchange(other->m_inputSent, false);
+    m_sinceOutput = other->m_sinceOutput;
+    if (!m_pty) {
+        return;
+    }
+    m_pty->disconnect(other);
+    m_pty->setParent(this);
+    connectPty();
+    m_pty->resize(QSize(cols(), rows()));
+    m_foregroundTimer->start();
+}
+
+void KodoTermCore::sendInput(const QByteArray &data) {
+    if (!m_pty || data.isEmpty()) {
+        return;
+    }
+    m_inputSent = true;
+    // Keys typed while a paste is still going out follow it, outside of the paste brackets
+    if (!m_paste.isEmpty()) {
+        m_pasteTail.append(data);
+        return;
+    }
+    m_pty->write(data);
+}
+
+void KodoTermCore::paste(const QByteArray &data) {
+    if (data.isEmpty() || !m_pty) {
+        return;
+    }
+    if (m_paste.isEmpty()) {
+        vterm_keyboard_start_paste(m_vterm);
+        m_pasteOffset = 0;
+    }
+    m_paste.append(data);
+    feedPaste();
+}
+
+// Keeps at most a chunk of the paste queued, the output the child produces meanwhile keeps
+// being shown
+void KodoTermCore::feedPaste() {
+    if (m_paste.isEmpty() || !m_pty) {
+        return;
+    }
+    while (m_pasteOffset < m_paste.size() && m_pty->bytesToWrite() < PasteChunkSize) {
+        qsizetype n = std::min(PasteChunkSize, m_paste.size() - m_pasteOffset);
+        m_pty->write(QByteArray(m_paste.constData() + m_pasteOffset, n));
+        m_pasteOffset += n;
+    }
+    if (m_pasteOffset < m_paste.size()) {
+        return;
+    }
+    m_paste.clear();
+    m_pasteOffset = 0;
+    vterm_keyboard_end_paste(m_vterm);
+    if (!m_pasteTail.isEmpty()) {
+        m_pty->write(m_pasteTail);
+        m_pasteTail.clear();
+    }
+}
+
+QString KodoTermCore::foregroundProcessName() const {
+    return m_pty ? m_pty->foregroundProcessName() : QString();
+}
+
+bool KodoTermCore::isRoot() const { return m_pty && m_pty->isRoot(); }
+
+void KodoTermCore::foregroundLikelyChanged() {
+    if (m_pty) {
+        m_foregroundTimer->start();
+    }
+}
+
+void KodoTermCore::receive(const QByteArray &data) {
+    if (data.isEmpty()) {
+        return;
+    }
+    emit received(data);
+    // Output answering input is when a command starts or ends. So is the first output after
+    // a quiet spell, a command that ends on its own prints the prompt without any input.
+    const bool idle = !m_sinceOutput.isValid() || m_sinceOutput.elapsed() > ForegroundIdleTime;
+    m_sinceOutput.start();
+    if (m_inputSent || idle) {
+        m_inputSent = false;
+        foregroundLikelyChanged();
+    }
+    if (!m_paced) {
+        feed(data);
+        return;
+    }
+    m_pending.append(data);
+    if (m_pty && !m_readPaused && pendingBytes() > MaxPendingInput) {
+        m_readPaused = true;
+        m_pty->setReadEnabled(false);
+    }
+}
+
+qsizetype KodoTermCore::parsePending(qsizetype maxBytes) {
+    const qsizetype n = std::min(maxBytes, pendingBytes());
+    if (n <= 0) {
+        return 0;
+    }
+    feed(QByteArray::fromRawData(m_pending.constData() + m_pendingOffset, n));
+    m_pendingOffset += n;
+    if (m_pendingOffset >= m_pending.size()) {
+        m_pending.clear();
+        m_pendingOffset = 0;
+    } else if (m_pendingOffset > m_pending.size() / 2) {
+        m_pending.remove(0, m_pendingOffset);
+        m_pendingOffset = 0;
+    }
+    if (m_readPaused && pendingBytes() < MaxPendingInput / 2) {
+        m_readPaused = false;
+        if (m_pty) {
+            m_pty->setReadEnabled(true);
+        }
+    }
+    return n;
+}
+
+void KodoTermCore::feed(const QByteArray &data) {
+    if (data.isEmpty()) {
+        return;
+    }
+    vterm_input_write(m_vterm, data.constData(), data.size());
+    vterm_screen_flush_damage(m_screen);
+}
+
+bool KodoTermCore::replayLog(const QString &logPath, const QString &checkpointPath,
+                             const std::function<bool()> &keepGoing) {
+    SessionLogReader log;
+    if (!log.open(logPath)) {
+        return false;
+    }
+    QFile checkpoint(checkpointPath);
+    if (!checkpointPath.isEmpty() && checkpoint.open(QIODevice::ReadOnly)) {
+        QDataStream in(&checkpoint);
+        qint64 offset = 0;
+        if (readState(in, &offset)) {
+            // A log shorter than the offset lost its tail, the checkpoint is newer
+            log.skip(offset);
+        } else {
+            reset();
+            clearScrollback();
+            log.open(logPath);
+        }
+    }
+    for (QByteArray chunk = log.read(ReplayChunk); !chunk.isEmpty();
+         chunk = log.read(ReplayChunk)) {
+        if (keepGoing && !keepGoing()) {
+            return false;
+        }
+        vterm_input_write(m_vterm, chunk.constData(), chunk.size());
+    }
+    vterm_screen_flush_damage(m_screen);
+    markDirty(0, rows(), 0, cols());
+    return true;
+}
+
+void KodoTermCore::reset() {
+    vterm_screen_reset(m_screen, 1);
+    markDirty(0, rows(), 0, cols());
+}
+
+void KodoTermCore::clearScrollback() { m_scrollback->clear(); }
+
+bool KodoTermCore::saveState(const QString &path) {
+    return TerminalState::save(path, *snapshot(), 0);
+}
+
+bool KodoTermCore::loadState(const QString &path) {
+    QFile f(path);
+    if (!f.open(QIODevice::ReadOnly)) {
+        return false;
+    }
+    QDataStream in(&f);
+    return readState(in);
+}
+
+void KodoTermCore::writeState(QDataStream &out, qint64 logOffset) {
+    TerminalState::write(out, *snapshot(), logOffset);
+}
+
+bool KodoTermCore::readState(QDataStream &in, qint64 *logOffset) {
+    bool ok = TerminalState::read(in, m_vterm, *m_scrollback, logOffset);
+    // The scrollback was replaced under the cached snapshots
+    m_snapshots->invalidate();
+    markDirty(0, rows(), 0, cols());
+    return ok;
+}
+
+std::shared_ptr<const TerminalSnapshot> KodoTermCore::snapshot() {
+    return m_snapshots->take(m_vterm, *m_scrollback, m_altScreen);
+}
+
+int KodoTermCore::scrollbackRows() const { return m_scrollback->rows(); }
+
+int KodoTermCore::fetchRow(int row, int startCol, int endCol, VTermScreenCell *cells) const {
+    const int rows = this->rows(), cols = this->cols();
+    const int sb = m_scrollback->rows();
+    if (row < sb) {
+        return m_scrollback->readRow(row, endCol, cells);
+    }
+    const int vr = row - sb;
+    for (int c = startCol; c < endCol; ++c) {
+        if (vr < rows && c < cols) {
+            vterm_screen_get_cell(m_screen, {vr, c}, &cells[c]);
+        } else {
+            cells[c] = VTermScreenCell{};
+            cells[c].width = 1;
+            cells[c].fg.type = VTERM_COLOR_DEFAULT_FG;
+            cells[c].bg.type = VTERM_COLOR_DEFAULT_BG;
+        }
+    }
+    return vr < rows ? cols : 0;
+}
+
+QString KodoTermCore::screenText() {
+    QString text;
+    // Only the screen, the scrollback is not needed
+    m_snapshots->takeScreen(m_vterm, m_altScreen)
+        ->writeText({0, 0}, {rows() - 1, cols() - 1}, [&text](const QString &chunk) {
+            text.append(chunk);
+            return true;
+        });
+    // Blank rows at the bottom
+    while (text.endsWith('\n')) {
+        text.chop(1);
+    }
+    return text;
+}
+
+QList<QRect> KodoTermCore::takeDamage() { return m_dirtySpans->take(); }
+
+bool KodoTermCore::hasDamage() const { return !m_dirtySpans->isEmpty(); }
+
+void KodoTermCore::markDirty(int top, int bottom, int startCol, int endCol) {
+    const bool notify = !hasDamage();
+    m_dirtySpans->mark(rows(), cols(), top, bottom, startCol, endCol);
+    if (notify && hasDamage()) {
+        emit damaged();
+    }
+}
+
+int KodoTermCore::onDamage(VTermRect r, void *user) {
+    auto *core = static_cast<KodoTermCore *>(user);
+    core->m_snapshots->damage(r.start_row, r.end_row);
+    core->markDirty(r.start_row, r.end_row, r.start_col, r.end_col);
+    return 1;
+}
+
+int KodoTermCore::onMoveRect(VTermRect d, VTermRect s, void *user) {
+    auto *core = static_cast<KodoTermCore *>(user);
+    core->m_snapshots->damage(d.start_row, d.end_row);
+    // Whoever draws the core decides how to move pixels, views keeping them can compare the
+    // moved cells rather than draw them again
+    emit core->moved(
+        QRect(d.start_col, d.start_row, d.end_col - d.start_col, d.end_row - d.start_row),
+        QRect(s.start_col, s.start_row, s.end_col - s.start_col, s.end_row - s.start_row));
+    core->markDirty(std::min(d.start_row, s.start_row), std::max(d.end_row, s.end_row),
+                    std::min(d.start_col, s.start_col), std::max(d.end_col, s.end_col));
+    return 1;
+}
+
+int KodoTermCore::onMoveCursor(VTermPos pos, VTermPos oldpos, int visible, void *user) {
+    auto *core = static_cast<KodoTermCore *>(user);
+    core->m_cursor = QPoint(pos.col, pos.row);
+    core->m_cursorVisible = visible;
+    core->markDirty(oldpos.row, oldpos.row + 1, oldpos.col, oldpos.col + 1);
+    core->markDirty(pos.row, pos.row + 1, pos.col, pos.col + 1);
+    return 1;
+}
+
+int KodoTermCore::onSetTermProp(VTermProp prop, VTermValue *val, void *user) {
+    auto *core = static_cast<KodoTermCore *>(user);
+    const QPoint cursor = core->m_cursor;
+    switch (prop) {
+    case VTERM_PROP_CURSORVISIBLE:
+        core->m_cursorVisible = val->boolean;
+        core->markDirty(cursor.y(), cursor.y() + 1, cursor.x(), cursor.x() + 1);
+        break;
+    case VTERM_PROP_CURSORBLINK:
+        core->m_cursorBlink = val->boolean;
+        core->markDirty(cursor.y(), cursor.y() + 1, cursor.x(), cursor.x() + 1);
+        emit core->cursorBlinkChanged(core->m_cursorBlink);
+        break;
+    case VTERM_PROP_CURSORSHAPE:
+        core->m_cursorShape = val->number;
+        core->markDirty(cursor.y(), cursor.y() + 1, cursor.x(), cursor.x() + 1);
+        break;
+    case VTERM_PROP_MOUSE:
+        core->m_mouseMode = val->number;
+        break;
+    case VTERM_PROP_REVERSE:
+        core->markDirty(0, core->rows(), 0, core->cols());
+        break;
+    case VTERM_PROP_ALTSCREEN:
+        core->m_altScreen = val->boolean;
+        core->markDirty(0, core->rows(), 0, core->cols());
+        emit core->altScreenChanged(core->m_altScreen);
+        break;
+    case VTERM_PROP_TITLE:
+        core->m_title = QString::fromUtf8(val->string.str, (int)val->string.len);
+        emit core->titleChanged(core->m_title);
+        // Many shells retitle the window as a command starts
+        core->foregroundLikelyChanged();
+        break;
+    default:
+        break;
+    }
+    return 1;
+}
+
+int KodoTermCore::onBell(void *user) {
+    emit static_cast<KodoTermCore *>(user)->bell();
+    return 1;
+}
+
+int KodoTermCore::onSbPushLine(int cols, const VTermScreenCell *cells, bool continuation,
+                               void *user) {
+    auto *core = static_cast<KodoTermCore *>(user);
+    if (core->m_altScreen) {
+        return 0;
+    }
+    core->m_scrollback->append(cols, cells, continuation);
+    const bool dropped = core->m_scrollback->size() > core->m_maxScrollback;
+    if (dropped) {
+        core->m_scrollback->popFront();
+    }
+    emit core->scrollbackPushed(cols, cells, dropped);
+    return 1;
+}
+
+int KodoTermCore::onSbPopLine(int cols, VTermScreenCell *cells, void *user) {
+    auto *core = static_cast<KodoTermCore *>(user);
+    if (core->m_scrollback->isEmpty()) {
+        return 0;
+    }
+    // The last row of a wrapped line may sit in the middle of a stored one
+    const int lines = core->m_scrollback->size();
+    int changedFrom = lines;
+    core->m_scrollback->popRow(cols, cells, &changedFrom);
+    emit core->scrollbackPopped(changedFrom, lines - changedFrom);
+    return 1;
+}
+
+int KodoTermCore::onOsc(int command, VTermStringFragment frag, void *user) {
+    auto *core = static_cast<KodoTermCore *>(user);
+    if (frag.initial) {
+        core->m_oscBuffer.clear();
+    }
+    core->m_oscBuffer.append(frag.str, frag.len);
+    if (!frag.final || command != 7) {
+        return 1;
+    }
+    QString s = QString::fromUtf8(core->m_oscBuffer);
+    while (!s.isEmpty() &&
+           (s.endsWith(';') || s.endsWith('\a') || s.endsWith('\n') || s.endsWith(' '))) {
+        s.chop(1);
+    }
+    if (s.startsWith("file://")) {
+        QUrl u(s);
+        QString p = u.toLocalFile();
+        if (p.isEmpty() || (p.startsWith("//") && !u.host().isEmpty())) {
+            p = u.path();
+        }
+        s = p;
+    }
+    if (s.isEmpty()) {
+        return 1;
+    }
+    emit core->cwdReported(s);
+    // Shells report the directory with every prompt, the command before it has ended
+    core->foregroundLikelyChanged();
+    if (s != core->m_cwd) {
+        core->m_cwd = s;
+        emit core->cwdChanged(s);
+    }
+    return 1;
+}
+
+void KodoTermCore::onOutput(const char *s, size_t len, void *user) {
+    auto *core = static_cast<KodoTermCore *>(user);
+    if (core->m_pty) {
+        core->sendInput(QByteArray(s, (qsizetype)len));
+    } else {
+        emit core->output(QByteArray(s, (qsizetype)len));
+    }
+}
@@ -0,0 +1,79 @@
+// SPDX-License-Identifier: MIT
+// Author: Diego Iastrubni <diegoiast@gmail.com>
+
+#include "LinkCache.h"
+#include "ScrollbackSearch.h"
+
+#include <QRegularExpression>
+#include <algorithm>
+
+// URLs, ~/ and ./ relative paths, and absolute paths with at least two components
+static const QRegularExpression &linkRegex() {
+    static const QRegularExpression re(
+        R"((?:(?:https?|ftp|file)://|mailto:|www\.)[^\s<>"'`]+)"
+        "|"
+        R"((?<![\w/.~])(?:(?:~|\.{1,2})(?:/[\w.\-+~@]+)+|(?:/[\w.\-+~@]+){2,})/?)");
+    return re;
+}
+
+void LinkCache::resize(int rows, int cols) {
+    m_rows.assign(std::max(0, rows), Row());
+    m_cols = std::max(0, cols);
+}
+
+void LinkCache::invalidateRows(int first, int last) {
+    first = std::max(0, first);
+    last = std::min((int)m_rows.size(), last);
+    for (int r = first; r < last; ++r) {
+        m_rows[r].valid = false;
+    }
+}
+
+void LinkCache::invalidateAll() {
+    for (auto &row : m_rows) {
+        row.valid = false;
+    }
+}
+
+bool LinkCache::isValid(int row) const {
+    return row >= 0 && row < (int)m_rows.size() && m_rows[row].valid;
+}
+
+void LinkCache::setRow(int row, const SearchLine &line) {
+    if (row < 0 || row >= (int)m_rows.size()) {
+        return;
+    }
+    Row &r = m_rows[row];
+    r.valid = true;
+    r.links.clear();
+    r.cells.assign(m_cols, -1);
+    for (auto it = linkRegex().globalMatch(line.text); it.hasNext();) {
+        QRegularExpressionMatch m = it.next();
+        QString target = m.captured();
+        // Sentence punctuation and closing brackets are rarely part of the link
+        qsizetype length = target.size();
+        while (length > 0 && QStringLiteral(".,;:!?)]}'\"").contains(target[length - 1])) {
+            length--;
+        }
+        if (length < 3) {
+            continue;
+        }
+        target.truncate(length);
+        int start = line.columnAt(m.capturedStart());
+        int end = std::min(m_cols, line.columnAt(m.capturedStart() + length));
+        if (start >= end || r.links.size() >= INT16_MAX) {
+            continue;
+        }
+        std::fill(r.cells.begin() + start, r.cells.begin() + end, (int16_t)r.links.size());
+        r.links.push_back({start, end, target});
+    }
+}
+
+const TerminalLink *LinkCache::linkAt(int row, int col) const {
+    if (!isValid(row) || col < 0 || col >= m_cols) {
+        return nullptr;
+    }
+    const Row &r = m_rows[row];
+    int16_t i = r.cells.empty() ? -1 : r.cells[col];
+    return i < 0 ? nullptr : &r.links[i];
+}
@@ -0,0 +1,40 @@
+// SPDX-License-Identifier: MIT
+// Author: Diego Iastrubni <diegoiast@gmail.com>
+
+#pragma once
+
+#include <QString>
+#include <cstdint>
+#include <vector>
+
+struct SearchLine;
+
+// A URL or absolute path found on screen, covering cells [start, end) of its row
+struct TerminalLink {
+    int start;
+    int end;
+    QString target;
+};
+
+// Links of the rows currently in the viewport, detected lazily the first time a row is
+// hovered or clicked. Each row keeps a cell to link map, so lookups are O(1) until the row
+// is invalidated by damage or scrolling.
+class LinkCache {
+  public:
+    void resize(int rows, int cols);
+    void invalidateRows(int first, int last);
+    void invalidateAll();
+
+    bool isValid(int row) const;
+    void setRow(int row, const SearchLine &line);
+    const TerminalLink *linkAt(int row, int col) const;
+
+  private:
+    struct Row {
+        bool valid = false;
+        std::vector<TerminalLink> links;
+        std::vector<int16_t> cells;
+    };
+    std::vector<Row> m_rows;
+    int m_cols = 0;
+};
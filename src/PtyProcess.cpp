@@ -16,6 +16,17 @@ bool PtyProcess::start(const QString &program, const QStringList &arguments, con
     return start(size);
 }
 
+void PtyProcess::consumeWritten(qsizetype n) {
+    m_writeOffset += n;
+    if (m_writeOffset >= m_writeQueue.size()) {
+        m_writeQueue.clear();
+        m_writeOffset = 0;
+    } else if (m_writeOffset > m_writeQueue.size() / 2) {
+        m_writeQueue.remove(0, m_writeOffset);
+        m_writeOffset = 0;
+    }
+}
+
 PtyProcess *PtyProcess::create(QObject *parent) {
 #if defined(Q_OS_UNIX)
     return new PtyProcessUnix(parent);
@@ -12,6 +12,10 @@ class PtyProcess : public QObject {
     Q_OBJECT
 
   public:
+    // Notifier reads the PTY on the GUI thread, one read per activation. Thread drains it on
+    // a dedicated thread into a ring buffer which the GUI side consumes in large batches.
+    enum class ReadMode { Notifier, Thread };
+
     explicit PtyProcess(QObject *parent = nullptr) : QObject(parent) {}
     virtual ~PtyProcess() = default;
 
@@ -31,13 +35,26 @@ class PtyProcess : public QObject {
     }
     QProcessEnvironment processEnvironment() const { return m_environment; }
 
+    // Takes effect on the next start()
+    void setReadMode(ReadMode mode) { m_readMode = mode; }
+    ReadMode readMode() const { return m_readMode; }
+
     virtual bool start(const QSize &size) = 0;
     virtual bool start(const QString &program, const QStringList &arguments, const QSize &size);
+    // Queues data for the child and returns right away. Writes made within one pass of the
+    // event loop go out together, the queue drains as fast as the child reads.
     virtual void write(const QByteArray &data) = 0;
+    qsizetype bytesToWrite() const { return m_writeQueue.size() - m_writeOffset; }
     virtual void resize(const QSize &size) = 0;
     virtual void kill() = 0;
+    // Stop pulling data from the child while the consumer catches up, so the kernel
+    // applies back-pressure instead of us buffering without bound.
+    virtual void setReadEnabled(bool enabled) = 0;
+    // Both describe the foreground process as of the last checkForeground(), which the
+    // owner calls whenever it is likely to have changed
     virtual bool isRoot() const = 0;
     virtual QString foregroundProcessName() const = 0;
+    virtual void checkForeground() {}
 
     // Factory method
     static PtyProcess *create(QObject *parent = nullptr);
@@ -45,10 +62,20 @@ class PtyProcess : public QObject {
   signals:
     void readyRead(const QByteArray &data);
     void finished(int exitCode, int exitStatus);
+    // The write queue ran empty
+    void bytesWritten();
+    // Another process got the terminal, or the same one under another user
+    void foregroundChanged();
 
   protected:
     QString m_program;
     QStringList m_arguments;
     QString m_workingDirectory;
     QProcessEnvironment m_environment = QProcessEnvironment::systemEnvironment();
+    ReadMode m_readMode = ReadMode::Thread;
+
+    // Sent up to m_writeOffset, filled by write() and drained by the platform code
+    QByteArray m_writeQueue;
+    qsizetype m_writeOffset = 0;
+    void consumeWritten(qsizetype n);
 };
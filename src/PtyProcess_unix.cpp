@@ -12,18 +12,151 @@
 #endif
 #include <QFile>
 #include <QFileInfo>
+#include <QThread>
+#include <algorithm>
 #include <cerrno>
 #include <fcntl.h>
+#include <poll.h>
 #include <signal.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <termios.h>
 #include <unistd.h>
 
+// Most handed to a single write(), the kernel takes far less per call anyway
+static constexpr qsizetype WriteChunkSize = 64 * 1024;
+
+// Drains the PTY master into the ring buffer. The GUI thread is only notified when the
+// buffer goes from empty to non-empty, so a fast producer costs one queued call per batch
+// instead of one per read. A self-pipe is used to wake the thread for stop/pause/resume.
+class PtyProcessUnix::ReaderThread : public QThread {
+  public:
+    ReaderThread(int fd, PtyProcessUnix *parent) : m_fd(fd), m_parent(parent) {
+        if (::pipe(m_wakePipe) == 0) {
+            fcntl(m_wakePipe[0], F_SETFL, O_NONBLOCK);
+            fcntl(m_wakePipe[1], F_SETFL, O_NONBLOCK);
+        }
+    }
+
+    ~ReaderThread() override {
+        for (int fd : m_wakePipe) {
+            if (fd >= 0) {
+                ::close(fd);
+            }
+        }
+    }
+
+    void run() override {
+        RingBuffer &ring = m_parent->m_ring;
+        while (m_running) {
+            char *buffer = nullptr;
+            size_t space = m_paused ? 0 : ring.writeRegion(&buffer);
+            if (space == 0) {
+                // Full or paused: sleep until the consumer drains, or we get resumed/stopped.
+                // The timeout covers the (unlikely) race with the consumer's wake-up.
+                m_waiting = true;
+                waitForWake(50);
+                m_waiting = false;
+                continue;
+            }
+
+            pollfd fds[2] = {{m_fd, POLLIN, 0}, {m_wakePipe[0], POLLIN, 0}};
+            int rc = ::poll(fds, 2, -1);
+            if (rc < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                finish(-1);
+                break;
+            }
+            if (fds[1].revents) {
+                drainWake();
+                continue;
+            }
+            if (!fds[0].revents) {
+                continue;
+            }
+
+            ssize_t len = ::read(m_fd, buffer, space);
+            if (len > 0) {
+                ring.commitWrite((size_t)len);
+                notify();
+            } else if (len < 0 && (errno == EAGAIN || errno == EINTR)) {
+                continue;
+            } else {
+                finish(len == 0 ? 0 : -1);
+                break;
+            }
+        }
+    }
+
+    void stop() {
+        m_running = false;
+        wake();
+    }
+
+    void setPaused(bool paused) {
+        m_paused = paused;
+        wake();
+    }
+
+    void spaceAvailable() {
+        if (m_waiting) {
+            wake();
+        }
+    }
+
+    bool hasFinished() const { return m_finished; }
+    int exitCode() const { return m_exitCode; }
+
+  private:
+    void notify() {
+        if (!m_parent->m_dataNotified.exchange(true)) {
+            QMetaObject::invokeMethod(m_parent, "onReadThreadData", Qt::QueuedConnection);
+        }
+    }
+
+    void finish(int exitCode) {
+        m_exitCode = exitCode;
+        m_finished = true;
+        notify();
+    }
+
+    void wake() {
+        char c = 0;
+        if (m_wakePipe[1] >= 0) {
+            [[maybe_unused]] ssize_t r = ::write(m_wakePipe[1], &c, 1);
+        }
+    }
+
+    void waitForWake(int timeoutMs) {
+        pollfd fd = {m_wakePipe[0], POLLIN, 0};
+        if (::poll(&fd, 1, timeoutMs) > 0) {
+            drainWake();
+        }
+    }
+
+    void drainWake() {
+        char buffer[64];
+        while (::read(m_wakePipe[0], buffer, sizeof(buffer)) > 0) {
+        }
+    }
+
+    int m_fd;
+    PtyProcessUnix *m_parent;
+    int m_wakePipe[2] = {-1, -1};
+    std::atomic<bool> m_running = true;
+    std::atomic<bool> m_paused = false;
+    std::atomic<bool> m_waiting = false;
+    std::atomic<bool> m_finished = false;
+    std::atomic<int> m_exitCode = 0;
+};
+
 PtyProcessUnix::PtyProcessUnix(QObject *parent) : PtyProcess(parent) {}
 
 PtyProcessUnix::~PtyProcessUnix() {
     kill();
+    stopReaderThread();
     if (m_masterFd >= 0) {
         ::close(m_masterFd);
         m_masterFd = -1;
@@ -86,9 +219,19 @@ bool PtyProcessUnix::start(const QSize &size) {
     } else {
         // Parent
         m_pid = pid;
+        fcntl(m_masterFd, F_SETFL, fcntl(m_masterFd, F_GETFL) | O_NONBLOCK);
+        m_writeNotifier = new QSocketNotifier(m_masterFd, QSocketNotifier::Write, this);
+        m_writeNotifier->setEnabled(false);
+        connect(m_writeNotifier, &QSocketNotifier::activated, this,
+                &PtyProcessUnix::onReadyWrite);
 
-        m_notifier = new QSocketNotifier(m_masterFd, QSocketNotifier::Read, this);
-        connect(m_notifier, &QSocketNotifier::activated, this, &PtyProcessUnix::onReadyRead);
+        if (m_readMode == ReadMode::Thread) {
+            m_readerThread = new ReaderThread(m_masterFd, this);
+            m_readerThread->start();
+        } else {
+            m_notifier = new QSocketNotifier(m_masterFd, QSocketNotifier::Read, this);
+            connect(m_notifier, &QSocketNotifier::activated, this, &PtyProcessUnix::onReadyRead);
+        }
 
         return true;
     }
@@ -100,9 +243,38 @@ bool PtyProcessUnix::start(const QString &program, const QStringList &arguments,
 }
 
 void PtyProcessUnix::write(const QByteArray &data) {
-    if (m_masterFd >= 0) {
-        ::write(m_masterFd, data.constData(), data.size());
+    if (m_masterFd < 0 || !m_writeNotifier || data.isEmpty()) {
+        return;
     }
+    // Written once the event loop sees the PTY writable, by then whatever else was written in
+    // this pass (a burst of keys, replies to queries in the parsed output) is queued as well
+    m_writeQueue.append(data);
+    m_writeNotifier->setEnabled(true);
+}
+
+void PtyProcessUnix::onReadyWrite() {
+    while (bytesToWrite() > 0) {
+        qsizetype n = std::min(bytesToWrite(), WriteChunkSize);
+        ssize_t len = ::write(m_masterFd, m_writeQueue.constData() + m_writeOffset, n);
+        if (len < 0 && errno == EINTR) {
+            continue;
+        }
+        if (len < 0 && errno == EAGAIN) {
+            // The child is not reading, we are notified again once it does
+            return;
+        }
+        if (len < 0) {
+            // The child went away, the read side reports it
+            consumeWritten(bytesToWrite());
+            break;
+        }
+        consumeWritten(len);
+        if (len < n) {
+            return;
+        }
+    }
+    m_writeNotifier->setEnabled(false);
+    emit bytesWritten();
 }
 
 void PtyProcessUnix::resize(const QSize &size) {
@@ -124,48 +296,62 @@ void PtyProcessUnix::kill() {
     }
 }
 
-bool PtyProcessUnix::isRoot() const {
-    if (m_masterFd < 0) {
-        return false;
+void PtyProcessUnix::setReadEnabled(bool enabled) {
+    if (m_notifier) {
+        m_notifier->setEnabled(enabled);
+    }
+    if (m_readerThread) {
+        m_readerThread->setPaused(!enabled);
     }
+}
+
+void PtyProcessUnix::stopReaderThread() {
+    if (!m_readerThread) {
+        return;
+    }
+    m_readerThread->stop();
+    m_readerThread->wait();
+    delete m_readerThread;
+    m_readerThread = nullptr;
+}
 
+void PtyProcessUnix::checkForeground() {
+    if (m_masterFd < 0) {
+        return;
+    }
     pid_t pgrp = tcgetpgrp(m_masterFd);
     if (pgrp <= 0) {
         // Fallback to initial pid
-        if (m_pid <= 0) {
-            return false;
-        }
         pgrp = m_pid;
     }
-
-    struct stat st;
-    char path[64];
-    snprintf(path, sizeof(path), "/proc/%d", (int)pgrp);
-    if (stat(path, &st) == 0) {
-        return st.st_uid == 0;
+    QString name;
+    bool root = false;
+    if (pgrp > 0) {
+        char path[64];
+        snprintf(path, sizeof(path), "/proc/%d/comm", (int)pgrp);
+        QFile file(path);
+        if (file.open(QIODevice::ReadOnly)) {
+            name = QString::fromUtf8(file.readAll().trimmed());
+        }
+        struct stat st;
+        snprintf(path, sizeof(path), "/proc/%d", (int)pgrp);
+        root = stat(path, &st) == 0 && st.st_uid == 0;
     }
-    return false;
+    if (pgrp == m_foregroundGroup && name == m_foregroundName && root == m_foregroundRoot) {
+        return;
+    }
+    m_foregroundGroup = pgrp;
+    m_foregroundName = name;
+    m_foregroundRoot = root;
+    emit foregroundChanged();
 }
 
 QString PtyProcessUnix::foregroundProcessName() const {
     if (m_masterFd < 0) {
         return QString();
     }
-
-    pid_t pgrp = tcgetpgrp(m_masterFd);
-    if (pgrp <= 0) {
-        return QFileInfo(m_program).baseName();
-    }
-
-    char path[64];
-    snprintf(path, sizeof(path), "/proc/%d/comm", (int)pgrp);
-    QFile file(path);
-    if (file.open(QIODevice::ReadOnly)) {
-        return QString::fromUtf8(file.readAll().trimmed());
-    }
-
     // Fallback to initial program
-    return QFileInfo(m_program).baseName();
+    return m_foregroundName.isEmpty() ? QFileInfo(m_program).baseName() : m_foregroundName;
 }
 
 void PtyProcessUnix::onReadyRead() {
@@ -181,4 +367,21 @@ void PtyProcessUnix::onReadyRead() {
         m_notifier->setEnabled(false);
         emit finished(0, 0); // EOF
     }
-}
\ No newline at end of file
+}
+
+void PtyProcessUnix::onReadThreadData() {
+    m_dataNotified = false;
+    if (!m_readerThread) {
+        return;
+    }
+    if (!m_ring.isEmpty()) {
+        QByteArray data = m_ring.readAll();
+        m_readerThread->spaceAvailable();
+        emit readyRead(data);
+    }
+    if (m_readerThread && m_readerThread->hasFinished() && m_ring.isEmpty()) {
+        int code = m_readerThread->exitCode();
+        stopReaderThread();
+        emit finished(code, code);
+    }
+}
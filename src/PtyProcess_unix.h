@@ -4,7 +4,9 @@
 #pragma once
 
 #include "PtyProcess.h"
+#include "RingBuffer.h"
 #include <QSocketNotifier>
+#include <atomic>
 #include <sys/types.h>
 
 class PtyProcessUnix : public PtyProcess {
@@ -19,14 +21,29 @@ class PtyProcessUnix : public PtyProcess {
     void write(const QByteArray &data) override;
     void resize(const QSize &size) override;
     void kill() override;
-    bool isRoot() const override;
+    void setReadEnabled(bool enabled) override;
+    bool isRoot() const override { return m_foregroundRoot; }
     QString foregroundProcessName() const override;
+    void checkForeground() override;
 
   private slots:
     void onReadyRead();
+    void onReadyWrite();
+    void onReadThreadData();
 
   private:
+    void stopReaderThread();
+
     int m_masterFd = -1;
     pid_t m_pid = -1;
+    pid_t m_foregroundGroup = -1;
+    QString m_foregroundName;
+    bool m_foregroundRoot = false;
     QSocketNotifier *m_notifier = nullptr;
+    QSocketNotifier *m_writeNotifier = nullptr;
+
+    class ReaderThread;
+    ReaderThread *m_readerThread = nullptr;
+    RingBuffer m_ring{1024 * 1024};
+    std::atomic<bool> m_dataNotified = false;
 };
@@ -4,24 +4,42 @@
 #include "PtyProcess_win.h"
 #include <QDebug>
 #include <QDir>
+#include <QFileInfo>
+#include <QMutex>
+#include <QWaitCondition>
+#include <algorithm>
+#include <atomic>
 #include <vector>
 
 // Define necessary types if building on older SDKs or mingw that might lack them
 // But assuming standard modern environment.
 
+// Reads ConPTY output straight into the ring buffer, and only notifies the GUI thread when
+// the buffer goes from empty to non-empty, instead of allocating and queueing every chunk.
 class PtyProcessWin::ReaderThread : public QThread {
   public:
     ReaderThread(HANDLE hPipe, PtyProcessWin *parent) : m_hPipe(hPipe), m_parent(parent) {}
 
     void run() override {
-        char buffer[4096];
+        RingBuffer &ring = m_parent->m_ring;
         DWORD bytesRead;
         while (m_running) {
-            if (ReadFile(m_hPipe, buffer, sizeof(buffer), &bytesRead, NULL)) {
+            char *buffer = nullptr;
+            size_t space = m_paused ? 0 : ring.writeRegion(&buffer);
+            if (space == 0) {
+                // Paused or full. The pipe is bounded, once we stop draining it ConPTY blocks
+                // the child
+                msleep(m_paused ? 5 : 1);
+                continue;
+            }
+            if (ReadFile(m_hPipe, buffer, (DWORD)std::min<size_t>(space, 64 * 1024), &bytesRead,
+                         NULL)) {
                 if (bytesRead > 0) {
-                    QByteArray data(buffer, (int)bytesRead);
-                    QMetaObject::invokeMethod(m_parent, "onReadThreadData", Qt::QueuedConnection,
-                                              Q_ARG(QByteArray, data));
+                    ring.commitWrite(bytesRead);
+                    if (!m_parent->m_dataNotified.exchange(true)) {
+                        QMetaObject::invokeMethod(m_parent, "onReadThreadData",
+                                                  Qt::QueuedConnection);
+                    }
                 } else {
                     // EOF (bytesRead == 0)
                     break;
@@ -37,10 +55,72 @@ class PtyProcessWin::ReaderThread : public QThread {
     }
 
     void stop() { m_running = false; }
+    void setPaused(bool paused) { m_paused = paused; }
 
   private:
     HANDLE m_hPipe;
     PtyProcessWin *m_parent;
+    std::atomic<bool> m_running = true;
+    std::atomic<bool> m_paused = false;
+};
+
+// The ConPTY input pipe is synchronous, WriteFile blocks for as long as the child does not
+// read. Writes happen here so the GUI thread never waits on it, each batch is reported back
+// with a queued call once it has gone out.
+class PtyProcessWin::WriterThread : public QThread {
+  public:
+    WriterThread(HANDLE hPipe, PtyProcessWin *parent) : m_hPipe(hPipe), m_parent(parent) {}
+
+    void run() override {
+        bool broken = false;
+        while (true) {
+            QByteArray batch;
+            {
+                QMutexLocker lock(&m_mutex);
+                while (m_running && m_pending.isEmpty()) {
+                    m_wake.wait(&m_mutex);
+                }
+                if (!m_running) {
+                    break;
+                }
+                batch.swap(m_pending);
+            }
+            // After a failed write the child is gone, the rest is dropped but still accounted
+            qsizetype offset = 0;
+            while (!broken && offset < batch.size()) {
+                DWORD n = (DWORD)std::min<qsizetype>(batch.size() - offset, 64 * 1024);
+                DWORD bytesWritten = 0;
+                if (!WriteFile(m_hPipe, batch.constData() + offset, n, &bytesWritten, NULL)) {
+                    broken = true;
+                    break;
+                }
+                offset += bytesWritten;
+            }
+            PtyProcessWin *parent = m_parent;
+            qsizetype size = batch.size();
+            QMetaObject::invokeMethod(
+                parent, [parent, size]() { parent->onWritten(size); }, Qt::QueuedConnection);
+        }
+    }
+
+    void push(const QByteArray &data) {
+        QMutexLocker lock(&m_mutex);
+        m_pending.append(data);
+        m_wake.wakeOne();
+    }
+
+    void stop() {
+        QMutexLocker lock(&m_mutex);
+        m_running = false;
+        m_wake.wakeOne();
+    }
+
+  private:
+    HANDLE m_hPipe;
+    PtyProcessWin *m_parent;
+    QMutex m_mutex;
+    QWaitCondition m_wake;
+    QByteArray m_pending;
     bool m_running = true;
 };
 
@@ -155,6 +235,8 @@ bool PtyProcessWin::start(const QSize &size) {
     // Start reader thread
     m_readerThread = new ReaderThread(m_hPipeIn, this);
     m_readerThread->start();
+    m_writerThread = new WriterThread(m_hPipeOut, this);
+    m_writerThread->start();
 
     return true;
 }
@@ -164,9 +246,22 @@ bool PtyProcessWin::start(const QString &program, const QStringList &arguments,
 }
 
 void PtyProcessWin::write(const QByteArray &data) {
-    if (m_hPipeOut != INVALID_HANDLE_VALUE) {
-        DWORD bytesWritten;
-        WriteFile(m_hPipeOut, data.constData(), data.size(), &bytesWritten, NULL);
+    if (!m_writerThread || data.isEmpty()) {
+        return;
+    }
+    // The queue here only backs bytesToWrite(), the writer thread sends its own copy and
+    // batches whatever arrives while it is busy
+    m_writeQueue.append(data);
+    m_writerThread->push(data);
+}
+
+void PtyProcessWin::onWritten(qsizetype n) {
+    if (bytesToWrite() == 0) {
+        return;
+    }
+    consumeWritten(n);
+    if (bytesToWrite() == 0) {
+        emit bytesWritten();
     }
 }
 
@@ -202,6 +297,21 @@ void PtyProcessWin::kill() {
         m_readerThread = nullptr;
     }
 
+    // Stop the writer before its handle goes away. The console is closed, so a blocked
+    // WriteFile fails right away.
+    if (m_writerThread) {
+        m_writerThread->stop();
+        m_writerThread->wait(3000);
+        if (m_writerThread->isRunning()) {
+            m_writerThread->terminate();
+            m_writerThread->wait();
+        }
+        delete m_writerThread;
+        m_writerThread = nullptr;
+    }
+    m_writeQueue.clear();
+    m_writeOffset = 0;
+
     // Close write pipe
     if (m_hPipeOut != INVALID_HANDLE_VALUE) {
         CloseHandle(m_hPipeOut);
@@ -219,6 +329,12 @@ void PtyProcessWin::kill() {
     }
 }
 
+void PtyProcessWin::setReadEnabled(bool enabled) {
+    if (m_readerThread) {
+        m_readerThread->setPaused(!enabled);
+    }
+}
+
 bool PtyProcessWin::isRoot() const {
     // Could check for elevation here
     return false;
@@ -226,4 +342,9 @@ bool PtyProcessWin::isRoot() const {
 
 QString PtyProcessWin::foregroundProcessName() const { return QFileInfo(m_program).baseName(); }
 
-void PtyProcessWin::onReadThreadData(const QByteArray &data) { emit readyRead(data); }
+void PtyProcessWin::onReadThreadData() {
+    m_dataNotified = false;
+    if (!m_ring.isEmpty()) {
+        emit readyRead(m_ring.readAll());
+    }
+}
@@ -4,7 +4,9 @@
 #pragma once
 
 #include "PtyProcess.h"
+#include "RingBuffer.h"
 #include <QThread>
+#include <atomic>
 #include <windows.h>
 
 class PtyProcessWin : public PtyProcess {
@@ -19,11 +21,13 @@ class PtyProcessWin : public PtyProcess {
     void write(const QByteArray &data) override;
     void resize(const QSize &size) override;
     void kill() override;
+    void setReadEnabled(bool enabled) override;
     bool isRoot() const override;
     QString foregroundProcessName() const override;
 
   private slots:
-    void onReadThreadData(const QByteArray &data);
+    void onReadThreadData();
+    void onWritten(qsizetype n);
 
   private:
     HPCON m_hPC = INVALID_HANDLE_VALUE;
@@ -33,4 +37,8 @@ class PtyProcessWin : public PtyProcess {
 
     class ReaderThread;
     ReaderThread *m_readerThread = nullptr;
+    class WriterThread;
+    WriterThread *m_writerThread = nullptr;
+    RingBuffer m_ring{1024 * 1024};
+    std::atomic<bool> m_dataNotified = false;
 };
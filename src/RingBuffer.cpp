@@ -0,0 +1,63 @@
+// SPDX-License-Identifier: MIT
+// Author: Diego Iastrubni <diegoiast@gmail.com>
+
+#include "RingBuffer.h"
+
+#include <algorithm>
+#include <cstring>
+
+RingBuffer::RingBuffer(size_t capacity) {
+    size_t size = 4096;
+    while (size < capacity) {
+        size <<= 1;
+    }
+    m_buffer.resize(size);
+    m_mask = size - 1;
+}
+
+size_t RingBuffer::available() const {
+    return m_head.load(std::memory_order_acquire) - m_tail.load(std::memory_order_acquire);
+}
+
+size_t RingBuffer::writeRegion(char **ptr) {
+    size_t head = m_head.load(std::memory_order_relaxed);
+    size_t tail = m_tail.load(std::memory_order_acquire);
+    size_t free = capacity() - (head - tail);
+    size_t offset = head & m_mask;
+    *ptr = m_buffer.data() + offset;
+    return std::min(free, capacity() - offset);
+}
+
+void RingBuffer::commitWrite(size_t n) {
+    m_head.store(m_head.load(std::memory_order_relaxed) + n, std::memory_order_release);
+}
+
+size_t RingBuffer::readRegion(const char **ptr) {
+    size_t tail = m_tail.load(std::memory_order_relaxed);
+    size_t head = m_head.load(std::memory_order_acquire);
+    size_t offset = tail & m_mask;
+    *ptr = m_buffer.data() + offset;
+    return std::min(head - tail, capacity() - offset);
+}
+
+void RingBuffer::commitRead(size_t n) {
+    m_tail.store(m_tail.load(std::memory_order_relaxed) + n, std::memory_order_release);
+}
+
+QByteArray RingBuffer::readAll() {
+    // One allocation for the whole batch, at most two copies (the buffer may wrap)
+    size_t total = available();
+    QByteArray data(static_cast<qsizetype>(total), Qt::Uninitialized);
+    size_t copied = 0;
+    while (copied < total) {
+        const char *p;
+        size_t n = std::min(readRegion(&p), total - copied);
+        if (n == 0) {
+            break;
+        }
+        memcpy(data.data() + copied, p, n);
+        commitRead(n);
+        copied += n;
+    }
+    return data;
+}
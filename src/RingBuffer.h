@@ -0,0 +1,37 @@
+// SPDX-License-Identifier: MIT
+// Author: Diego Iastrubni <diegoiast@gmail.com>
+
+#pragma once
+
+#include <QByteArray>
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+// Lock-free single-producer/single-consumer byte queue. The producer (a PTY reader
+// thread) reads straight into writeRegion() and publishes with commitWrite(), the consumer
+// (GUI thread) drains everything in one go with readAll(). Head and tail are free running
+// counters, the capacity is always a power of two.
+class RingBuffer {
+  public:
+    explicit RingBuffer(size_t capacity);
+
+    size_t capacity() const { return m_buffer.size(); }
+    size_t available() const;
+    bool isEmpty() const { return available() == 0; }
+
+    // Producer side
+    size_t writeRegion(char **ptr);
+    void commitWrite(size_t n);
+
+    // Consumer side
+    size_t readRegion(const char **ptr);
+    void commitRead(size_t n);
+    QByteArray readAll();
+
+  private:
+    std::vector<char> m_buffer;
+    size_t m_mask = 0;
+    alignas(64) std::atomic<size_t> m_head = 0;
+    alignas(64) std::atomic<size_t> m_tail = 0;
+};
@@ -0,0 +1,1294 @@
+// SPDX-License-Identifier: MIT
+// Author: Diego Iastrubni <diegoiast@gmail.com>
+
+#include "Scrollback.h"
+
+#include <QDataStream>
+#include <QDir>
+#include <QFile>
+#include <QMutex>
+#include <QTemporaryFile>
+#include <QtEndian>
+#include <algorithm>
+#include <cstring>
+
+// Record layout, all fields unaligned and little endian:
+//   u16 cols, u16 stored, u16 runs, u16 extras, u8 flags
+//   text:   stored x u8                      (Ascii)
+//           stored x u32, stored x u8 width  (otherwise)
+//   extras: u16 col, u8 n, n x u32           (combining characters, chars[1..])
+//   runs:   u16 length, u32 attrs, fg, bg    (covering all cols)
+// Colors are a type byte followed by red, green, blue or by the index and two zero bytes.
+// A continued line carries on the line before it.
+enum : uint8_t { LineAscii = 1, LineContinued = 2 };
+
+static constexpr size_t HeaderSize = 9;
+static constexpr size_t ColorSize = 4;
+static constexpr size_t RunSize = 2 + 4 + 2 * ColorSize;
+static constexpr size_t MaxFreePages = 4;
+// Enough inflated pages to cover a viewport that straddles page boundaries
+static constexpr size_t MaxCachedPages = 4;
+
+template <typename T> static inline void put(char *&p, T v) {
+    qToLittleEndian<T>(v, p);
+    p += sizeof(T);
+}
+
+template <typename T> static inline T get(const char *&p) {
+    T v = qFromLittleEndian<T>(p);
+    p += sizeof(T);
+    return v;
+}
+
+static inline void putColor(char *&p, const VTermColor &c) {
+    p[0] = (char)c.type;
+    if (VTERM_COLOR_IS_INDEXED(&c)) {
+        p[1] = (char)c.indexed.idx;
+        p[2] = p[3] = 0;
+    } else {
+        p[1] = (char)c.rgb.red;
+        p[2] = (char)c.rgb.green;
+        p[3] = (char)c.rgb.blue;
+    }
+    p += ColorSize;
+}
+
+static inline VTermColor getColor(const char *&p) {
+    VTermColor c;
+    memset(&c, 0, sizeof(c));
+    c.type = (uint8_t)p[0];
+    if (VTERM_COLOR_IS_INDEXED(&c)) {
+        c.indexed.idx = (uint8_t)p[1];
+    } else {
+        c.rgb.red = (uint8_t)p[1];
+        c.rgb.green = (uint8_t)p[2];
+        c.rgb.blue = (uint8_t)p[3];
+    }
+    p += ColorSize;
+    return c;
+}
+
+static inline uint32_t packAttrs(const VTermScreenCellAttrs &a) {
+    return a.bold | a.underline << 1 | a.italic << 3 | a.blink << 4 | a.reverse << 5 |
+           a.conceal << 6 | a.strike << 7 | a.font << 8 | a.dwl << 12 | a.dhl << 13 |
+           a.small << 15 | a.baseline << 16;
+}
+
+static inline void unpackAttrs(uint32_t v, VTermScreenCellAttrs &a) {
+    a.bold = v & 1;
+    a.underline = (v >> 1) & 3;
+    a.italic = (v >> 3) & 1;
+    a.blink = (v >> 4) & 1;
+    a.reverse = (v >> 5) & 1;
+    a.conceal = (v >> 6) & 1;
+    a.strike = (v >> 7) & 1;
+    a.font = (v >> 8) & 15;
+    a.dwl = (v >> 12) & 1;
+    a.dhl = (v >> 13) & 3;
+    a.small = (v >> 15) & 1;
+    a.baseline = (v >> 16) & 3;
+}
+
+static inline bool sameRun(const VTermScreenCell &a, const VTermScreenCell &b) {
+    return packAttrs(a.attrs) == packAttrs(b.attrs) &&
+           memcmp(&a.fg, &b.fg, sizeof(a.fg)) == 0 && memcmp(&a.bg, &b.bg, sizeof(a.bg)) == 0;
+}
+
+static inline int combiningCount(const VTermScreenCell &c) {
+    int n = 0;
+    while (n + 1 < VTERM_MAX_CHARS_PER_CELL && c.chars[n + 1]) {
+        n++;
+    }
+    return c.chars[0] ? n : 0;
+}
+
+static void blankCell(VTermScreenCell &cell) {
+    memset(&cell, 0, sizeof(cell));
+    cell.width = 1;
+    cell.fg.type = VTERM_COLOR_DEFAULT_FG;
+    cell.bg.type = VTERM_COLOR_DEFAULT_BG;
+}
+
+// Compressed pages moved out of memory. Snapshots read spilled pages from it on other threads
+// while the buffer goes on appending, it goes away with the last of them.
+class SpillFile {
+  public:
+    explicit SpillFile(const QString &directory)
+        : m_file(directory + "/scrollback-XXXXXX.swap") {}
+    ~SpillFile() {
+        if (m_map) {
+            m_file.unmap(m_map);
+        }
+    }
+
+    bool open() { return m_file.open(); }
+
+    // Offset the block was written at, -1 when writing failed
+    qint64 append(const QByteArray &block) {
+        QMutexLocker lock(&m_mutex);
+        if (m_map) {
+            m_file.unmap(m_map);
+            m_map = nullptr;
+            m_mapSize = 0;
+        }
+        const qint64 offset = m_file.size();
+        if (!m_file.seek(offset) || m_file.write(block) != block.size() || !m_file.flush()) {
+            return -1;
+        }
+        return offset;
+    }
+
+    // The records of the block at offset, empty when it can not be read
+    QByteArray inflate(qint64 offset, uint32_t size) {
+        QMutexLocker lock(&m_mutex);
+        if (offset + size > m_mapSize) {
+            if (m_map) {
+                m_file.unmap(m_map);
+            }
+            m_mapSize = m_file.size();
+            m_map = m_file.map(0, m_mapSize);
+            if (!m_map) {
+                m_mapSize = 0;
+                return QByteArray();
+            }
+        }
+        return qUncompress(m_map + offset, (qsizetype)size);
+    }
+
+    // The block at offset as it was written, empty when it can not be read
+    QByteArray read(qint64 offset, uint32_t size) {
+        QMutexLocker lock(&m_mutex);
+        if (!m_file.seek(offset)) {
+            return QByteArray();
+        }
+        return m_file.read(size);
+    }
+
+  private:
+    QMutex m_mutex;
+    QTemporaryFile m_file;
+    uchar *m_map = nullptr;
+    qint64 m_mapSize = 0;
+};
+
+void ScrollbackSnapshot::pageLines(int page, qint64 *first, qint64 *end) const {
+    // The first page may still list lines popped from the front before the snapshot
+    const Page &p = *m_pages[page];
+    *first = (qint64)std::max<uint64_t>(p.firstLine, m_lineBase);
+    *end = (qint64)std::min<uint64_t>(p.firstLine + p.lines.size(), m_lineBase + m_size);
+}
+
+QByteArray ScrollbackSnapshot::pageRecords(int page) const {
+    const Page &p = *m_pages[page];
+    QByteArray raw;
+    if (p.spillFile) {
+        raw = p.spillFile->inflate(p.spillOffset, p.spillSize);
+    } else if (p.packed) {
+        raw = qUncompress(p.data);
+    } else {
+        raw = p.data;
+    }
+    if (raw.size() < (qsizetype)p.used) {
+        raw = QByteArray((qsizetype)p.used, '\0');
+    }
+    return raw;
+}
+
+int ScrollbackSnapshot::readLine(int page, const QByteArray &records, qint64 line, int cols,
+                                 VTermScreenCell *cells) const {
+    const Page &p = *m_pages[page];
+    const Line &l = p.lines[(size_t)(line - (qint64)p.firstLine)];
+    return ScrollbackBuffer::decodeLine(records.constData() + l.offset, cols, cells);
+}
+
+int ScrollbackSnapshot::lineColumns(int page, qint64 line) const {
+    const Page &p = *m_pages[page];
+    return p.lines[(size_t)(line - (qint64)p.firstLine)].cols;
+}
+
+// Metadata of line, moving *page forward to the page holding it
+const ScrollbackSnapshot::Line &ScrollbackSnapshot::lineAt(size_t *page, uint64_t line) const {
+    while (line >= m_pages[*page]->firstLine + m_pages[*page]->lines.size()) {
+        ++*page;
+    }
+    return m_pages[*page]->lines[(size_t)(line - m_pages[*page]->firstLine)];
+}
+
+// End of the logical line starting at line, with its row count the way
+// ScrollbackBuffer::wrappedRows() has it
+uint64_t ScrollbackSnapshot::logicalEnd(size_t *page, uint64_t line, int64_t *rows) const {
+    const uint64_t end = m_lineBase + m_size;
+    int64_t cells = 0, length = 0;
+    do {
+        const Line &l = lineAt(page, line);
+        length = cells + l.stored;
+        cells += l.cols;
+        line++;
+    } while (line < end && lineAt(page, line).continued);
+    *rows = std::max<int64_t>(1, (length + m_wrapWidth - 1) / m_wrapWidth);
+    return line;
+}
+
+ScrollbackSnapshot ScrollbackSnapshot::slice(int first, int end, int *firstRow) const {
+    ScrollbackSnapshot slice;
+    slice.m_wrapWidth = m_wrapWidth;
+    first = std::clamp(first, 0, m_rows);
+    end = std::clamp(end, first, m_rows);
+    *firstRow = first;
+    if (first == end) {
+        slice.m_lineBase = m_lineBase + m_size;
+        return slice;
+    }
+    // Start from the last page whose logical line begins at or before first, and walk the
+    // lines from there
+    auto it = std::upper_bound(m_heads.begin(), m_heads.end(), (int64_t)first,
+                               [](int64_t r, const Head &h) { return r < h.row; });
+    size_t page = it == m_heads.begin() ? 0 : (size_t)(it - m_heads.begin()) - 1;
+    uint64_t line = m_heads[page].line;
+    int64_t row = m_heads[page].row;
+    while (page > 0 && m_pages[page]->firstLine > line) {
+        page--;
+    }
+    const uint64_t lineEnd = m_lineBase + m_size;
+    int64_t rows;
+    uint64_t next = logicalEnd(&page, line, &rows);
+    while (row + rows <= first && next < lineEnd) {
+        line = next;
+        row += rows;
+        next = logicalEnd(&page, line, &rows);
+    }
+    const uint64_t head = line;
+    const int64_t headRow = row;
+    size_t headPage = page;
+    while (headPage > 0 && m_pages[headPage]->firstLine > head) {
+        headPage--;
+    }
+    while (row + rows < end && next < lineEnd) {
+        line = next;
+        row += rows;
+        next = logicalEnd(&page, line, &rows);
+    }
+
+    slice.m_lineBase = head;
+    slice.m_size = (size_t)(next - head);
+    slice.m_rows = (int)(row + rows - headRow);
+    *firstRow = (int)headRow;
+    for (size_t i = headPage; i < m_pages.size() && m_pages[i]->firstLine < next; ++i) {
+        // Later pages start in head's logical line or after it
+        slice.m_heads.push_back(i == headPage ? Head{0, head}
+                                              : Head{m_heads[i].row - headRow, m_heads[i].line});
+        slice.m_pages.push_back(m_pages[i]);
+    }
+    return slice;
+}
+
+ScrollbackBuffer::ScrollbackBuffer(int pageSize) : m_pageSize(pageSize) {}
+
+ScrollbackBuffer::ScrollbackBuffer(const ScrollbackSnapshot &snapshot)
+    : m_pageSize(DefaultPageSize) {
+    m_wrapWidth = snapshot.m_wrapWidth;
+    m_lineBase = snapshot.m_lineBase;
+    const uint64_t end = snapshot.m_lineBase + snapshot.m_size;
+    for (const auto &shared : snapshot.m_pages) {
+        Page page;
+        if (shared->spillFile) {
+            page.spillFile = shared->spillFile;
+            page.spillOffset = shared->spillOffset;
+            page.spillSize = shared->spillSize;
+        } else if (shared->packed) {
+            page.packed = shared->data;
+            m_packedBytes += page.packed.size();
+        } else {
+            page.borrowed = shared->data;
+        }
+        page.capacity = std::max<uint32_t>(shared->used, (uint32_t)m_pageSize);
+        page.used = shared->used;
+        page.handle = shared;
+        const uint32_t seq = (uint32_t)m_pages.size();
+        for (size_t i = 0; i < shared->lines.size(); ++i) {
+            // The first page may still list lines popped from the front before the snapshot
+            const uint64_t line = shared->firstLine + i;
+            if (line < snapshot.m_lineBase || line >= end) {
+                continue;
+            }
+            const ScrollbackSnapshot::Line &l = shared->lines[i];
+            pushRef({seq, l.offset, 0, l.cols, l.stored}, l.continued);
+            page.lines++;
+        }
+        if (page.lines == 0) {
+            continue;
+        }
+        page.endLine = m_lineBase + m_lines.size();
+        m_pages.push_back(std::move(page));
+    }
+    // Like pages mapped from a state file, the shared ones are only read until popBack()
+    // reaches them, new lines start a page of their own
+    m_spillEnd = m_hotStart = m_pages.size();
+}
+
+ScrollbackBuffer::~ScrollbackBuffer() {
+    resetSpill();
+    resetSnapshot();
+}
+
+void ScrollbackBuffer::setTiering(int hotLines, qint64 memoryLimit,
+                                  const QString &spillDirectory) {
+    m_hotLines = hotLines;
+    m_memoryLimit = memoryLimit;
+    if (spillDirectory != m_spillDirectory) {
+        m_spillDirectory = spillDirectory;
+        m_spillFailed = false;
+    }
+    freezeColdPages();
+}
+
+void ScrollbackBuffer::clear() {
+    for (auto &page : m_pages) {
+        releasePage(page);
+    }
+    m_pages.clear();
+    m_lines.clear();
+    m_logical.clear();
+    m_rowEnd = 0;
+    m_pageBase = 0;
+    m_lineBase = 0;
+    m_spillEnd = 0;
+    m_hotStart = 0;
+    m_packedBytes = 0;
+    m_cache.clear();
+    resetSpill();
+    resetSnapshot();
+}
+
+struct LineShape {
+    int cols = 0;
+    int stored = 0;
+    int runs = 0;
+    int extras = 0;
+    bool ascii = true;
+    bool continued = false;
+    size_t size = 0;
+};
+
+// First pass: measure, so the record is written in place without temporaries
+static LineShape measureLine(int cols, const VTermScreenCell *cells) {
+    LineShape shape;
+    shape.cols = std::clamp(cols, 0, 0xFFFF);
+    size_t extraBytes = 0;
+    for (int i = 0; i < shape.cols; ++i) {
+        const VTermScreenCell &c = cells[i];
+        int n = combiningCount(c);
+        if (c.chars[0] >= 0x80 || c.width != 1 || n > 0) {
+            shape.ascii = false;
+        }
+        if (c.chars[0] != 0 || c.width != 1) {
+            shape.stored = i + 1;
+        }
+        if (n > 0) {
+            shape.extras++;
+            extraBytes += 3 + n * sizeof(uint32_t);
+        }
+        if (i == 0 || !sameRun(c, cells[i - 1])) {
+            shape.runs++;
+        }
+    }
+    shape.size = HeaderSize + (shape.ascii ? shape.stored : shape.stored * 5) + extraBytes +
+                 shape.runs * RunSize;
+    return shape;
+}
+
+static void encodeRecord(char *p, const LineShape &shape, const VTermScreenCell *cells) {
+    const int cols = shape.cols, stored = shape.stored;
+    put<uint16_t>(p, cols);
+    put<uint16_t>(p, stored);
+    put<uint16_t>(p, shape.runs);
+    put<uint16_t>(p, shape.extras);
+    put<uint8_t>(p, (shape.ascii ? LineAscii : 0) | (shape.continued ? LineContinued : 0));
+    if (shape.ascii) {
+        for (int i = 0; i < stored; ++i) {
+            *p++ = (char)cells[i].chars[0];
+        }
+    } else {
+        for (int i = 0; i < stored; ++i) {
+            put<uint32_t>(p, cells[i].chars[0]);
+        }
+        for (int i = 0; i < stored; ++i) {
+            put<uint8_t>(p, (uint8_t)cells[i].width);
+        }
+        for (int i = 0; i < stored && shape.extras > 0; ++i) {
+            int n = combiningCount(cells[i]);
+            if (n > 0) {
+                put<uint16_t>(p, i);
+                put<uint8_t>(p, n);
+                for (int k = 1; k <= n; ++k) {
+                    put<uint32_t>(p, cells[i].chars[k]);
+                }
+            }
+        }
+    }
+    int start = 0;
+    for (int i = 1; i <= cols; ++i) {
+        if (i == cols || !sameRun(cells[i], cells[start])) {
+            put<uint16_t>(p, i - start);
+            put<uint32_t>(p, packAttrs(cells[start].attrs));
+            putColor(p, cells[start].fg);
+            putColor(p, cells[start].bg);
+            start = i;
+        }
+    }
+}
+
+QByteArray ScrollbackBuffer::encodeLine(int cols, const VTermScreenCell *cells) {
+    LineShape shape = measureLine(cols, cells);
+    QByteArray record((qsizetype)shape.size, Qt::Uninitialized);
+    encodeRecord(record.data(), shape, cells);
+    return record;
+}
+
+void ScrollbackBuffer::append(int cols, const VTermScreenCell *cells, bool continued) {
+    LineShape shape = measureLine(cols, cells);
+    shape.continued = continued && !m_lines.empty();
+    LineRef ref;
+    encodeRecord(reserve(shape.size, &ref), shape, cells);
+    ref.cols = (uint16_t)shape.cols;
+    ref.stored = (uint16_t)shape.stored;
+    pushRef(ref, shape.continued);
+    pageFor(ref.page).endLine = m_lineBase + m_lines.size();
+    freezeColdPages();
+}
+
+void ScrollbackBuffer::pushRef(LineRef ref, bool continued) {
+    continued = continued && !m_lines.empty();
+    ref.start = continued ? m_lines.back().start + m_lines.back().cols : 0;
+    m_lines.push_back(ref);
+    if (!continued) {
+        m_logical.push_back({m_rowEnd, m_lineBase + m_lines.size() - 1});
+    }
+    m_rowEnd = m_logical.back().row + wrappedRows(m_logical.size() - 1);
+}
+
+void ScrollbackBuffer::popFront() {
+    if (m_lines.empty()) {
+        return;
+    }
+    const bool whole = logicalEnd(0) == 1;
+    const int64_t end = m_logical.front().row + logicalRows(0);
+    pageFor(m_lines.front().page).lines--;
+    m_lines.pop_front();
+    m_lineBase++;
+    if (whole) {
+        m_logical.pop_front();
+    } else {
+        // The logical line loses its head, the rows left keep their numbers
+        m_logical.front().line = m_lineBase;
+        m_logical.front().row = end - wrappedRows(0);
+    }
+    while (!m_pages.empty() && m_pages.front().lines == 0) {
+        dropCached(m_pageBase);
+        releasePage(m_pages.front());
+        m_pages.pop_front();
+        m_pageBase++;
+        m_spillEnd = m_spillEnd > 0 ? m_spillEnd - 1 : 0;
+        m_hotStart = m_hotStart > 0 ? m_hotStart - 1 : 0;
+    }
+    if (m_spillEnd == 0 && m_spill) {
+        // Nothing references the spill file anymore, start it over
+        resetSpill();
+    }
+}
+
+void ScrollbackBuffer::popBack() {
+    if (m_lines.empty()) {
+        return;
+    }
+    LineRef ref = m_lines.back();
+    Page &page = pageFor(ref.page);
+    size_t index = ref.page - m_pageBase;
+    if (index < m_hotStart) {
+        // Popping back into cold history, the page becomes writable again
+        thaw(ref.page);
+        m_hotStart = index;
+        m_spillEnd = std::min(m_spillEnd, index);
+    }
+    m_lines.pop_back();
+    if (m_logical.back().line == m_lineBase + m_lines.size()) {
+        m_rowEnd = m_logical.back().row;
+        m_logical.pop_back();
+    } else {
+        m_rowEnd = m_logical.back().row + wrappedRows(m_logical.size() - 1);
+    }
+    page.handle.reset();
+    page.used = ref.offset;
+    page.lines--;
+    page.endLine--;
+    if (page.lines == 0) {
+        // Only the last page can be emptied from the back
+        dropCached(ref.page);
+        releasePage(page);
+        m_pages.pop_back();
+        m_hotStart = std::min(m_hotStart, m_pages.size());
+        m_spillEnd = std::min(m_spillEnd, m_pages.size());
+        if (m_pages.empty()) {
+            m_pageBase = 0;
+        }
+    }
+}
+
+const char *ScrollbackBuffer::lineData(int idx) const {
+    const LineRef &ref = m_lines[idx];
+    return pageData(ref.page) + ref.offset;
+}
+
+const char *ScrollbackBuffer::pageData(uint32_t page) const {
+    const Page &p = m_pages[page - m_pageBase];
+    if (p.data) {
+        return p.data.get();
+    }
+    if (p.mapped) {
+        return p.mapped;
+    }
+    if (!p.borrowed.isNull()) {
+        return p.borrowed.constData();
+    }
+    for (auto &c : m_cache) {
+        if (c.page == page) {
+            c.stamp = ++m_cacheStamp;
+            return c.data.constData();
+        }
+    }
+
+    QByteArray raw;
+    if (!p.packed.isEmpty()) {
+        raw = qUncompress(p.packed);
+    } else if (p.spillFile) {
+        raw = p.spillFile->inflate(p.spillOffset, p.spillSize);
+    }
+    if (raw.size() < (qsizetype)p.used) {
+        // Unreadable block, zeroed records decode as empty lines
+        raw = QByteArray((qsizetype)p.used, '\0');
+    }
+
+    if (m_cache.size() >= MaxCachedPages) {
+        auto oldest = std::min_element(m_cache.begin(), m_cache.end(),
+                                       [](const CachedPage &a, const CachedPage &b) {
+                                           return a.stamp < b.stamp;
+                                       });
+        m_cache.erase(oldest);
+    }
+    m_cache.push_back({page, ++m_cacheStamp, raw});
+    return m_cache.back().data.constData();
+}
+
+void ScrollbackBuffer::dropCached(uint32_t page) const {
+    m_cache.erase(std::remove_if(m_cache.begin(), m_cache.end(),
+                                 [page](const CachedPage &c) { return c.page == page; }),
+                  m_cache.end());
+}
+
+void ScrollbackBuffer::prefetch(int first, int count) const {
+    int last = std::min(size(), first + count);
+    uint32_t previous = UINT32_MAX;
+    for (int i = std::max(0, first); i < last; ++i) {
+        uint32_t page = m_lines[i].page;
+        if (page != previous) {
+            pageData(page);
+            previous = page;
+        }
+    }
+}
+
+int ScrollbackBuffer::lineColumns(int idx) const {
+    if (idx < 0 || idx >= size()) {
+        return 0;
+    }
+    return m_lines[idx].cols;
+}
+
+int ScrollbackBuffer::readLine(int idx, int cols, VTermScreenCell *cells) const {
+    if (idx < 0 || idx >= size()) {
+        for (int i = 0; i < cols; ++i) {
+            blankCell(cells[i]);
+        }
+        return 0;
+    }
+    return decodeLine(lineData(idx), cols, cells);
+}
+
+size_t ScrollbackBuffer::logicalEnd(size_t logical) const {
+    return logical + 1 < m_logical.size() ? (size_t)(m_logical[logical + 1].line - m_lineBase)
+                                          : m_lines.size();
+}
+
+size_t ScrollbackBuffer::logicalAt(int64_t row) const {
+    auto it = std::upper_bound(m_logical.begin(), m_logical.end(), row,
+                               [](int64_t r, const Logical &l) { return r < l.row; });
+    return it == m_logical.begin() ? 0 : (size_t)(it - m_logical.begin()) - 1;
+}
+
+size_t ScrollbackBuffer::logicalOf(uint64_t line) const {
+    auto it = std::upper_bound(m_logical.begin(), m_logical.end(), line,
+                               [](uint64_t n, const Logical &l) { return n < l.line; });
+    return it == m_logical.begin() ? 0 : (size_t)(it - m_logical.begin()) - 1;
+}
+
+// Index of the line holding cell, counted from the start of the first line
+size_t ScrollbackBuffer::lineAtCell(size_t logical, int64_t cell) const {
+    auto begin = m_lines.begin() + (m_logical[logical].line - m_lineBase);
+    auto end = m_lines.begin() + logicalEnd(logical);
+    cell += begin->start;
+    auto it = std::upper_bound(begin, end, cell,
+                               [](int64_t c, const LineRef &ref) { return c < ref.start; });
+    return (size_t)((it == begin ? it : it - 1) - m_lines.begin());
+}
+
+int64_t ScrollbackBuffer::logicalRows(size_t logical) const {
+    int64_t next = logical + 1 < m_logical.size() ? m_logical[logical + 1].row : m_rowEnd;
+    return next - m_logical[logical].row;
+}
+
+// Row count from the lengths alone, the trailing blanks of the last line do not wrap
+int64_t ScrollbackBuffer::wrappedRows(size_t logical) const {
+    const LineRef &first = m_lines[m_logical[logical].line - m_lineBase];
+    const LineRef &last = m_lines[logicalEnd(logical) - 1];
+    int64_t length = (int64_t)last.start + last.stored - first.start;
+    return std::max<int64_t>(1, (length + m_wrapWidth - 1) / m_wrapWidth);
+}
+
+void ScrollbackBuffer::readCells(size_t logical, int64_t from, int count,
+                                 VTermScreenCell *cells) const {
+    size_t idx = lineAtCell(logical, from);
+    const size_t end = logicalEnd(logical);
+    const int64_t base = m_lines[m_logical[logical].line - m_lineBase].start;
+    const LineRef &ref = m_lines[idx];
+    if (ref.start - base == from && (ref.cols >= count || idx + 1 == end)) {
+        // A row that starts a line and ends within it, no rewrapping needed
+        decodeLine(lineData((int)idx), count, cells);
+        return;
+    }
+    for (int i = 0; i < count; ++i) {
+        blankCell(cells[i]);
+    }
+    int done = 0;
+    for (int64_t cell = base + from; idx < end && done < count; ++idx) {
+        const LineRef &line = m_lines[idx];
+        int64_t skip = cell - line.start;
+        if (skip >= line.cols) {
+            continue;
+        }
+        m_scratch.resize(line.cols);
+        decodeLine(lineData((int)idx), line.cols, m_scratch.data());
+        int n = (int)std::min<int64_t>(line.cols - skip, count - done);
+        std::copy_n(m_scratch.begin() + skip, n, cells + done);
+        done += n;
+        cell += n;
+    }
+}
+
+void ScrollbackBuffer::setWrapWidth(int cols) {
+    cols = std::max(1, cols);
+    if (cols == m_wrapWidth) {
+        return;
+    }
+    m_wrapWidth = cols;
+    // Arithmetic on the line lengths only, no record is touched
+    int64_t row = 0;
+    for (size_t i = 0; i < m_logical.size(); ++i) {
+        m_logical[i].row = row;
+        row += wrappedRows(i);
+    }
+    m_rowEnd = row;
+}
+
+int ScrollbackBuffer::rows() const {
+    return m_logical.empty() ? 0 : (int)(m_rowEnd - m_logical.front().row);
+}
+
+qint64 ScrollbackBuffer::firstRow() const {
+    return m_logical.empty() ? m_rowEnd : m_logical.front().row;
+}
+
+int ScrollbackBuffer::readRow(int idx, int cols, VTermScreenCell *cells) const {
+    if (idx < 0 || idx >= rows()) {
+        for (int i = 0; i < cols; ++i) {
+            blankCell(cells[i]);
+        }
+        return 0;
+    }
+    const int64_t row = firstRow() + idx;
+    const size_t logical = logicalAt(row);
+    const int64_t from = (row - m_logical[logical].row) * m_wrapWidth;
+    const int count = std::min(cols, m_wrapWidth);
+    readCells(logical, from, count, cells);
+    for (int i = count; i < cols; ++i) {
+        blankCell(cells[i]);
+    }
+    if (from > 0 && cells[0].chars[0] == (uint32_t)-1) {
+        // Right half of a wide character the wrap cut in two
+        cells[0].chars[0] = 0;
+    }
+    return rowColumns(idx);
+}
+
+int ScrollbackBuffer::rowColumns(int idx) const {
+    if (idx < 0 || idx >= rows()) {
+        return 0;
+    }
+    const int64_t row = firstRow() + idx;
+    const size_t logical = logicalAt(row);
+    const LineRef &first = m_lines[m_logical[logical].line - m_lineBase];
+    const LineRef &last = m_lines[logicalEnd(logical) - 1];
+    const int64_t from = (row - m_logical[logical].row) * m_wrapWidth;
+    const int64_t length = (int64_t)last.start + last.cols - first.start;
+    return (int)std::clamp<int64_t>(length - from, 0, m_wrapWidth);
+}
+
+void ScrollbackBuffer::prefetchRows(int first, int count) const {
+    first = std::max(0, first);
+    int last = std::min(rows(), first + count);
+    if (first >= last) {
+        return;
+    }
+    qint64 from = lineOf(firstRow() + first) - (qint64)m_lineBase;
+    qint64 to = lineOf(firstRow() + last) - (qint64)m_lineBase;
+    prefetch((int)from, (int)(to - from + 1));
+}
+
+bool ScrollbackBuffer::popRow(int cols, VTermScreenCell *cells, int *changedFrom) {
+    if (m_lines.empty()) {
+        return false;
+    }
+    const size_t logical = m_logical.size() - 1;
+    const size_t first = m_logical[logical].line - m_lineBase;
+    const int64_t cut =
+        m_lines[first].start + (logicalRows(logical) - 1) * (int64_t)m_wrapWidth;
+    readRow(rows() - 1, cols, cells);
+    while (m_lines.size() > first && m_lines.back().start >= cut) {
+        popBack();
+    }
+    *changedFrom = size();
+    if (m_lines.size() > first && m_lines.back().start + m_lines.back().cols > cut) {
+        // The row began inside this line, it keeps the cells before
+        const int keep = (int)(cut - m_lines.back().start);
+        const bool continued = m_lines.size() - 1 > first;
+        std::vector<VTermScreenCell> head(keep);
+        readLine(size() - 1, keep, head.data());
+        popBack();
+        append(keep, head.data(), continued);
+        *changedFrom = size() - 1;
+    }
+    return true;
+}
+
+qint64 ScrollbackBuffer::rowOf(qint64 line, int column, int *rowColumn) const {
+    const qint64 end = (qint64)(m_lineBase + m_lines.size());
+    if (line < (qint64)m_lineBase || line >= end) {
+        if (rowColumn) {
+            *rowColumn = column;
+        }
+        return line < (qint64)m_lineBase ? firstRow() - ((qint64)m_lineBase - line)
+                                         : m_rowEnd + (line - end);
+    }
+    const size_t logical = logicalOf(line);
+    const int64_t cell = (int64_t)m_lines[line - m_lineBase].start -
+                         m_lines[m_logical[logical].line - m_lineBase].start + column;
+    const int64_t row = std::min(cell / m_wrapWidth, logicalRows(logical) - 1);
+    if (rowColumn) {
+        *rowColumn = (int)(cell - row * m_wrapWidth);
+    }
+    return m_logical[logical].row + row;
+}
+
+qint64 ScrollbackBuffer::lineOf(qint64 row, int *column) const {
+    if (column) {
+        *column = 0;
+    }
+    if (row < firstRow()) {
+        return (qint64)m_lineBase - (firstRow() - row);
+    }
+    if (row >= m_rowEnd) {
+        return (qint64)(m_lineBase + m_lines.size()) + (row - m_rowEnd);
+    }
+    const size_t logical = logicalAt(row);
+    const int64_t cell = (row - m_logical[logical].row) * m_wrapWidth;
+    const size_t idx = lineAtCell(logical, cell);
+    if (column) {
+        *column = (int)(cell + m_lines[m_logical[logical].line - m_lineBase].start -
+                        m_lines[idx].start);
+    }
+    return (qint64)(m_lineBase + idx);
+}
+
+int ScrollbackBuffer::decodeLine(const char *p, int cols, VTermScreenCell *cells) {
+    int lineCols = get<uint16_t>(p);
+    int stored = get<uint16_t>(p);
+    int runs = get<uint16_t>(p);
+    int extras = get<uint16_t>(p);
+    uint8_t flags = get<uint8_t>(p);
+
+    int n = std::min(cols, lineCols);
+    for (int i = 0; i < cols; ++i) {
+        blankCell(cells[i]);
+    }
+    if (flags & LineAscii) {
+        for (int i = 0; i < stored; ++i) {
+            if (i < n) {
+                cells[i].chars[0] = (uint8_t)p[i];
+            }
+        }
+        p += stored;
+    } else {
+        const char *widths = p + stored * sizeof(uint32_t);
+        for (int i = 0; i < stored; ++i) {
+            uint32_t ch = get<uint32_t>(p);
+            if (i < n) {
+                cells[i].chars[0] = ch;
+                cells[i].width = (uint8_t)widths[i];
+            }
+        }
+        p += stored;
+        for (int e = 0; e < extras; ++e) {
+            int col = get<uint16_t>(p);
+            int count = std::min<int>(get<uint8_t>(p), VTERM_MAX_CHARS_PER_CELL - 1);
+            for (int k = 1; k <= count; ++k) {
+                uint32_t ch = get<uint32_t>(p);
+                if (col < n) {
+                    cells[col].chars[k] = ch;
+                }
+            }
+        }
+    }
+    int col = 0;
+    for (int r = 0; r < runs && col < n; ++r) {
+        int len = get<uint16_t>(p);
+        VTermScreenCellAttrs attrs;
+        memset(&attrs, 0, sizeof(attrs));
+        unpackAttrs(get<uint32_t>(p), attrs);
+        VTermColor fg = getColor(p);
+        VTermColor bg = getColor(p);
+        int end = std::min(n, col + len);
+        for (; col < end; ++col) {
+            cells[col].attrs = attrs;
+            cells[col].fg = fg;
+            cells[col].bg = bg;
+        }
+    }
+    return lineCols;
+}
+
+size_t ScrollbackBuffer::recordSize(const char *data, size_t available) {
+    if (available < HeaderSize) {
+        return 0;
+    }
+    const char *p = data + sizeof(uint16_t);
+    const size_t stored = get<uint16_t>(p);
+    const size_t runs = get<uint16_t>(p);
+    const size_t extras = get<uint16_t>(p);
+    const uint8_t flags = get<uint8_t>(p);
+    size_t size = HeaderSize + ((flags & LineAscii) ? stored : stored * 5);
+    // Combining characters are only read from lines that are not plain ASCII
+    for (size_t e = 0; e < extras && !(flags & LineAscii); ++e) {
+        if (size + 3 > available) {
+            return 0;
+        }
+        const int n = (uint8_t)data[size + 2];
+        if (n > VTERM_MAX_CHARS_PER_CELL - 1) {
+            return 0;
+        }
+        size += 3 + n * sizeof(uint32_t);
+    }
+    size += runs * RunSize;
+    return size <= available ? size : 0;
+}
+
+size_t ScrollbackBuffer::memoryUsage() const {
+    size_t total = m_lines.size() * sizeof(LineRef) + m_logical.size() * sizeof(Logical) +
+                   m_freePages.size() * m_pageSize +
+                   m_pages.size() * sizeof(Page) + m_packedBytes;
+    for (const auto &page : m_pages) {
+        if (page.data) {
+            total += page.capacity;
+        } else {
+            total += page.borrowed.size();
+        }
+    }
+    for (const auto &c : m_cache) {
+        total += c.data.size();
+    }
+    return total;
+}
+
+char *ScrollbackBuffer::reserve(size_t size, LineRef *ref) {
+    // Cold pages and those shared with snapshots are not written to
+    if (m_pages.empty() || m_pages.size() - 1 < m_hotStart || !m_pages.back().data ||
+        m_pages.back().used + size > m_pages.back().capacity) {
+        Page page;
+        page.capacity = (uint32_t)std::max<size_t>(m_pageSize, size);
+        if (page.capacity == (uint32_t)m_pageSize && !m_freePages.empty()) {
+            page.data = std::move(m_freePages.back());
+            m_freePages.pop_back();
+        } else {
+            page.data.reset(new char[page.capacity]);
+        }
+        if (m_pages.empty()) {
+            m_pageBase = 0;
+        }
+        m_pages.push_back(std::move(page));
+    }
+    Page &page = m_pages.back();
+    page.handle.reset();
+    ref->page = m_pageBase + (uint32_t)m_pages.size() - 1;
+    ref->offset = page.used;
+    page.used += (uint32_t)size;
+    page.lines++;
+    return page.data.get() + ref->offset;
+}
+
+void ScrollbackBuffer::releasePage(Page &page) {
+    if (page.data && page.capacity == (uint32_t)m_pageSize && m_freePages.size() < MaxFreePages) {
+        m_freePages.push_back(std::move(page.data));
+    }
+    page.data.reset();
+    m_packedBytes -= page.packed.size();
+    page.packed = QByteArray();
+    page.borrowed = QByteArray();
+    page.handle.reset();
+    if (page.mapped) {
+        page.mapped = nullptr;
+        if (--m_mappedPages == 0) {
+            resetSnapshot();
+        }
+    }
+    page.spillFile.reset();
+    page.spillOffset = -1;
+    page.spillSize = 0;
+    page.capacity = 0;
+    page.used = 0;
+    page.lines = 0;
+}
+
+void ScrollbackBuffer::freezeColdPages() {
+    if (m_hotLines <= 0) {
+        return;
+    }
+    uint64_t hotFrom = m_lineBase + m_lines.size() - std::min<size_t>(m_lines.size(), m_hotLines);
+    // The last page is still being filled and always stays hot
+    while (m_hotStart + 1 < m_pages.size() && m_pages[m_hotStart].endLine <= hotFrom) {
+        freeze(m_pages[m_hotStart]);
+        m_hotStart++;
+    }
+    while (m_memoryLimit > 0 && m_packedBytes > m_memoryLimit && m_spillEnd < m_hotStart &&
+           !m_spillDirectory.isEmpty() && !m_spillFailed) {
+        spill(m_pages[m_spillEnd]);
+        if (m_spillFailed) {
+            break;
+        }
+        m_spillEnd++;
+    }
+}
+
+void ScrollbackBuffer::freeze(Page &page) {
+    // zlib at its fastest level, scrollback text tends to compress 5-10x
+    const char *records = page.data ? page.data.get() : page.borrowed.constData();
+    page.packed = qCompress((const uchar *)records, (qsizetype)page.used, 1);
+    m_packedBytes += page.packed.size();
+    if (page.data && page.capacity == (uint32_t)m_pageSize &&
+        m_freePages.size() < MaxFreePages) {
+        m_freePages.push_back(std::move(page.data));
+    }
+    page.data.reset();
+    page.borrowed = QByteArray();
+    // Snapshots taken from now on share the compressed bytes
+    page.handle.reset();
+}
+
+void ScrollbackBuffer::spill(Page &page) {
+    if (page.packed.isEmpty()) {
+        // Mapped from a state file, already on disk
+        return;
+    }
+    if (!m_spill) {
+        QDir().mkpath(m_spillDirectory);
+        m_spill = std::make_shared<SpillFile>(m_spillDirectory);
+        if (!m_spill->open()) {
+            m_spill.reset();
+            m_spillFailed = true;
+            return;
+        }
+    }
+    const qint64 offset = m_spill->append(page.packed);
+    if (offset < 0) {
+        m_spillFailed = true;
+        return;
+    }
+    page.spillFile = m_spill;
+    page.spillOffset = offset;
+    page.spillSize = (uint32_t)page.packed.size();
+    m_packedBytes -= page.packed.size();
+    page.packed = QByteArray();
+    page.handle.reset();
+}
+
+void ScrollbackBuffer::thaw(uint32_t seq) {
+    Page &page = pageFor(seq);
+    if (page.data) {
+        return;
+    }
+    const char *src = pageData(seq);
+    page.data.reset(new char[page.capacity]);
+    memcpy(page.data.get(), src, page.used);
+    dropCached(seq);
+    m_packedBytes -= page.packed.size();
+    page.packed = QByteArray();
+    page.borrowed = QByteArray();
+    page.spillFile.reset();
+    page.spillOffset = -1;
+    page.spillSize = 0;
+    if (page.mapped) {
+        page.mapped = nullptr;
+        if (--m_mappedPages == 0) {
+            resetSnapshot();
+        }
+    }
+}
+
+// Snapshots still holding on to either file keep it until they are done with it
+void ScrollbackBuffer::resetSpill() { m_spill.reset(); }
+
+void ScrollbackBuffer::resetSnapshot() {
+    m_snapshot.reset();
+    m_snapshotMap = nullptr;
+    m_mappedPages = 0;
+}
+
+// Snapshot layout: u32 lines, u32 pages, then per page u32 lines, that many u32 record
+// offsets, u32 used and u32 packed, followed by packed bytes of compressed records or, when
+// packed is 0, by the used bytes of the records. Lines popped from the front of the first
+// page are not listed, their bytes are kept.
+void ScrollbackBuffer::writeSnapshot(QDataStream &out, const ScrollbackSnapshot &snapshot) {
+    const uint64_t begin = snapshot.m_lineBase, end = begin + snapshot.m_size;
+    auto listed = [&](const ScrollbackSnapshot::Page &page) {
+        const uint64_t first = std::max(begin, page.firstLine);
+        const uint64_t last = std::min(end, page.firstLine + page.lines.size());
+        return last > first ? (uint32_t)(last - first) : 0;
+    };
+    quint32 pages = 0;
+    for (const auto &page : snapshot.m_pages) {
+        pages += listed(*page) > 0;
+    }
+    out << (quint32)snapshot.m_size << pages;
+    for (const auto &page : snapshot.m_pages) {
+        const uint32_t lines = listed(*page);
+        if (lines == 0) {
+            continue;
+        }
+        out << (quint32)lines;
+        const size_t skip = page->firstLine < begin ? (size_t)(begin - page->firstLine) : 0;
+        for (uint32_t l = 0; l < lines; ++l) {
+            out << (quint32)page->lines[skip + l].offset;
+        }
+        out << (quint32)page->used;
+        const QByteArray block = page->spillFile
+                                     ? page->spillFile->read(page->spillOffset, page->spillSize)
+                                     : QByteArray();
+        if (page->spillFile && block.size() != (qsizetype)page->spillSize) {
+            // Unreadable block, zeroed records read back as empty lines
+            out << (quint32)0;
+            out.writeRawData(QByteArray((qsizetype)page->used, '\0').constData(), (int)page->used);
+        } else if (page->spillFile) {
+            out << (quint32)block.size();
+            out.writeRawData(block.constData(), (int)block.size());
+        } else if (page->packed) {
+            out << (quint32)page->data.size();
+            out.writeRawData(page->data.constData(), (int)page->data.size());
+        } else {
+            out << (quint32)0;
+            out.writeRawData(page->data.constData(), (int)page->used);
+        }
+    }
+}
+
+bool ScrollbackBuffer::readSnapshot(QDataStream &in, bool compressedPages) {
+    clear();
+    quint32 lineCount = 0, pageCount = 0;
+    in >> lineCount >> pageCount;
+    if (in.status() != QDataStream::Ok) {
+        return false;
+    }
+
+    QFile *file = qobject_cast<QFile *>(in.device());
+#if !defined(Q_OS_WIN)
+    // Windows can not replace a file while it is mapped, the state file is copied there
+    if (file && !file->fileName().isEmpty()) {
+        auto mapped = std::make_unique<QFile>(file->fileName());
+        uchar *map = nullptr;
+        if (mapped->open(QIODevice::ReadOnly)) {
+            map = mapped->map(0, mapped->size());
+        }
+        if (map) {
+            m_snapshotMap = map;
+            m_snapshot = std::shared_ptr<QFile>(mapped.release(), [map](QFile *f) {
+                f->unmap(map);
+                delete f;
+            });
+        }
+    }
+#endif
+
+    bool ok = true;
+    std::vector<uint32_t> offsets;
+    for (quint32 i = 0; i < pageCount && ok; ++i) {
+        quint32 lines = 0, used = 0;
+        in >> lines;
+        offsets.resize(lines);
+        for (auto &o : offsets) {
+            quint32 v = 0;
+            in >> v;
+            o = v;
+        }
+        in >> used;
+        quint32 packed = 0;
+        if (compressedPages) {
+            in >> packed;
+        }
+        if (in.status() != QDataStream::Ok || lines == 0 || m_lines.size() + lines > lineCount ||
+            (file && (qint64)std::max(used, packed) > file->size()) ||
+            std::any_of(offsets.begin(), offsets.end(), [&](uint32_t o) { return o >= used; })) {
+            ok = false;
+            break;
+        }
+
+        Page page;
+        page.capacity = std::max<uint32_t>(used, (uint32_t)m_pageSize);
+        page.used = used;
+        page.lines = lines;
+        // A compressed page stays compressed, its records are inflated once to list its lines
+        QByteArray records;
+        const qint64 pos = m_snapshotMap ? file->pos() : -1;
+        if (packed > 0) {
+            page.packed = QByteArray((qsizetype)packed, Qt::Uninitialized);
+            ok = in.readRawData(page.packed.data(), (int)packed) == (int)packed;
+            m_packedBytes += page.packed.size();
+            records = qUncompress(page.packed);
+            ok = ok && records.size() >= (qsizetype)used;
+        } else if (pos >= 0 && pos + used <= m_snapshot->size() &&
+                   in.skipRawData((int)used) == (int)used) {
+            page.mapped = (const char *)m_snapshotMap + pos;
+            m_mappedPages++;
+        } else {
+            page.data.reset(new char[page.capacity]);
+            ok = in.readRawData(page.data.get(), (int)used) == (int)used;
+        }
+        const uint32_t seq = (uint32_t)m_pages.size();
+        const char *data = packed > 0   ? records.constData()
+                           : page.mapped ? page.mapped
+                                         : page.data.get();
+        for (uint32_t o : offsets) {
+            // The offsets were checked against used, the records themselves are checked here
+            if (!ok || recordSize(data + o, used - o) == 0) {
+                ok = false;
+                break;
+            }
+            const char *p = data + o;
+            LineRef ref;
+            ref.page = seq;
+            ref.offset = o;
+            ref.cols = get<uint16_t>(p);
+            ref.stored = get<uint16_t>(p);
+            p += 2 * sizeof(uint16_t);
+            pushRef(ref, get<uint8_t>(p) & LineContinued);
+        }
+        page.endLine = m_lines.size();
+        m_pages.push_back(std::move(page));
+    }
+    if (!ok || m_lines.size() != lineCount) {
+        clear();
+        return false;
+    }
+    // Compressed and mapped pages were written before the raw ones and are cold, new lines
+    // start a fresh page after them. The compressed ones spill like any others.
+    m_spillEnd = 0;
+    m_hotStart = 0;
+    for (size_t i = 0; i < m_pages.size(); ++i) {
+        if (!m_pages[i].data) {
+            m_hotStart = i + 1;
+        }
+    }
+    if (m_mappedPages == 0) {
+        resetSnapshot();
+    }
+    freezeColdPages();
+    return true;
+}
+
+ScrollbackSnapshot ScrollbackBuffer::snapshot() {
+    ScrollbackSnapshot snapshot;
+    snapshot.m_lineBase = m_lineBase;
+    snapshot.m_size = m_lines.size();
+    snapshot.m_wrapWidth = m_wrapWidth;
+    snapshot.m_rows = rows();
+    snapshot.m_pages.reserve(m_pages.size());
+    snapshot.m_heads.reserve(m_pages.size());
+    size_t line = 0;
+    for (size_t i = 0; i < m_pages.size(); ++i) {
+        Page &page = m_pages[i];
+        const size_t logical = logicalOf(m_lineBase + line);
+        snapshot.m_heads.push_back({m_logical[logical].row - firstRow(), m_logical[logical].line});
+        if (i + 1 == m_pages.size()) {
+            // The last page is still written to, every snapshot gets a copy of it
+            snapshot.m_pages.push_back(sharePage(i, line));
+        } else {
+            if (!page.handle) {
+                page.handle = sharePage(i, line);
+            }
+            snapshot.m_pages.push_back(page.handle);
+        }
+        line += page.lines;
+    }
+    return snapshot;
+}
+
+// Immutable view of page index, whose first line is m_lines[line]. The bytes of a closed page
+// are not copied: compressed and borrowed ones are implicitly shared, spilled ones are read
+// from the spill file, mapped ones from the mapped file, and hot ones move into the handle and
+// are borrowed back from it.
+std::shared_ptr<const ScrollbackSnapshot::Page> ScrollbackBuffer::sharePage(size_t index,
+                                                                            size_t line) {
+    Page &page = m_pages[index];
+    const bool last = index + 1 == m_pages.size();
+    auto shared = std::make_shared<ScrollbackSnapshot::Page>();
+    shared->used = page.used;
+    shared->firstLine = m_lineBase + line;
+    if (page.data) {
+        shared->data = QByteArray(page.data.get(), (qsizetype)page.used);
+        if (!last) {
+            if (page.capacity == (uint32_t)m_pageSize && m_freePages.size() < MaxFreePages) {
+                m_freePages.push_back(std::move(page.data));
+            }
+            page.data.reset();
+            page.borrowed = shared->data;
+        }
+    } else if (page.spillFile) {
+        shared->spillFile = page.spillFile;
+        shared->spillOffset = page.spillOffset;
+        shared->spillSize = page.spillSize;
+    } else if (!page.packed.isEmpty()) {
+        shared->data = page.packed;
+        shared->packed = true;
+    } else if (page.mapped) {
+        shared->data = QByteArray::fromRawData(page.mapped, (qsizetype)page.used);
+        shared->mapping = m_snapshot;
+    } else {
+        shared->data = page.borrowed;
+    }
+    shared->lines.reserve(page.lines);
+    size_t logical = logicalOf(m_lineBase + line);
+    for (uint32_t i = 0; i < page.lines; ++i) {
+        const LineRef &ref = m_lines[line + i];
+        const uint64_t abs = m_lineBase + line + i;
+        while (logical + 1 < m_logical.size() && m_logical[logical + 1].line <= abs) {
+            logical++;
+        }
+        shared->lines.push_back({ref.offset, ref.cols, ref.stored, m_logical[logical].line != abs});
+    }
+    return shared;
+}
@@ -0,0 +1,266 @@
+// SPDX-License-Identifier: MIT
+// Author: Diego Iastrubni <diegoiast@gmail.com>
+
+#pragma once
+
+#include <vterm.h>
+
+#include <QByteArray>
+#include <QString>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <vector>
+
+class QDataStream;
+class QFile;
+class SpillFile;
+
+// The scrollback as it was when ScrollbackBuffer::snapshot() was taken. Pages that can no
+// longer change are shared with the buffer and between snapshots, only the page still being
+// filled is copied, so taking one costs about a page however long the history is. Snapshots
+// are immutable and can be handed to any thread, a ScrollbackBuffer constructed from one
+// reads its pages in place.
+class ScrollbackSnapshot {
+  public:
+    int size() const { return (int)m_size; }
+    qint64 firstLine() const { return (qint64)m_lineBase; }
+    bool isEmpty() const { return m_size == 0; }
+    int wrapWidth() const { return m_wrapWidth; }
+    int rows() const { return m_rows; }
+
+    // Pages are read one at a time without building a ScrollbackBuffer, for scans of the
+    // whole history. The lines of page are the absolute numbers [*first, *end).
+    int pageCount() const { return (int)m_pages.size(); }
+    void pageLines(int page, qint64 *first, qint64 *end) const;
+    // The records of page, inflated or read back from the spill file when it is cold. An
+    // unreadable page comes back zeroed, its lines decode as empty.
+    QByteArray pageRecords(int page) const;
+    // Decodes line, which is on page, out of the records pageRecords() returned for it.
+    // Returns the number of columns the line was stored with.
+    int readLine(int page, const QByteArray &records, qint64 line, int cols,
+                 VTermScreenCell *cells) const;
+    int lineColumns(int page, qint64 line) const;
+
+    // The logical lines holding rows [first, end), as a snapshot of their own whose row 0 is
+    // row *firstRow of this one. Found from the line lengths alone, no page is read, and a
+    // ScrollbackBuffer made from it indexes only those lines.
+    ScrollbackSnapshot slice(int first, int end, int *firstRow) const;
+
+  private:
+    friend class ScrollbackBuffer;
+    struct Line {
+        uint32_t offset;
+        uint16_t cols;
+        uint16_t stored;
+        bool continued;
+    };
+    struct Page {
+        QByteArray data; // the records, or them compressed
+        bool packed = false;
+        // A spilled page stays in the spill file, data is empty
+        std::shared_ptr<SpillFile> spillFile;
+        qint64 spillOffset = -1;
+        uint32_t spillSize = 0;
+        // The state file data points into when it was mapped
+        std::shared_ptr<const QFile> mapping;
+        uint32_t used = 0;
+        uint64_t firstLine = 0;
+        std::vector<Line> lines;
+    };
+    // First row and line of the logical line a page starts in
+    struct Head {
+        int64_t row;
+        uint64_t line;
+    };
+
+    const Line &lineAt(size_t *page, uint64_t line) const;
+    uint64_t logicalEnd(size_t *page, uint64_t line, int64_t *rows) const;
+
+    std::vector<std::shared_ptr<const Page>> m_pages;
+    std::vector<Head> m_heads; // one per page
+    uint64_t m_lineBase = 0;
+    size_t m_size = 0;
+    int m_wrapWidth = 80;
+    int m_rows = 0;
+};
+
+// Scrollback lines packed into fixed size pages. A line record is a small header, the cell
+// text (one byte per cell for plain ASCII lines, a codepoint and a width otherwise), the
+// combining characters of the few cells that have them, and attribute/color runs. Trailing
+// blank cells cost nothing besides their run. Pages are appended to, dropped from the front
+// once all their lines scrolled out, and recycled through a small free list, so pushing a
+// line does not allocate in the steady state.
+//
+// Pages are also the unit of tiering: once a page holds only lines older than the hot
+// window it is compressed, and once compressed pages exceed the memory limit the oldest
+// are moved to a memory mapped spill file. Cold pages are inflated on demand into a small
+// LRU cache.
+//
+// Records are byte order and struct layout independent, so pages can be written to a
+// snapshot as is and used straight from the mapped snapshot file when it is read back.
+//
+// Lines are kept the way the terminal pushed them. A continued line carries on the line
+// before it, consecutive ones form a logical line, and rows are the logical lines wrapped at
+// the wrap width. A prefix index of the first row of every logical line maps rows to lines
+// with a binary search. Changing the width only recomputes row counts from line lengths,
+// cells are cut out of the stored lines as rows are read.
+class ScrollbackBuffer {
+  public:
+    static constexpr int DefaultPageSize = 64 * 1024;
+
+    explicit ScrollbackBuffer(int pageSize = DefaultPageSize);
+    // A buffer of its own sharing the pages of snapshot, they are copied once written to
+    explicit ScrollbackBuffer(const ScrollbackSnapshot &snapshot);
+    ~ScrollbackBuffer();
+
+    // hotLines <= 0 keeps everything uncompressed, an empty directory disables spilling
+    void setTiering(int hotLines, qint64 memoryLimit, const QString &spillDirectory);
+
+    int size() const { return (int)m_lines.size(); }
+    // Absolute number of line 0, counting every line dropped from the front since clear()
+    qint64 firstLine() const { return (qint64)m_lineBase; }
+    bool isEmpty() const { return m_lines.empty(); }
+    void clear();
+
+    void append(int cols, const VTermScreenCell *cells, bool continued = false);
+    void popFront();
+    void popBack();
+
+    // Decodes line idx into cells[0, cols). Missing cells are blank with default colors.
+    // Returns the number of columns the line was stored with.
+    int readLine(int idx, int cols, VTermScreenCell *cells) const;
+    int lineColumns(int idx) const;
+
+    // Inflates the pages backing lines [first, first + count) ahead of painting them
+    void prefetch(int first, int count) const;
+
+    void setWrapWidth(int cols);
+    int wrapWidth() const { return m_wrapWidth; }
+    int rows() const;
+    // Absolute number of row 0, stable until the wrap width changes
+    qint64 firstRow() const;
+    // Row counterparts of readLine(), lineColumns() and prefetch()
+    int readRow(int idx, int cols, VTermScreenCell *cells) const;
+    int rowColumns(int idx) const;
+    void prefetchRows(int first, int count) const;
+    // Takes the last row off, for the screen to pull back. Lines from *changedFrom on were
+    // dropped or rewritten.
+    bool popRow(int cols, VTermScreenCell *cells, int *changedFrom);
+    // Maps an absolute line and column to an absolute row and column, and back. Numbers past
+    // either end continue one row per line, like screen rows after the scrollback.
+    qint64 rowOf(qint64 line, int column, int *rowColumn = nullptr) const;
+    qint64 lineOf(qint64 row, int *column = nullptr) const;
+
+    size_t memoryUsage() const;
+
+    // The record format on its own, used for the screen rows of saved state
+    static QByteArray encodeLine(int cols, const VTermScreenCell *cells);
+    static int decodeLine(const char *data, int cols, VTermScreenCell *cells);
+    // Length of the record at data as its header counts have it, 0 when that is more than
+    // the available bytes. Records read from files are checked with it before decoding.
+    static size_t recordSize(const char *data, size_t available);
+
+    // Writes the pages of a snapshot, compressed and spilled ones as they are, so it can run
+    // on any thread without inflating anything. Raw pages read from a file are mapped rather
+    // than copied, they stay read only until popBack() needs one of them writable again.
+    // compressedPages is false for snapshots written before pages could be compressed.
+    static void writeSnapshot(QDataStream &out, const ScrollbackSnapshot &snapshot);
+    bool readSnapshot(QDataStream &in, bool compressedPages = true);
+
+    // Closed pages are handed over rather than copied, hence not const
+    ScrollbackSnapshot snapshot();
+
+  private:
+    struct Page {
+        std::unique_ptr<char[]> data;
+        QByteArray packed;
+        const char *mapped = nullptr;
+        // Uncompressed records shared with snapshots, once a closed page was handed to one
+        // or when this buffer was made from a snapshot
+        QByteArray borrowed;
+        // Where a spilled page is, the buffer's own spill file or that of the buffer a
+        // snapshot was taken from
+        std::shared_ptr<SpillFile> spillFile;
+        qint64 spillOffset = -1;
+        uint32_t spillSize = 0;
+        uint32_t capacity = 0;
+        uint32_t used = 0;
+        uint32_t lines = 0;
+        uint64_t endLine = 0;
+        // Handed to every snapshot while the page is not the last one, dropped when it changes
+        // or changes tier. Also keeps alive what borrowed points into.
+        mutable std::shared_ptr<const ScrollbackSnapshot::Page> handle;
+    };
+    struct LineRef {
+        uint32_t page;
+        uint32_t offset;
+        uint32_t start; // first cell within the logical line
+        uint16_t cols;
+        uint16_t stored;
+    };
+    struct Logical {
+        int64_t row;   // absolute first row
+        uint64_t line; // absolute first line
+    };
+    struct CachedPage {
+        uint32_t page;
+        uint64_t stamp;
+        QByteArray data;
+    };
+
+    const char *lineData(int idx) const;
+    const char *pageData(uint32_t page) const;
+    Page &pageFor(uint32_t page) { return m_pages[page - m_pageBase]; }
+    char *reserve(size_t size, LineRef *ref);
+    void releasePage(Page &page);
+    void dropCached(uint32_t page) const;
+    std::shared_ptr<const ScrollbackSnapshot::Page> sharePage(size_t index, size_t line);
+
+    void pushRef(LineRef ref, bool continued);
+    size_t logicalEnd(size_t logical) const;
+    size_t logicalAt(int64_t row) const;
+    size_t logicalOf(uint64_t line) const;
+    size_t lineAtCell(size_t logical, int64_t cell) const;
+    int64_t logicalRows(size_t logical) const;
+    int64_t wrappedRows(size_t logical) const;
+    void readCells(size_t logical, int64_t from, int count, VTermScreenCell *cells) const;
+
+    void freezeColdPages();
+    void freeze(Page &page);
+    void spill(Page &page);
+    void thaw(uint32_t page);
+    void resetSpill();
+    void resetSnapshot();
+
+    int m_pageSize;
+    std::deque<Page> m_pages;
+    uint32_t m_pageBase = 0;
+    std::deque<LineRef> m_lines;
+    uint64_t m_lineBase = 0;
+    std::vector<std::unique_ptr<char[]>> m_freePages;
+
+    std::deque<Logical> m_logical;
+    int64_t m_rowEnd = 0;
+    int m_wrapWidth = 80;
+    mutable std::vector<VTermScreenCell> m_scratch;
+
+    // Pages [0, m_spillEnd) live in the spill file, [m_spillEnd, m_hotStart) are compressed
+    // in memory, the rest are hot
+    size_t m_spillEnd = 0;
+    size_t m_hotStart = 0;
+    int m_hotLines = 0;
+    qint64 m_memoryLimit = 0;
+    qint64 m_packedBytes = 0;
+    QString m_spillDirectory;
+    // Shared with the snapshots still reading spilled pages from it
+    std::shared_ptr<SpillFile> m_spill;
+    bool m_spillFailed = false;
+    // Pages mapped from the snapshot file count as spilled
+    std::shared_ptr<QFile> m_snapshot;
+    uchar *m_snapshotMap = nullptr;
+    size_t m_mappedPages = 0;
+    mutable std::vector<CachedPage> m_cache;
+    mutable uint64_t m_cacheStamp = 0;
+};
@@ -0,0 +1,249 @@
+// SPDX-License-Identifier: MIT
+// Author: Diego Iastrubni <diegoiast@gmail.com>
+
+#include "ScrollbackSearch.h"
+#include "TerminalSnapshot.h"
+
+#include <QElapsedTimer>
+#include <QMetaObject>
+#include <QRegularExpression>
+#include <QThread>
+#include <algorithm>
+#include <vector>
+
+static constexpr int MaxMatches = 100000;
+// How often a running scan checks for cancellation
+static constexpr int ScanChunk = 1024;
+static constexpr int BatchInterval = 16;
+
+SearchLine SearchLine::fromCells(const VTermScreenCell *cells, int cols) {
+    SearchLine line;
+    int end = cols;
+    while (end > 0 && cells[end - 1].width == 1 &&
+           (cells[end - 1].chars[0] == 0 || cells[end - 1].chars[0] == ' ')) {
+        end--;
+    }
+    line.text.reserve(end);
+    bool simple = true;
+    QList<quint16> columns;
+    columns.reserve(end + 1);
+    for (int c = 0; c < end; ++c) {
+        const VTermScreenCell &cell = cells[c];
+        if (cell.chars[0] == (uint32_t)-1) {
+            // Right half of a wide character
+            continue;
+        }
+        if (cell.width > 1) {
+            simple = false;
+        }
+        if (cell.chars[0] == 0) {
+            line.text.append(QLatin1Char(' '));
+            columns.append(c);
+            continue;
+        }
+        for (int i = 0; i < VTERM_MAX_CHARS_PER_CELL && cell.chars[i]; ++i) {
+            char32_t ch = cell.chars[i];
+            if (i > 0 || QChar::requiresSurrogates(ch)) {
+                simple = false;
+            }
+            if (QChar::requiresSurrogates(ch)) {
+                line.text.append(QChar(QChar::highSurrogate(ch)));
+                line.text.append(QChar(QChar::lowSurrogate(ch)));
+                columns.append(c);
+                columns.append(c);
+            } else {
+                line.text.append(QChar((char16_t)ch));
+                columns.append(c);
+            }
+        }
+    }
+    if (!simple) {
+        columns.append(end);
+        line.columns = std::move(columns);
+    }
+    return line;
+}
+
+int SearchLine::columnAt(qsizetype pos) const {
+    if (columns.isEmpty()) {
+        return (int)pos;
+    }
+    return columns[std::clamp<qsizetype>(pos, 0, columns.size() - 1)];
+}
+
+class ScrollbackSearch::Worker : public QThread {
+  public:
+    explicit Worker(ScrollbackSearch *owner) : m_owner(owner) {}
+
+  protected:
+    void run() override {
+        ScrollbackSearch *o = m_owner;
+        forever {
+            Request request;
+            {
+                QMutexLocker lock(&o->m_mutex);
+                while (!o->m_requestPending && !o->m_stop) {
+                    o->m_wake.wait(&o->m_mutex);
+                }
+                if (o->m_stop) {
+                    return;
+                }
+                request = std::move(o->m_request);
+                o->m_request = Request();
+                o->m_requestPending = false;
+            }
+            o->runSearch(request);
+        }
+    }
+
+  private:
+    ScrollbackSearch *m_owner;
+};
+
+ScrollbackSearch::ScrollbackSearch(QObject *parent) : QObject(parent) {
+    m_worker = new Worker(this);
+    m_worker->start(QThread::LowPriority);
+}
+
+ScrollbackSearch::~ScrollbackSearch() {
+    {
+        QMutexLocker lock(&m_mutex);
+        m_stop = true;
+        m_generation++;
+        m_wake.wakeAll();
+    }
+    m_worker->wait();
+    delete m_worker;
+}
+
+void ScrollbackSearch::search(const QString &pattern, int flags,
+                         std::shared_ptr<const TerminalSnapshot> snapshot, MatchHandler handler) {
+    QMutexLocker lock(&m_mutex);
+    m_request.generation = ++m_generation;
+    m_request.pattern = pattern;
+    m_request.flags = flags;
+    m_request.snapshot = std::move(snapshot);
+    m_request.handler = std::move(handler);
+    m_requestPending = true;
+    m_wake.wakeAll();
+}
+
+void ScrollbackSearch::cancel() {
+    QMutexLocker lock(&m_mutex);
+    m_generation++;
+    m_request = Request();
+    m_requestPending = false;
+}
+
+void ScrollbackSearch::runSearch(const Request &request) {
+    const quint64 generation = request.generation;
+    const Qt::CaseSensitivity cs =
+        (request.flags & CaseSensitive) ? Qt::CaseSensitive : Qt::CaseInsensitive;
+    QRegularExpression re;
+    if (request.flags & RegularExpression) {
+        re.setPattern(request.pattern);
+        if (cs == Qt::CaseInsensitive) {
+            re.setPatternOptions(QRegularExpression::CaseInsensitiveOption);
+        }
+        re.optimize();
+    }
+    bool valid = !request.pattern.isEmpty() &&
+                 (!(request.flags & RegularExpression) || re.isValid());
+
+    QList<SearchMatch> batch;
+    int total = 0;
+    bool delivered = false;
+    QElapsedTimer sinceDelivery;
+    sinceDelivery.start();
+    auto deliver = [&](bool finished) {
+        QList<SearchMatch> matches;
+        matches.swap(batch);
+        MatchHandler handler = request.handler;
+        QMetaObject::invokeMethod(
+            this,
+            [this, handler, matches, finished, generation]() {
+                if (m_generation == generation) {
+                    handler(matches, finished);
+                }
+            },
+            Qt::QueuedConnection);
+        delivered = true;
+        sinceDelivery.restart();
+    };
+
+    QList<SearchMatch> found;
+    auto scanLine = [&](const SearchLine &line, qint64 number) {
+        found.clear();
+        if (request.flags & RegularExpression) {
+            for (auto it = re.globalMatch(line.text); it.hasNext();) {
+                QRegularExpressionMatch m = it.next();
+                if (m.capturedLength() > 0) {
+                    int col = line.columnAt(m.capturedStart());
+                    found.append({number, col, line.columnAt(m.capturedEnd()) - col});
+                }
+            }
+        } else {
+            qsizetype pos = 0;
+            while ((pos = line.text.indexOf(request.pattern, pos, cs)) >= 0) {
+                int col = line.columnAt(pos);
+                found.append(
+                    {number, col, line.columnAt(pos + request.pattern.size()) - col});
+                pos += request.pattern.size();
+            }
+        }
+        // Batches run newest first, also within a line
+        for (auto it = found.crbegin(); it != found.crend(); ++it) {
+            batch.append(*it);
+        }
+        total += found.size();
+    };
+
+    if (!valid) {
+        deliver(true);
+        return;
+    }
+    const TerminalSnapshot &snapshot = *request.snapshot;
+    const ScrollbackSnapshot &scrollback = snapshot.scrollback();
+    const qint64 firstScreenLine = scrollback.firstLine() + scrollback.size();
+    std::vector<VTermScreenCell> cells(std::max(snapshot.cols(), 1));
+    for (int r = snapshot.rows() - 1; r >= 0; --r) {
+        snapshot.readScreenRow(r, snapshot.cols(), cells.data());
+        scanLine(SearchLine::fromCells(cells.data(), snapshot.cols()), firstScreenLine + r);
+    }
+    if (!batch.isEmpty()) {
+        deliver(false);
+    }
+
+    // Then the scrollback of the same snapshot, a page at a time so only the one being
+    // scanned is inflated
+    int scanned = 0;
+    for (int page = scrollback.pageCount() - 1; page >= 0 && total < MaxMatches; --page) {
+        qint64 first, next;
+        scrollback.pageLines(page, &first, &next);
+        if (first >= next) {
+            continue;
+        }
+        if (m_generation != generation) {
+            return;
+        }
+        const QByteArray records = scrollback.pageRecords(page);
+        while (--next >= first && total < MaxMatches) {
+            const int cols = scrollback.lineColumns(page, next);
+            cells.resize(std::max(cols, 1));
+            scrollback.readLine(page, records, next, cols, cells.data());
+            scanLine(SearchLine::fromCells(cells.data(), cols), next);
+            if (++scanned % ScanChunk == 0) {
+                if (m_generation != generation) {
+                    return;
+                }
+                if (!batch.isEmpty() &&
+                    (!delivered || sinceDelivery.elapsed() >= BatchInterval)) {
+                    deliver(false);
+                }
+            }
+        }
+    }
+    if (m_generation == generation) {
+        deliver(true);
+    }
+}
@@ -0,0 +1,78 @@
+// SPDX-License-Identifier: MIT
+// Author: Diego Iastrubni <diegoiast@gmail.com>
+
+#pragma once
+
+#include <vterm.h>
+
+#include <QList>
+#include <QMutex>
+#include <QObject>
+#include <QString>
+#include <QWaitCondition>
+#include <atomic>
+#include <functional>
+#include <memory>
+
+class TerminalSnapshot;
+
+// Plain text of one terminal line. columns maps each UTF-16 position to its cell, it is
+// only filled in when the line has wide, combining or non-BMP characters.
+struct SearchLine {
+    QString text;
+    QList<quint16> columns;
+
+    static SearchLine fromCells(const VTermScreenCell *cells, int cols);
+    int columnAt(qsizetype pos) const;
+};
+
+// line is an absolute line number: scrollback lines are numbered from the first line ever
+// pushed, screen rows continue after the last scrollback line.
+struct SearchMatch {
+    qint64 line;
+    int column;
+    int length;
+};
+
+// Searches terminal snapshots on a worker thread. Nothing is kept between searches, a search
+// scans the screen of its snapshot and then the scrollback pages from the newest line
+// backwards, inflating one page at a time, and streams batches of matches as it goes, so the
+// nearest hits show up long before the scan is done.
+class ScrollbackSearch : public QObject {
+    Q_OBJECT
+
+  public:
+    enum Flag { CaseSensitive = 0x1, RegularExpression = 0x2 };
+
+    // Called on the owner's thread. Matches in a batch are ordered newest first.
+    using MatchHandler = std::function<void(const QList<SearchMatch> &matches, bool finished)>;
+
+    explicit ScrollbackSearch(QObject *parent = nullptr);
+    ~ScrollbackSearch();
+
+    // Starts a new search, cancelling the previous one. Screen rows are numbered on from the
+    // last line of scrollback.
+    void search(const QString &pattern, int flags,
+                std::shared_ptr<const TerminalSnapshot> snapshot, MatchHandler handler);
+    void cancel();
+
+  private:
+    class Worker;
+    struct Request {
+        quint64 generation = 0;
+        QString pattern;
+        int flags = 0;
+        std::shared_ptr<const TerminalSnapshot> snapshot;
+        MatchHandler handler;
+    };
+
+    void runSearch(const Request &request);
+
+    Worker *m_worker = nullptr;
+    QMutex m_mutex;
+    QWaitCondition m_wake;
+    Request m_request;
+    bool m_requestPending = false;
+    bool m_stop = false;
+    std::atomic<quint64> m_generation = 0;
+};
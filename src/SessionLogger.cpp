@@ -0,0 +1,254 @@
+// SPDX-License-Identifier: MIT
+// Author: Diego Iastrubni <diegoiast@gmail.com>
+
+#include "SessionLogger.h"
+
+#include <QDeadlineTimer>
+#include <QElapsedTimer>
+#include <QThread>
+#include <QtEndian>
+#include <algorithm>
+
+#if defined(Q_OS_WIN)
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+static const QByteArray StartMarker = "LOG_START_MARKER\n";
+static const QByteArray CompressionHeader = "Compression: zlib-blocks\n";
+// The GUI thread blocks once this much is waiting for the disk
+static constexpr qsizetype MaxPending = 8 * 1024 * 1024;
+
+static void syncToDisk(QFile &file) {
+    file.flush();
+#if defined(Q_OS_WIN)
+    _commit(file.handle());
+#else
+    ::fsync(file.handle());
+#endif
+}
+
+class SessionLogger::Worker : public QThread {
+  public:
+    explicit Worker(SessionLogger *owner) : m_owner(owner) {}
+
+  protected:
+    void run() override { m_owner->run(); }
+
+  private:
+    SessionLogger *m_owner;
+};
+
+SessionLogger::SessionLogger() = default;
+
+SessionLogger::~SessionLogger() { close(); }
+
+bool SessionLogger::open(const QString &path, const QByteArray &header,
+                         const Options &options) {
+    close();
+    m_file.setFileName(path);
+    if (!m_file.open(QIODevice::WriteOnly)) {
+        return false;
+    }
+    QByteArray h = header;
+    if (options.compress && h.endsWith(StartMarker)) {
+        h.insert(h.size() - StartMarker.size(), CompressionHeader);
+    }
+    m_file.write(h);
+    m_file.flush();
+
+    m_fileName = path;
+    m_options = options;
+    m_options.flushInterval = std::max(10, m_options.flushInterval);
+    m_options.flushSize = std::clamp<qint64>(m_options.flushSize, 4096, MaxPending / 2);
+    m_stop = false;
+    m_worker = new Worker(this);
+    m_worker->start(QThread::LowPriority);
+    return true;
+}
+
+void SessionLogger::close() {
+    if (!m_worker) {
+        return;
+    }
+    {
+        QMutexLocker lock(&m_mutex);
+        m_stop = true;
+        m_dataReady.wakeAll();
+    }
+    m_worker->wait();
+    delete m_worker;
+    m_worker = nullptr;
+    m_file.close();
+    m_pending.clear();
+}
+
+void SessionLogger::write(const QByteArray &data) {
+    if (!m_worker || data.isEmpty()) {
+        return;
+    }
+    QMutexLocker lock(&m_mutex);
+    while (m_pending.size() >= MaxPending && !m_stop) {
+        m_dataReady.wakeAll();
+        m_spaceAvailable.wait(&m_mutex);
+    }
+    bool wasEmpty = m_pending.isEmpty();
+    m_pending.append(data);
+    if (wasEmpty || m_pending.size() >= m_options.flushSize) {
+        m_dataReady.wakeAll();
+    }
+}
+
+SessionLogger::DiskStats SessionLogger::takeDiskStats() {
+    DiskStats stats;
+    stats.operations = m_diskOperations.exchange(0);
+    stats.totalNs = m_diskNs.exchange(0);
+    stats.maxNs = m_maxDiskNs.exchange(0);
+    return stats;
+}
+
+void SessionLogger::run() {
+    QElapsedTimer sinceSync;
+    sinceSync.start();
+    bool unsynced = false;
+    forever {
+        QByteArray batch;
+        bool stop;
+        {
+            QMutexLocker lock(&m_mutex);
+            // An idle log does not wake up at all
+            while (!m_stop && m_pending.isEmpty() && !unsynced) {
+                m_dataReady.wait(&m_mutex);
+            }
+            while (!m_stop && m_pending.size() < m_options.flushSize &&
+                   sinceSync.elapsed() < m_options.flushInterval) {
+                m_dataReady.wait(&m_mutex,
+                                 QDeadlineTimer(m_options.flushInterval - sinceSync.elapsed()));
+            }
+            batch.swap(m_pending);
+            stop = m_stop;
+            m_spaceAvailable.wakeAll();
+        }
+        // Compression is not disk time, only the write and sync calls are measured
+        qint64 diskNs = -1;
+        QElapsedTimer disk;
+        if (!batch.isEmpty()) {
+            if (m_options.compress) {
+                QByteArray block = qCompress(batch);
+                char size[4];
+                qToBigEndian<quint32>(block.size(), size);
+                disk.start();
+                m_file.write(size, sizeof(size));
+                m_file.write(block);
+            } else {
+                disk.start();
+                m_file.write(batch);
+            }
+            diskNs = disk.nsecsElapsed();
+            unsynced = true;
+        }
+        if (unsynced && (stop || sinceSync.elapsed() >= m_options.flushInterval)) {
+            disk.start();
+            syncToDisk(m_file);
+            diskNs = std::max<qint64>(diskNs, 0) + disk.nsecsElapsed();
+            unsynced = false;
+        }
+        if (diskNs >= 0) {
+            m_diskOperations++;
+            m_diskNs += diskNs;
+            qint64 max = m_maxDiskNs.load();
+            while (diskNs > max && !m_maxDiskNs.compare_exchange_weak(max, diskNs)) {
+            }
+        }
+        if (sinceSync.elapsed() >= m_options.flushInterval) {
+            sinceSync.restart();
+        }
+        if (stop) {
+            return;
+        }
+    }
+}
+
+bool SessionLogReader::open(const QString &path) {
+    close();
+    m_file.setFileName(path);
+    if (!m_file.open(QIODevice::ReadOnly)) {
+        return false;
+    }
+    QByteArray header;
+    while (!m_file.atEnd() && header.size() <= 1024) {
+        QByteArray line = m_file.readLine(1024);
+        if (line.isEmpty()) {
+            break;
+        }
+        header.append(line);
+        if (line == StartMarker) {
+            break;
+        }
+    }
+    m_compressed = header.contains("\n" + CompressionHeader);
+    return true;
+}
+
+void SessionLogReader::close() {
+    m_file.close();
+    m_compressed = false;
+    m_block.clear();
+    m_blockOffset = 0;
+}
+
+bool SessionLogReader::nextBlock() {
+    m_block.clear();
+    m_blockOffset = 0;
+    char size[4];
+    if (m_file.read(size, sizeof(size)) != sizeof(size)) {
+        return false;
+    }
+    m_block = qUncompress(m_file.read(qFromBigEndian<quint32>(size)));
+    return !m_block.isEmpty();
+}
+
+QByteArray SessionLogReader::read(qint64 maxSize) {
+    if (!m_compressed) {
+        return m_file.read(maxSize);
+    }
+    if (m_blockOffset >= m_block.size() && !nextBlock()) {
+        return {};
+    }
+    QByteArray chunk = m_block.mid(m_blockOffset, maxSize);
+    m_blockOffset += chunk.size();
+    return chunk;
+}
+
+bool SessionLogReader::skip(qint64 size) {
+    if (!m_compressed) {
+        qint64 target = m_file.pos() + size;
+        m_file.seek(std::min(target, m_file.size()));
+        return target <= m_file.size();
+    }
+    while (size > 0) {
+        qint64 left = m_block.size() - m_blockOffset;
+        if (left > 0) {
+            qint64 n = std::min(left, size);
+            m_blockOffset += n;
+            size -= n;
+            continue;
+        }
+        // qCompress() stores the inflated size up front, whole blocks are skipped unread
+        char header[8];
+        if (m_file.peek(header, sizeof(header)) != sizeof(header)) {
+            return false;
+        }
+        qint64 packed = qFromBigEndian<quint32>(header);
+        qint64 plain = qFromBigEndian<quint32>(header + 4);
+        qint64 next = m_file.pos() + 4 + packed;
+        if (plain <= size && next <= m_file.size()) {
+            m_file.seek(next);
+            size -= plain;
+        } else if (!nextBlock()) {
+            return false;
+        }
+    }
+    return true;
+}
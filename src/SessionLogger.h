@@ -0,0 +1,87 @@
+// SPDX-License-Identifier: MIT
+// Author: Diego Iastrubni <diegoiast@gmail.com>
+
+#pragma once
+
+#include <QByteArray>
+#include <QFile>
+#include <QMutex>
+#include <QString>
+#include <QWaitCondition>
+#include <atomic>
+
+// Writes the session log on a background thread. The GUI thread only appends to a bounded
+// buffer, the writer drains it once flushSize bytes are pending or flushInterval passed, and
+// syncs the file to disk every flushInterval. If the disk falls behind by more than the
+// buffer limit, write() blocks until the writer catches up, so nothing is dropped.
+//
+// With compression enabled everything after the plain text header is a sequence of zlib
+// blocks, one per drain: a big endian u32 size followed by qCompress() output. A block torn
+// by a crash is simply ignored when reading.
+class SessionLogger {
+  public:
+    struct Options {
+        int flushInterval = 1000; // ms
+        qint64 flushSize = 256 * 1024;
+        bool compress = false;
+    };
+
+    SessionLogger();
+    ~SessionLogger();
+
+    // header must end with "LOG_START_MARKER\n"
+    bool open(const QString &path, const QByteArray &header, const Options &options);
+    void close();
+    bool isOpen() const { return m_worker != nullptr; }
+    QString fileName() const { return m_fileName; }
+
+    void write(const QByteArray &data);
+
+    // Time the writer thread spent in write and sync calls since the previous call, one
+    // operation per drain that reached the disk
+    struct DiskStats {
+        qint64 operations = 0;
+        qint64 totalNs = 0;
+        qint64 maxNs = 0;
+    };
+    DiskStats takeDiskStats();
+
+  private:
+    class Worker;
+    void run();
+
+    QString m_fileName;
+    QFile m_file;
+    Options m_options;
+    Worker *m_worker = nullptr;
+
+    QMutex m_mutex;
+    QWaitCondition m_dataReady;
+    QWaitCondition m_spaceAvailable;
+    QByteArray m_pending;
+    bool m_stop = false;
+
+    std::atomic<qint64> m_diskOperations = 0;
+    std::atomic<qint64> m_diskNs = 0;
+    std::atomic<qint64> m_maxDiskNs = 0;
+};
+
+// Reads back the terminal output of a session log, compressed or not
+class SessionLogReader {
+  public:
+    bool open(const QString &path);
+    void close();
+    bool isOpen() const { return m_file.isOpen(); }
+    // Returns an empty array at the end of the log
+    QByteArray read(qint64 maxSize);
+    // Skips bytes of terminal output, false when the log ends first
+    bool skip(qint64 size);
+
+  private:
+    bool nextBlock();
+
+    QFile m_file;
+    bool m_compressed = false;
+    QByteArray m_block;
+    qsizetype m_blockOffset = 0;
+};
@@ -0,0 +1,141 @@
+// SPDX-License-Identifier: MIT
+// Author: Diego Iastrubni <diegoiast@gmail.com>
+
+#include "SessionRestore.h"
+#include "KodoTerm/KodoTermCore.hpp"
+
+#include <QCoreApplication>
+#include <QMetaObject>
+#include <QThread>
+#include <QThreadPool>
+#include <algorithm>
+#include <deque>
+
+// Restores waiting for the visible ones to finish, and how many visible ones are running
+static std::deque<SessionRestore *> s_waiting;
+static int s_foregroundRunning = 0;
+
+void SessionRestore::startWaiting() {
+    while (s_foregroundRunning == 0 && !s_waiting.empty()) {
+        SessionRestore *restore = s_waiting.front();
+        s_waiting.pop_front();
+        restore->startOnPool(false);
+    }
+}
+
+void SessionRestore::startOnPool(bool foreground) {
+    m_counted = foreground;
+    if (foreground) {
+        s_foregroundRunning++;
+    }
+    QThreadPool::globalInstance()->start(this, foreground ? 1 : 0);
+}
+
+SessionRestore::SessionRestore(const Options &options, QObject *context,
+                               std::function<void()> finished)
+    : m_options(options), m_context(context), m_onFinished(std::move(finished)),
+      m_thread(QThread::currentThread()) {
+    setAutoDelete(false);
+}
+
+SessionRestore::~SessionRestore() {
+    m_cancel = true;
+    auto it = std::find(s_waiting.begin(), s_waiting.end(), this);
+    if (it != s_waiting.end()) {
+        s_waiting.erase(it);
+    } else if (m_started && !QThreadPool::globalInstance()->tryTake(this)) {
+        m_done.acquire();
+    } else if (m_counted) {
+        // Taken from the pool queue before it ran
+        s_foregroundRunning--;
+        startWaiting();
+    }
+    delete m_core;
+}
+
+void SessionRestore::schedule(SessionRestore *restore, bool visible) {
+    restore->m_started = true;
+    restore->m_foreground = visible;
+    if (visible) {
+        restore->startOnPool(true);
+    } else {
+        s_waiting.push_back(restore);
+        startWaiting();
+    }
+}
+
+void SessionRestore::promote() {
+    if (m_foreground || m_finished) {
+        return;
+    }
+    auto it = std::find(s_waiting.begin(), s_waiting.end(), this);
+    if (it != s_waiting.end()) {
+        s_waiting.erase(it);
+        m_foreground = true;
+        startOnPool(true);
+    } else {
+        // Already running, it only gets its priority back
+        m_foreground = true;
+    }
+}
+
+KodoTermCore *SessionRestore::takeCore() {
+    KodoTermCore *core = m_core;
+    m_core = nullptr;
+    return core;
+}
+
+void SessionRestore::run() {
+    QThread *thread = QThread::currentThread();
+    QThread::Priority priority = thread->priority();
+    const bool counted = m_counted;
+    thread->setPriority(m_foreground ? QThread::NormalPriority : QThread::LowPriority);
+
+    m_succeeded = !m_cancel && replay();
+    if (m_core) {
+        // Handed over to the thread that asked for the restore
+        m_core->moveToThread(m_thread);
+    }
+    m_finished = true;
+    thread->setPriority(priority);
+
+    QMetaObject::invokeMethod(
+        QCoreApplication::instance(),
+        [counted]() {
+            if (counted) {
+                s_foregroundRunning--;
+            }
+            startWaiting();
+        },
+        Qt::QueuedConnection);
+    if (!m_cancel && m_context) {
+        QMetaObject::invokeMethod(m_context, m_onFinished, Qt::QueuedConnection);
+    }
+    m_done.release();
+}
+
+bool SessionRestore::replay() {
+    // No PTY behind it, answers to queries in the log go nowhere
+    m_core = new KodoTermCore(m_options.rows, m_options.cols);
+    m_core->setMaxScrollback(m_options.maxScrollback);
+
+    QThread *thread = QThread::currentThread();
+    bool foreground = m_foreground;
+    bool ok = m_core->replayLog(m_options.logPath, m_options.checkpointPath, [&]() {
+        if (foreground != m_foreground) {
+            foreground = m_foreground;
+            thread->setPriority(QThread::NormalPriority);
+        }
+        return !m_cancel;
+    });
+    if (!ok || m_cancel) {
+        return false;
+    }
+    m_core->feed("\r\n");
+
+    // The new log starts where this restore ends
+    if (!m_options.newCheckpointPath.isEmpty()) {
+        m_checkpointWritten = m_core->saveState(m_options.newCheckpointPath);
+    }
+    return true;
+}
@@ -0,0 +1,73 @@
+// SPDX-License-Identifier: MIT
+// Author: Diego Iastrubni <diegoiast@gmail.com>
+
+#pragma once
+
+#include <QRunnable>
+#include <QSemaphore>
+#include <QString>
+#include <atomic>
+#include <functional>
+
+class KodoTermCore;
+class QObject;
+class QThread;
+
+// Rebuilds a terminal from its session log on a pool thread, into a KodoTermCore of its own,
+// so nothing touches the widget until it adopts the result.
+//
+// Restores are scheduled by visibility: those of visible terminals start right away, the
+// others wait until no visible one is running and then run at low priority, several at
+// once. A waiting restore jumps the queue once its terminal is shown.
+class SessionRestore : public QRunnable {
+  public:
+    struct Options {
+        QString logPath;
+        QString checkpointPath;    // checkpoint of the log being restored
+        QString newCheckpointPath; // written for the new log once the restore finished
+        int rows = 25;
+        int cols = 80;
+        int maxScrollback = 1000;
+    };
+
+    // finished runs on the thread of context
+    SessionRestore(const Options &options, QObject *context, std::function<void()> finished);
+    // Cancels the restore and waits for it to stop
+    ~SessionRestore();
+
+    static void schedule(SessionRestore *restore, bool visible);
+    void promote();
+
+    bool isFinished() const { return m_finished; }
+    bool succeeded() const { return m_succeeded; }
+    bool checkpointWritten() const { return m_checkpointWritten; }
+
+    // Ownership passes to the caller, the core already lives on the thread that created the
+    // restore
+    KodoTermCore *takeCore();
+
+    void run() override;
+
+  private:
+    static void startWaiting();
+    void startOnPool(bool foreground);
+    bool replay();
+
+    Options m_options;
+    QObject *m_context;
+    std::function<void()> m_onFinished;
+    QThread *m_thread;
+
+    KodoTermCore *m_core = nullptr;
+
+    // Only used on the GUI thread, m_counted is set before the pool runs it
+    bool m_started = false;
+    bool m_counted = false; // in s_foregroundRunning
+
+    std::atomic<bool> m_foreground{false};
+    std::atomic<bool> m_cancel{false};
+    std::atomic<bool> m_finished{false};
+    bool m_succeeded = false;
+    bool m_checkpointWritten = false;
+    QSemaphore m_done;
+};
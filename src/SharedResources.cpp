@@ -0,0 +1,63 @@
+// SPDX-License-Identifier: MIT
+// Author: Diego Iastrubni <diegoiast@gmail.com>
+
+#include "SharedResources.h"
+#include "GlyphCache.h"
+
+#include <QDataStream>
+#include <QFontMetrics>
+#include <QFontMetricsF>
+
+// Font::key() leaves out the style strategy, which decides antialiasing
+static QByteArray fontKey(const QFont &font) {
+    QByteArray key = font.key().toUtf8();
+    key += '|' + QByteArray::number((int)font.styleStrategy());
+    key += '|' + QByteArray::number((int)font.kerning());
+    return key;
+}
+
+std::shared_ptr<const ResolvedPalette> SharedResources::palette(const TerminalTheme &theme,
+                                                                const VTermState *state) {
+    static Registry<const ResolvedPalette> registry;
+    // Entries past the first 16 are fixed by libvterm, only the theme colors tell themes apart
+    QByteArray key;
+    QDataStream out(&key, QIODevice::WriteOnly);
+    out << theme.foreground.rgb() << theme.background.rgb();
+    for (const QColor &c : theme.palette) {
+        out << c.rgb();
+    }
+    return registry.acquire(key, [state]() {
+        auto palette = std::make_shared<ResolvedPalette>();
+        for (int i = 0; i < 256; ++i) {
+            VTermColor c;
+            vterm_color_indexed(&c, i);
+            vterm_state_convert_color_to_rgb(state, &c);
+            palette->colors[i] = qRgb(c.rgb.red, c.rgb.green, c.rgb.blue);
+        }
+        return std::shared_ptr<const ResolvedPalette>(std::move(palette));
+    });
+}
+
+std::shared_ptr<const FontMetrics> SharedResources::fontMetrics(const QFont &font) {
+    static Registry<const FontMetrics> registry;
+    return registry.acquire(fontKey(font), [&font]() {
+        auto metrics = std::make_shared<FontMetrics>();
+        QFontMetrics fm(font);
+        metrics->cellSize = QSize(fm.horizontalAdvance('W'), fm.height());
+        metrics->advance = QFontMetricsF(font).horizontalAdvance(QLatin1Char('W'));
+        return std::shared_ptr<const FontMetrics>(std::move(metrics));
+    });
+}
+
+std::shared_ptr<GlyphCache> SharedResources::glyphCache(const QFont &font, const QSize &cellSize,
+                                                        qreal dpr) {
+    static Registry<GlyphCache> registry;
+    QByteArray key = fontKey(font);
+    key += '|' + QByteArray::number(cellSize.width()) + 'x' +
+           QByteArray::number(cellSize.height()) + '@' + QByteArray::number(dpr);
+    return registry.acquire(key, [&]() {
+        auto cache = std::make_shared<GlyphCache>();
+        cache->setup(font, cellSize, dpr);
+        return cache;
+    });
+}
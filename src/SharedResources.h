@@ -0,0 +1,65 @@
+// SPDX-License-Identifier: MIT
+// Author: Diego Iastrubni <diegoiast@gmail.com>
+
+#pragma once
+
+#include "KodoTerm/KodoTermConfig.hpp"
+
+#include <vterm.h>
+
+#include <QByteArray>
+#include <QColor>
+#include <QFont>
+#include <QHash>
+#include <QMutex>
+#include <QSize>
+#include <memory>
+
+class GlyphCache;
+
+// Pixel values of all 256 palette entries under one theme
+struct ResolvedPalette {
+    QRgb colors[256];
+};
+
+struct FontMetrics {
+    QSize cellSize;
+    qreal advance = 0; // of 'W', fractional
+};
+
+// Process wide caches, shared by every terminal asking for the same font or theme. An entry
+// lives as long as some terminal holds on to it, so a new tab starts with whatever the tabs
+// already open have warmed up. Lookups are thread safe; the values are read only once made,
+// except for glyph caches which are only used for painting on the GUI thread.
+class SharedResources {
+  public:
+    // Colors are resolved through state, which must have the theme applied already
+    static std::shared_ptr<const ResolvedPalette> palette(const TerminalTheme &theme,
+                                                          const VTermState *state);
+    static std::shared_ptr<const FontMetrics> fontMetrics(const QFont &font);
+    static std::shared_ptr<GlyphCache> glyphCache(const QFont &font, const QSize &cellSize,
+                                                  qreal dpr);
+
+  private:
+    template <typename T> class Registry {
+      public:
+        template <typename Make>
+        std::shared_ptr<T> acquire(const QByteArray &key, const Make &make) {
+            QMutexLocker lock(&m_mutex);
+            std::shared_ptr<T> value = m_entries.value(key).lock();
+            if (!value) {
+                // Entries nobody holds any more only go away when the registry is touched
+                for (auto it = m_entries.begin(); it != m_entries.end();) {
+                    it = it->expired() ? m_entries.erase(it) : std::next(it);
+                }
+                value = make();
+                m_entries.insert(key, value);
+            }
+            return value;
+        }
+
+      private:
+        QMutex m_mutex;
+        QHash<QByteArray, std::weak_ptr<T>> m_entries;
+    };
+};
@@ -0,0 +1,131 @@
+// SPDX-License-Identifier: MIT
+// Author: Diego Iastrubni <diegoiast@gmail.com>
+
+#include "TerminalSnapshot.h"
+#include "TerminalState.h"
+
+#include <algorithm>
+#include <optional>
+
+// Code points collected before they go to the sink as one string
+static constexpr size_t TextChunkSize = 64 * 1024;
+
+TerminalSnapshot::TerminalSnapshot(ScrollbackSnapshot scrollback, std::vector<QByteArray> screen,
+                                   int cols, VTermPos cursor, QByteArray pen, bool altScreen)
+    : m_scrollback(std::move(scrollback)), m_screen(std::move(screen)), m_cols(cols),
+      m_cursor(cursor), m_pen(std::move(pen)), m_altScreen(altScreen) {}
+
+void TerminalSnapshot::readScreenRow(int row, int cols, VTermScreenCell *cells) const {
+    // A record of no columns decodes as blanks
+    static const QByteArray blank = ScrollbackBuffer::encodeLine(0, nullptr);
+    const QByteArray &record = row >= 0 && row < rows() ? m_screen[row] : blank;
+    ScrollbackBuffer::decodeLine(record.constData(), cols, cells);
+}
+
+bool TerminalSnapshot::writeText(VTermPos s, VTermPos e,
+                                 const std::function<bool(const QString &)> &sink) const {
+    if (s.row > e.row || (s.row == e.row && s.col > e.col)) {
+        std::swap(s, e);
+    }
+    // A buffer of our own over the pages the range covers, with its own inflate cache. It
+    // indexes only the lines of those rows, its row 0 is our row base.
+    const int sb = m_scrollback.rows();
+    const int last = std::min(e.row, sb + rows() - 1);
+    std::optional<ScrollbackBuffer> scrollback;
+    int base = 0;
+    if (s.row < sb) {
+        scrollback.emplace(m_scrollback.slice(std::max(0, s.row), std::min(last + 1, sb), &base));
+    }
+    std::vector<VTermScreenCell> cells;
+    std::vector<uint32_t> chars;
+    chars.reserve(TextChunkSize + (size_t)m_cols * VTERM_MAX_CHARS_PER_CELL + 1);
+    for (int r = std::max(0, s.row); r <= last; ++r) {
+        int width = m_cols;
+        if (r < sb) {
+            width = scrollback->rowColumns(r - base);
+            cells.resize(std::max(width, 1));
+            scrollback->readRow(r - base, width, cells.data());
+        } else {
+            cells.resize(std::max(width, 1));
+            readScreenRow(r - sb, width, cells.data());
+        }
+        const int sc = (r == s.row) ? s.col : 0;
+        const int ec = std::min((r == e.row) ? e.col + 1 : width, width);
+        const size_t start = chars.size();
+        // Erased cells are spaces when text follows them, as vterm_screen_get_chars() has it
+        int padding = 0;
+        for (int c = sc; c < ec; ++c) {
+            const VTermScreenCell &cell = cells[c];
+            if (cell.chars[0] == 0) {
+                padding++;
+            } else if (cell.chars[0] != (uint32_t)-1) {
+                chars.insert(chars.end(), padding, ' ');
+                padding = 0;
+                for (int i = 0; i < VTERM_MAX_CHARS_PER_CELL && cell.chars[i]; ++i) {
+                    chars.push_back(cell.chars[i]);
+                }
+            }
+        }
+        while (chars.size() > start && chars.back() == ' ') {
+            chars.pop_back();
+        }
+        if (r < e.row) {
+            chars.push_back('\n');
+        }
+        if (chars.size() >= TextChunkSize || r == last) {
+            if (!sink(QString::fromUcs4((const char32_t *)chars.data(), (qsizetype)chars.size()))) {
+                return false;
+            }
+            chars.clear();
+        }
+    }
+    return true;
+}
+
+void SnapshotCache::damage(int startRow, int endRow) {
+    startRow = std::max(startRow, 0);
+    endRow = std::min(endRow, (int)m_dirty.size());
+    for (int r = startRow; r < endRow; ++r) {
+        m_dirty[r] = true;
+    }
+}
+
+void SnapshotCache::update(VTerm *vt) {
+    int rows, cols;
+    vterm_get_size(vt, &rows, &cols);
+    if ((int)m_rows.size() != rows || m_cols != cols) {
+        m_rows.assign(rows, QByteArray());
+        m_dirty.assign(rows, true);
+        m_cols = cols;
+    }
+    VTermScreen *screen = vterm_obtain_screen(vt);
+    std::vector<VTermScreenCell> cells(cols);
+    for (int r = 0; r < rows; ++r) {
+        if (!m_dirty[r]) {
+            continue;
+        }
+        for (int c = 0; c < cols; ++c) {
+            vterm_screen_get_cell(screen, {r, c}, &cells[c]);
+        }
+        m_rows[r] = ScrollbackBuffer::encodeLine(cols, cells.data());
+        m_dirty[r] = false;
+    }
+}
+
+std::shared_ptr<const TerminalSnapshot>
+SnapshotCache::take(VTerm *vt, ScrollbackBuffer &scrollback, bool altScreen) {
+    update(vt);
+    VTermPos cursor;
+    vterm_state_get_cursorpos(vterm_obtain_state(vt), &cursor);
+    // The rows are implicitly shared, the snapshot holds on to them as they are now
+    return std::make_shared<TerminalSnapshot>(scrollback.snapshot(), m_rows, m_cols, cursor,
+                                              TerminalState::penSgr(vt), altScreen);
+}
+
+std::shared_ptr<const TerminalSnapshot> SnapshotCache::takeScreen(VTerm *vt, bool altScreen) {
+    update(vt);
+    VTermPos cursor;
+    vterm_state_get_cursorpos(vterm_obtain_state(vt), &cursor);
+    return std::make_shared<TerminalSnapshot>(ScrollbackSnapshot(), m_rows, m_cols, cursor,
+                                              TerminalState::penSgr(vt), altScreen);
+}
@@ -0,0 +1,71 @@
+// SPDX-License-Identifier: MIT
+// Author: Diego Iastrubni <diegoiast@gmail.com>
+
+#pragma once
+
+#include "Scrollback.h"
+
+#include <vterm.h>
+
+#include <QByteArray>
+#include <QString>
+#include <functional>
+#include <memory>
+#include <vector>
+
+// A terminal as it was at one point: its scrollback, its screen rows in the scrollback record
+// format and the cursor. Immutable, so it can be read on any thread while the terminal goes
+// on parsing. Rows count from the top of the scrollback and run on into the screen, like
+// KodoTermCore::fetchRow().
+class TerminalSnapshot {
+  public:
+    TerminalSnapshot(ScrollbackSnapshot scrollback, std::vector<QByteArray> screen, int cols,
+                     VTermPos cursor, QByteArray pen, bool altScreen);
+
+    int rows() const { return (int)m_screen.size(); }
+    int cols() const { return m_cols; }
+    VTermPos cursor() const { return m_cursor; }
+    // SGR sequence recreating the pen
+    const QByteArray &pen() const { return m_pen; }
+    bool altScreen() const { return m_altScreen; }
+    const ScrollbackSnapshot &scrollback() const { return m_scrollback; }
+
+    // Decodes screen row into cells[0, cols)
+    void readScreenRow(int row, int cols, VTermScreenCell *cells) const;
+    // The same row in the scrollback record format
+    const QByteArray &screenRecord(int row) const { return m_screen[row]; }
+    // Text between two cells, start and end included, handed to sink a chunk at a time.
+    // Stops early when sink returns false.
+    bool writeText(VTermPos start, VTermPos end,
+                   const std::function<bool(const QString &)> &sink) const;
+
+  private:
+    ScrollbackSnapshot m_scrollback;
+    std::vector<QByteArray> m_screen;
+    int m_cols;
+    VTermPos m_cursor;
+    QByteArray m_pen;
+    bool m_altScreen;
+};
+
+// Encoded screen rows of a VTerm, kept between snapshots. A row is encoded again only when
+// it was damaged since the previous snapshot, the others are shared with it. damage() is
+// cheap enough for the damage callbacks.
+class SnapshotCache {
+  public:
+    void damage(int startRow, int endRow);
+    // Everything is encoded again, for when the screen changed without damage
+    void invalidate() { m_rows.clear(); }
+    std::shared_ptr<const TerminalSnapshot> take(VTerm *vt, ScrollbackBuffer &scrollback,
+                                                 bool altScreen);
+    // The screen alone, its rows count from 0
+    std::shared_ptr<const TerminalSnapshot> takeScreen(VTerm *vt, bool altScreen);
+
+  private:
+    // Encodes the rows damaged since the last call
+    void update(VTerm *vt);
+
+    std::vector<QByteArray> m_rows;
+    std::vector<bool> m_dirty;
+    int m_cols = 0;
+};
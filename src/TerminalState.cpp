@@ -0,0 +1,337 @@
+// SPDX-License-Identifier: MIT
+// Author: Diego Iastrubni <diegoiast@gmail.com>
+
+#include "TerminalState.h"
+#include "Scrollback.h"
+#include "TerminalSnapshot.h"
+
+#include <QByteArray>
+#include <QDataStream>
+#include <QSaveFile>
+#include <QString>
+#include <algorithm>
+#include <cstring>
+
+static constexpr quint32 Magic = 0x4B4F444F; // "KODO"
+static constexpr quint32 Version = 6;
+
+// Cell record of the scrollback section in version 3 and 4 state files
+struct SavedCell {
+    uint32_t chars[VTERM_MAX_CHARS_PER_CELL];
+    VTermScreenCellAttrs attrs;
+    VTermColor fg, bg;
+    int width;
+};
+
+// Colors as written by version 2-4 state files
+static QDataStream &operator>>(QDataStream &in, VTermColor &c) {
+    quint8 t;
+    in >> t;
+    c.type = (VTermColorType)t;
+    if (c.type == VTERM_COLOR_RGB) {
+        in >> c.rgb.red >> c.rgb.green >> c.rgb.blue;
+    } else if (c.type == VTERM_COLOR_INDEXED) {
+        in >> c.indexed.idx;
+    }
+    return in;
+}
+
+// SGR sequence for the attributes and colors of cell, starting from a reset
+static void appendSgr(QByteArray &out, const VTermScreenCell &cell) {
+    const VTermScreenCellAttrs &a = cell.attrs;
+    out += "\033[0";
+    if (a.bold) {
+        out += ";1";
+    }
+    if (a.italic) {
+        out += ";3";
+    }
+    if (a.blink) {
+        out += ";5";
+    }
+    if (a.reverse) {
+        out += ";7";
+    }
+    if (a.conceal) {
+        out += ";8";
+    }
+    if (a.strike) {
+        out += ";9";
+    }
+    if (a.underline == VTERM_UNDERLINE_DOUBLE) {
+        out += ";21";
+    } else if (a.underline == VTERM_UNDERLINE_CURLY) {
+        out += ";4:3";
+    } else if (a.underline != VTERM_UNDERLINE_OFF) {
+        out += ";4";
+    }
+    if (a.font) {
+        out += ";" + QByteArray::number(10 + a.font);
+    }
+    if (a.baseline == VTERM_BASELINE_RAISE) {
+        out += ";73";
+    } else if (a.baseline == VTERM_BASELINE_LOWER) {
+        out += ";74";
+    }
+    auto color = [&](const VTermColor &c, int base) {
+        if (VTERM_COLOR_IS_DEFAULT_FG(&c) || VTERM_COLOR_IS_DEFAULT_BG(&c)) {
+            return;
+        }
+        if (VTERM_COLOR_IS_INDEXED(&c)) {
+            out += ";" + QByteArray::number(base + 8) + ";5;" + QByteArray::number(c.indexed.idx);
+        } else {
+            out += ";" + QByteArray::number(base + 8) + ";2;" + QByteArray::number(c.rgb.red) +
+                   ";" + QByteArray::number(c.rgb.green) + ";" + QByteArray::number(c.rgb.blue);
+        }
+    };
+    color(cell.fg, 30);
+    color(cell.bg, 40);
+    out += "m";
+}
+
+QByteArray TerminalState::penSgr(VTerm *vt) {
+    VTermState *state = vterm_obtain_state(vt);
+    VTermValue v;
+    VTermScreenCell pen;
+    memset(&pen, 0, sizeof(pen));
+    auto get = [&](VTermAttr attr) {
+        vterm_state_get_penattr(state, attr, &v);
+        return v;
+    };
+    pen.attrs.bold = get(VTERM_ATTR_BOLD).boolean;
+    pen.attrs.italic = get(VTERM_ATTR_ITALIC).boolean;
+    pen.attrs.blink = get(VTERM_ATTR_BLINK).boolean;
+    pen.attrs.reverse = get(VTERM_ATTR_REVERSE).boolean;
+    pen.attrs.conceal = get(VTERM_ATTR_CONCEAL).boolean;
+    pen.attrs.strike = get(VTERM_ATTR_STRIKE).boolean;
+    pen.attrs.underline = get(VTERM_ATTR_UNDERLINE).number;
+    pen.attrs.font = get(VTERM_ATTR_FONT).number;
+    pen.attrs.baseline = get(VTERM_ATTR_BASELINE).number;
+    pen.fg = get(VTERM_ATTR_FOREGROUND).color;
+    pen.bg = get(VTERM_ATTR_BACKGROUND).color;
+    QByteArray sgr;
+    appendSgr(sgr, pen);
+    return sgr;
+}
+
+static void readLegacyCell(QDataStream &in, VTermScreenCell &cell) {
+    memset(&cell, 0, sizeof(cell));
+    in.readRawData((char *)cell.chars, sizeof(cell.chars));
+    quint32 attrs, width;
+    in >> attrs;
+    memcpy(&cell.attrs, &attrs, std::min(sizeof(attrs), sizeof(cell.attrs)));
+    in >> cell.fg >> cell.bg >> width;
+    cell.width = width;
+}
+
+void TerminalState::write(QDataStream &out, const TerminalSnapshot &snapshot, qint64 logOffset) {
+    const VTermPos cursor = snapshot.cursor();
+    out << Magic << Version;
+    out << (quint32)cursor.row << (quint32)cursor.col;
+    out << (quint64)logOffset;
+    out << snapshot.pen();
+
+    out << (quint32)snapshot.rows() << (quint32)snapshot.cols();
+    for (int r = 0; r < snapshot.rows(); ++r) {
+        out << snapshot.screenRecord(r);
+    }
+    ScrollbackBuffer::writeSnapshot(out, snapshot.scrollback());
+}
+
+bool TerminalState::save(const QString &path, const TerminalSnapshot &snapshot, qint64 logOffset) {
+    QSaveFile f(path);
+    if (!f.open(QIODevice::WriteOnly)) {
+        return false;
+    }
+    QDataStream out(&f);
+    write(out, snapshot, logOffset);
+    return out.status() == QDataStream::Ok && f.commit();
+}
+
+bool TerminalState::read(QDataStream &in, VTerm *vt, ScrollbackBuffer &scrollback,
+                         qint64 *logOffset) {
+    quint32 magic, ver;
+    in >> magic >> ver;
+    if (in.status() != QDataStream::Ok || magic != Magic || ver > Version) {
+        return false;
+    }
+
+    quint32 cR = 0, cC = 0;
+    if (ver >= 2) {
+        in >> cR >> cC;
+    }
+    quint64 offset = 0;
+    QByteArray pen;
+    if (ver >= 4) {
+        in >> offset >> pen;
+    }
+    if (logOffset) {
+        *logOffset = (qint64)offset;
+    }
+
+    scrollback.clear();
+    quint32 rows = 0, cols = 0;
+    std::vector<VTermScreenCell> screen;
+    std::vector<VTermScreenCell> cells;
+    if (ver >= 5) {
+        in >> rows >> cols;
+        if (in.status() != QDataStream::Ok || rows > 0xFFFF || cols > 0xFFFF) {
+            return false;
+        }
+        screen.resize((size_t)rows * cols);
+        for (quint32 r = 0; r < rows; ++r) {
+            QByteArray record;
+            in >> record;
+            if (ScrollbackBuffer::recordSize(record.constData(), (size_t)record.size()) == 0) {
+                return false;
+            }
+            ScrollbackBuffer::decodeLine(record.constData(), cols, &screen[r * cols]);
+        }
+        if (!scrollback.readSnapshot(in, ver >= 6)) {
+            return false;
+        }
+    } else {
+        quint32 sbSize;
+        in >> sbSize;
+        std::vector<SavedCell> line;
+        for (quint32 i = 0; i < sbSize && in.status() == QDataStream::Ok; ++i) {
+            quint32 lineSize;
+            in >> lineSize;
+            cells.resize(lineSize);
+            if (ver >= 3) {
+                line.resize(lineSize);
+                if (lineSize > 0) {
+                    in.readRawData((char *)line.data(), lineSize * sizeof(SavedCell));
+                }
+                for (quint32 j = 0; j < lineSize; ++j) {
+                    memcpy(cells[j].chars, line[j].chars, sizeof(cells[j].chars));
+                    cells[j].attrs = line[j].attrs;
+                    cells[j].fg = line[j].fg;
+                    cells[j].bg = line[j].bg;
+                    cells[j].width = line[j].width;
+                }
+            } else {
+                for (quint32 j = 0; j < lineSize; ++j) {
+                    readLegacyCell(in, cells[j]);
+                }
+            }
+            scrollback.append(lineSize, cells.data());
+        }
+        in >> rows >> cols;
+        if (in.status() != QDataStream::Ok || rows > 0xFFFF || cols > 0xFFFF) {
+            return false;
+        }
+        screen.resize((size_t)rows * cols);
+        for (auto &cell : screen) {
+            readLegacyCell(in, cell);
+        }
+    }
+    QByteArray input = screenInput(vt, rows, cols, screen);
+    if (ver >= 2) {
+        input += "\033[" + QByteArray::number(cR + 1) + ";" + QByteArray::number(cC + 1) + "H";
+    }
+    input += pen.isEmpty() ? QByteArray("\033[0m") : pen;
+    vterm_input_write(vt, input.constData(), input.size());
+
+    return in.status() == QDataStream::Ok;
+}
+
+// Output that redraws saved cells on the screen of vt when written to it: a cursor position
+// and line size per row, SGR only where the pen changes, erased runs for blank cells and
+// text for the rest. Built as one block, so it is parsed in a single vterm_input_write().
+QByteArray TerminalState::screenInput(VTerm *vt, int rows, int cols,
+                                      const std::vector<VTermScreenCell> &cells) {
+    int vrows, vcols;
+    vterm_get_size(vt, &vrows, &vcols);
+    const int n = std::min(rows, vrows), w = std::min(cols, vcols);
+
+    auto samePen = [](const VTermScreenCell &a, const VTermScreenCell &b) {
+        return memcmp(&a.attrs, &b.attrs, sizeof(a.attrs)) == 0 &&
+               memcmp(&a.fg, &b.fg, sizeof(a.fg)) == 0 &&
+               memcmp(&a.bg, &b.bg, sizeof(a.bg)) == 0;
+    };
+    // Erasing keeps only the colors of the pen, cells with nothing else can be erased in runs
+    auto isBlank = [](const VTermScreenCell &c) {
+        VTermScreenCellAttrs plain;
+        memset(&plain, 0, sizeof(plain));
+        plain.dwl = c.attrs.dwl;
+        plain.dhl = c.attrs.dhl;
+        return c.chars[0] == 0 && c.width <= 1 &&
+               memcmp(&c.attrs, &plain, sizeof(plain)) == 0;
+    };
+    // Controls and invalid codepoints would be parsed rather than printed
+    auto printable = [](uint32_t ch) {
+        return ch >= 0x20 && ch != 0x7F && !(ch >= 0x80 && ch < 0xA0) && ch <= 0x10FFFF &&
+               !(ch >= 0xD800 && ch < 0xE000);
+    };
+    auto appendUtf8 = [](QByteArray &out, uint32_t ch) {
+        if (ch < 0x80) {
+            out += (char)ch;
+        } else if (ch < 0x800) {
+            out += (char)(0xC0 | (ch >> 6));
+            out += (char)(0x80 | (ch & 0x3F));
+        } else if (ch < 0x10000) {
+            out += (char)(0xE0 | (ch >> 12));
+            out += (char)(0x80 | ((ch >> 6) & 0x3F));
+            out += (char)(0x80 | (ch & 0x3F));
+        } else {
+            out += (char)(0xF0 | (ch >> 18));
+            out += (char)(0x80 | ((ch >> 12) & 0x3F));
+            out += (char)(0x80 | ((ch >> 6) & 0x3F));
+            out += (char)(0x80 | (ch & 0x3F));
+        }
+    };
+
+    QByteArray out;
+    out.reserve((qsizetype)n * (w + 16));
+    const VTermScreenCell *pen = nullptr;
+    for (int r = 0; r < n; ++r) {
+        const VTermScreenCell *row = &cells[(size_t)r * cols];
+        out += "\033[" + QByteArray::number(r + 1) + ";1H";
+        // DECDWL, DECDHL top and bottom, or DECSWL, for the erased cells of the row too
+        if (row[0].attrs.dwl) {
+            out += "\033#6";
+        } else if (row[0].attrs.dhl == 1) {
+            out += "\033#3";
+        } else if (row[0].attrs.dhl == 2) {
+            out += "\033#4";
+        } else {
+            out += "\033#5";
+        }
+        const int rw = row[0].attrs.dwl ? std::min(w, vcols / 2) : w;
+        for (int c = 0; c < rw;) {
+            const VTermScreenCell &cell = row[c];
+            if (!pen || !samePen(*pen, cell)) {
+                appendSgr(out, cell);
+                pen = &cell;
+            }
+            if (isBlank(cell)) {
+                int end = c + 1;
+                while (end < rw && isBlank(row[end]) && samePen(row[end], cell)) {
+                    end++;
+                }
+                // ECH leaves the cursor, move it absolutely so it cannot drift
+                out += "\033[" + QByteArray::number(end - c) + "X";
+                out += "\033[" + QByteArray::number(end + 1) + "G";
+                c = end;
+                continue;
+            }
+            const int width = std::max(1, cell.width);
+            if (width > rw - c) {
+                break;
+            }
+            if (printable(cell.chars[0])) {
+                appendUtf8(out, cell.chars[0]);
+                for (int i = 1; i < VTERM_MAX_CHARS_PER_CELL && cell.chars[i]; ++i) {
+                    if (printable(cell.chars[i])) {
+                        appendUtf8(out, cell.chars[i]);
+                    }
+                }
+            } else {
+                out.append(width, ' ');
+            }
+            c += width;
+        }
+    }
+    return out;
+}
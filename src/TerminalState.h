@@ -0,0 +1,38 @@
+// SPDX-License-Identifier: MIT
+// Author: Diego Iastrubni <diegoiast@gmail.com>
+
+#pragma once
+
+#include <vterm.h>
+
+#include <QtGlobal>
+#include <vector>
+
+class QByteArray;
+class QDataStream;
+class QString;
+class ScrollbackBuffer;
+class TerminalSnapshot;
+
+// Saved terminal contents, the format behind saveState(), session log checkpoints and
+// detached session restores. Written from a TerminalSnapshot, so it can run on any thread,
+// and read into a bare VTerm, so it can run away from the widget.
+//
+// Version 5 stores the screen and the scrollback pages in the scrollback record format, which
+// is independent of struct layout and byte order. Version 6 keeps compressed pages
+// compressed. Versions 2-5 can still be read.
+class TerminalState {
+  public:
+    static void write(QDataStream &out, const TerminalSnapshot &snapshot, qint64 logOffset);
+    // write() into a file replaced once complete
+    static bool save(const QString &path, const TerminalSnapshot &snapshot, qint64 logOffset);
+    // Replaces the scrollback, fills the screen of vt and positions the cursor
+    static bool read(QDataStream &in, VTerm *vt, ScrollbackBuffer &scrollback,
+                     qint64 *logOffset);
+    // SGR sequence recreating the current pen, written after restored screen contents
+    static QByteArray penSgr(VTerm *vt);
+
+  private:
+    static QByteArray screenInput(VTerm *vt, int rows, int cols,
+                                  const std::vector<VTermScreenCell> &cells);
+};
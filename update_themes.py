@@ -5,6 +5,8 @@ import subprocess
 import glob
 import re
 
+import generate_qrc
+
 def run_command(command, cwd=None):
     try:
         subprocess.check_call(command, shell=True, cwd=cwd)
@@ -93,31 +95,11 @@ def main():
         shutil.copy(f, dest_iterm)
         iterm_count += 1
         
-    # 3. Generate KodoTermThemes.qrc
-    print("Regenerating KodoTermThemes.qrc...")
-    qrc_path = os.path.join(base_dir, "KodoTermThemes.qrc")
-    
-    with open(qrc_path, "w") as f:
-        f.write('<!DOCTYPE RCC><RCC version="1.0">\n')
-        f.write('<qresource prefix="/">\n')
-        
-        # Konsole
-        for entry in sorted(os.listdir(dest_konsole)):
-            if entry.endswith(".colorscheme"):
-                f.write(f'    <file>KodoTermThemes/konsole/{entry}</file>\n')
-
-        # Windows Terminal
-        for entry in sorted(os.listdir(dest_wt)):
-            if entry.endswith(".json"):
-                f.write(f'    <file>KodoTermThemes/windowsterminal/{entry}</file>\n')
-
-        # iTerm
-        for entry in sorted(os.listdir(dest_iterm)):
-            if entry.endswith(".itermcolors"):
-                f.write(f'    <file>KodoTermThemes/iterm/{entry}</file>\n')
-
-        f.write('</qresource>\n')
-        f.write('</RCC>\n')
+    # 3. Generate the theme index and KodoTermThemes.qrc
+    print("Regenerating KodoTermThemes.json and KodoTermThemes.qrc...")
+    os.chdir(base_dir)
+    generate_qrc.generate_index(generate_qrc.INDEX_FILE, ["KodoTermThemes"])
+    generate_qrc.generate_qrc("KodoTermThemes.qrc", ["KodoTermThemes"])
 
     print("\n--- Theme Statistics ---")
     print(f"Konsole (KDE):          {konsole_count}")